@@ -18,6 +18,11 @@
 
 /*
  * Shared between the kernel and user spaces. This is 64-bit invariant.
+ *
+ * mount(2) does not pass the size of its data, so the kext copies in
+ * sizeof(struct fuse_mount_args) whatever the mount helper was built
+ * with. Any change to this structure must bump FUSE4X_VERSION, which
+ * mount_fuse4x compares with vfs.generic.fuse4x.version before mounting.
  */
 struct fuse_mount_args {
     char     mntpath[MAXPATHLEN]; // path to the mount point
@@ -31,6 +36,10 @@ struct fuse_mount_args {
     uint32_t fssubtype;           // file system sub type id (type is "fuse4x")
     uint32_t iosize;              // maximum size for reading or writing
     uint32_t rdev;                // dev_t for the /dev/fuse4xN in question
+    uint32_t statfs_timeout;      // seconds a statfs reply may be reused
+    uint32_t release_delay;       // seconds a closed handle is kept open
+    uint32_t release_budget;      // most handles kept open that way
+    uint32_t direct_io_depth;     // direct_io requests kept in flight per call
 };
 typedef struct fuse_mount_args fuse_mount_args;
 
@@ -72,6 +81,14 @@ enum {
     FUSE_MOPT_SPARSE              = 1ULL << 29,
     FUSE_MOPT_QUIET               = 1ULL << 30,
     FUSE_MOPT_LOCALVOL            = 1ULL << 31,
+    FUSE_MOPT_XATTR_CACHE         = 1ULL << 32,
+    FUSE_MOPT_STATFS_TIMEOUT      = 1ULL << 33,
+    FUSE_MOPT_STALE_ATTRCACHE     = 1ULL << 34,
+    FUSE_MOPT_RELEASE_DELAY       = 1ULL << 35,
+    FUSE_MOPT_RELEASE_BUDGET      = 1ULL << 36,
+    FUSE_MOPT_LAZY_OPEN           = 1ULL << 37,
+    FUSE_MOPT_DIRECT_IO_DEPTH     = 1ULL << 38,
+    FUSE_MOPT_HYBRID_IO           = 1ULL << 39,
 };
 
 #define FUSE_MINOR_MASK                 0x00FFFFFFUL
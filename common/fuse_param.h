@@ -38,6 +38,30 @@
  */
 #define FUSE4X_NDEVICES                   24
 
+/* File Control */
+
+/*
+ * Server-side copy. FUSE4XIOC_COPYRANGE, issued on a file open for writing,
+ * has the daemon copy length bytes at src_offset of the file open as src_fd
+ * (on the same volume) to dst_offset, without the data passing through the
+ * kernel. length comes back as the number of bytes copied. With
+ * FUSE_COPYRANGE_WHOLE the whole source is copied over the destination,
+ * which is then cut to the source size; the offsets and length are
+ * ignored. ENOTSUP means the daemon cannot do it and the caller has to
+ * copy by itself.
+ */
+struct fuse_copyrange_args {
+    int32_t  src_fd;
+    uint32_t flags;
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t length;
+};
+
+#define FUSE_COPYRANGE_WHOLE              0x1
+
+#define FUSE4XIOC_COPYRANGE               _IOWR('F', 1, struct fuse_copyrange_args)
+
 /*
  * This is the default block size of the virtual storage devices that are
  * implicitly implemented by the FUSE kernel extension. This can be changed
@@ -74,6 +98,37 @@
 #define FUSE_MIN_DAEMON_TIMEOUT                    0      /* s */
 #define FUSE_MAX_DAEMON_TIMEOUT                    600    /* s */
 
+/*
+ * How long a FUSE_STATFS reply is reused before it is refreshed in the
+ * background. Zero disables the cache, which is the default: like the
+ * other caches it is turned on per mount with the statfs_timeout option.
+ */
+#define FUSE_DEFAULT_STATFS_TIMEOUT                0      /* s */
+#define FUSE_MIN_STATFS_TIMEOUT                    0      /* s */
+#define FUSE_MAX_STATFS_TIMEOUT                    3600   /* s */
+
+/*
+ * How long a file handle nobody uses any more is kept open in case it is
+ * reopened, and how many such handles a mount keeps at most. Zero disables
+ * delayed release. These can be changed on a per-mount basis.
+ */
+#define FUSE_DEFAULT_RELEASE_DELAY                 0      /* s */
+#define FUSE_MIN_RELEASE_DELAY                     0      /* s */
+#define FUSE_MAX_RELEASE_DELAY                     60     /* s */
+
+#define FUSE_DEFAULT_RELEASE_BUDGET                256
+#define FUSE_MIN_RELEASE_BUDGET                    1
+#define FUSE_MAX_RELEASE_BUDGET                    65536
+
+/*
+ * How many READ or WRITE requests a single direct_io read(2) or write(2)
+ * keeps in flight. One issues them strictly one after another. This can be
+ * changed on a per-mount basis.
+ */
+#define FUSE_DEFAULT_DIRECT_IO_DEPTH               4
+#define FUSE_MIN_DIRECT_IO_DEPTH                   1
+#define FUSE_MAX_DIRECT_IO_DEPTH                   16
+
 
 #ifdef KERNEL
 
@@ -93,6 +148,33 @@
 
 #define FUSE_REASONABLE_XATTRSIZE          FUSE_MIN_USERKERNEL_BUFSIZE
 
+/* Largest extended attribute value (or name list) kept in the xattr cache. */
+#define FUSE_DEFAULT_XATTR_CACHE_MAX_SIZE  4096
+
+/*
+ * With stale_attrcache, expired attributes are still returned for this many
+ * seconds while a background FUSE_GETATTR refreshes them.
+ */
+#define FUSE_DEFAULT_ATTR_STALE_WINDOW     5      /* s */
+
+/* Buckets of the attribute staleness histogram: <10ms, <100ms, <1s, <10s. */
+#define FUSE_ATTR_STALE_BUCKETS            5
+
+/* Size of the READDIR batches kept by directory handles. */
+#define FUSE_READDIR_BUFSIZE               (16 * PAGE_SIZE)
+
+/* Memory all cached directory listings together may use. */
+#define FUSE_DEFAULT_DIRCACHE_MAX_SIZE     (8 * 1024 * 1024)
+
+/*
+ * With hybrid_io, sequential reads and writes at least this large (and
+ * reads of files at least this large) bypass the page cache.
+ */
+#define FUSE_DEFAULT_HYBRID_IO_MIN         (1024 * 1024)
+
+/* Most bytes one FUSE_COPY_FILE_RANGE asks for, to stay within the timeout. */
+#define FUSE_COPY_RANGE_CHUNK              (64 * 1024 * 1024)
+
 #endif /* KERNEL */
 
 #define FUSE_DEFAULT_USERKERNEL_BUFSIZE    FUSE_MAX_IOSIZE
@@ -19,7 +19,7 @@
 #define FUSE4X_BUNDLE_IDENTIFIER \
         FUSE4X_STRINGIFY(FUSE4X_BUNDLE_IDENTIFIER_LITERAL)
 
-#define FUSE4X_VERSION_LITERAL 0.10.0
+#define FUSE4X_VERSION_LITERAL 0.11.0
 #define FUSE4X_VERSION         FUSE4X_STRINGIFY(FUSE4X_VERSION_LITERAL)
 
 #endif /* _FUSE_VERSION_H_ */
@@ -109,11 +109,32 @@ extern lck_mtx_t *fuse_log_lock;
     lck_mtx_unlock((m));                                                                       \
     log("1: lck_mtx_unlock(%p): %s@%d by %d\n", (m), __FUNCTION__, __LINE__, proc_selfpid());  \
 }
+#define fuse_lck_rw_lock_shared(l)                                                                 \
+{                                                                                                  \
+    log("0: lck_rw_lock_shared(%p): %s@%d by %d\n", (l), __FUNCTION__, __LINE__, proc_selfpid());  \
+    lck_rw_lock_shared((l));                                                                       \
+    log("1: lck_rw_lock_shared(%p): %s@%d by %d\n", (l), __FUNCTION__, __LINE__, proc_selfpid());  \
+}
+#define fuse_lck_rw_lock_exclusive(l)                                                                 \
+{                                                                                                     \
+    log("0: lck_rw_lock_exclusive(%p): %s@%d by %d\n", (l), __FUNCTION__, __LINE__, proc_selfpid());  \
+    lck_rw_lock_exclusive((l));                                                                       \
+    log("1: lck_rw_lock_exclusive(%p): %s@%d by %d\n", (l), __FUNCTION__, __LINE__, proc_selfpid());  \
+}
+#define fuse_lck_rw_done(l)                                                                 \
+{                                                                                           \
+    log("0: lck_rw_done(%p): %s@%d by %d\n", (l), __FUNCTION__, __LINE__, proc_selfpid());  \
+    lck_rw_done((l));                                                                       \
+    log("1: lck_rw_done(%p): %s@%d by %d\n", (l), __FUNCTION__, __LINE__, proc_selfpid());  \
+}
 
 #else /* !FUSE4X_TRACE_LK */
 
 #define fuse_lck_mtx_lock(m)            lck_mtx_lock((m))
 #define fuse_lck_mtx_unlock(m)          lck_mtx_unlock((m))
+#define fuse_lck_rw_lock_shared(l)      lck_rw_lock_shared((l))
+#define fuse_lck_rw_lock_exclusive(l)   lck_rw_lock_exclusive((l))
+#define fuse_lck_rw_done(l)             (void)lck_rw_done((l))
 
 #endif /* FUSE4X_TRACE_LK */
 
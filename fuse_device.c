@@ -360,6 +360,15 @@ fuse_device_write(dev_t dev, uio_t uio, __unused int ioflag)
         return EINVAL;
     }
 
+    /* Unsolicited notifications carry their code in the error field. */
+    if (ohead.unique == 0) {
+        data = fdev->data;
+        if (!data || !data->inited || data->dead) {
+            return ENXIO;
+        }
+        return fuse_internal_notify(data, ohead.error, uio);
+    }
+
     if (uio_resid(uio) && ohead.error) {
         log("fuse4x: non-zero error for a message with a body\n");
         return EINVAL;
@@ -10,19 +10,69 @@
 #include "fuse_node.h"
 #include "fuse_sysctl.h"
 
+static uid_t
+fuse_filehandle_owner(vfs_context_t context)
+{
+    if (!context) {
+        context = vfs_context_current();
+    }
+
+    return kauth_cred_getuid(vfs_context_ucred(context));
+}
+
 /*
- * Because of the vagaries of how a filehandle can be used, we try not to
- * be too smart in here (we try to be smart elsewhere). It is required that
- * you come in here only if you really do not have the said filehandle--else
- * we panic.
- *
- * This function should be called with fufh_mtx mutex locked.
+ * Takes back a handle that was closed but not released yet, if it belongs
+ * to the same user. A handle parked for somebody else is released instead.
  */
-int
-fuse_filehandle_get(vnode_t       vp,
-                    vfs_context_t context,
-                    fufh_type_t   fufh_type,
-                    int           mode)
+static bool
+fuse_filehandle_reuse(vnode_t vp, vfs_context_t context,
+                      fufh_type_t fufh_type, uid_t owner)
+{
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_filehandle *fufh = &(VTOFUD(vp)->fufh[fufh_type]);
+    bool parked;
+
+    fuse_lck_mtx_lock(data->park_mtx);
+    parked = fufh->parked;
+    if (parked) {
+        TAILQ_REMOVE(&data->park_head, fufh, park_link);
+        data->park_count--;
+        fufh->parked = false;
+    }
+    fuse_lck_mtx_unlock(data->park_mtx);
+
+    if (!parked) {
+        return false;
+    }
+
+    if (fufh->owner != owner) {
+        (void)fuse_filehandle_put(vp, context, fufh_type);
+        return false;
+    }
+
+    /* The daemon did not vouch for the listing we may have cached. */
+    if (vnode_isdir(vp) && !(fufh->fuse_open_flags & FOPEN_KEEP_CACHE)) {
+        fuse_invalidate_dircache(vp);
+    }
+
+    fufh->open_count = 1;
+    OSIncrementAtomic((SInt32 *)&fuse_fh_unparked);
+
+    return true;
+}
+
+/*
+ * Asks the daemon for the handle; the caller sets its use count. A daemon
+ * that answered ENOSYS to FUSE_OPEN (FUSE_OPENDIR) keeps no per-open state:
+ * from then on its handles are made up locally, with fh_id 0, and are not
+ * released.
+ */
+static int
+fuse_filehandle_open(vnode_t       vp,
+                     vfs_context_t context,
+                     fufh_type_t   fufh_type,
+                     int           mode,
+                     uid_t         owner)
 {
     struct fuse_dispatcher  fdi;
     struct fuse_open_in    *foi;
@@ -33,18 +83,11 @@ fuse_filehandle_get(vnode_t       vp,
     int err    = 0;
     int oflags = 0;
     int op     = FUSE_OPEN;
-
-    fuse_trace_printf("fuse_filehandle_get(vp=%p, fufh_type=%d, mode=%x)\n",
-                      vp, fufh_type, mode);
+    uint64_t noimplbit = FSESS_NOIMPLBIT(OPEN);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
 
     fufh = &(fvdat->fufh[fufh_type]);
 
-    if (FUFH_IS_VALID(fufh)) {
-        panic("fuse4x: filehandle_get called despite valid fufh (type=%d)",
-              fufh_type);
-        /* NOTREACHED */
-    }
-
     /*
      * Note that this means we are effectively FILTERING OUT open() flags.
      */
@@ -52,12 +95,17 @@ fuse_filehandle_get(vnode_t       vp,
 
     if (vnode_isdir(vp)) {
         op = FUSE_OPENDIR;
+        noimplbit = FSESS_NOIMPLBIT(OPENDIR);
         if (fufh_type != FUFH_RDONLY) {
             log("fuse4x: non-rdonly fufh requested for directory\n");
             fufh_type = FUFH_RDONLY;
         }
     }
 
+    if (!fuse_implemented(data, noimplbit)) {
+        goto local;
+    }
+
     fuse_dispatcher_init(&fdi, sizeof(*foi));
     fuse_dispatcher_make_vp(&fdi, op, vp, context);
 
@@ -70,6 +118,11 @@ fuse_filehandle_get(vnode_t       vp,
 
     OSIncrementAtomic((SInt32 *)&fuse_fh_upcall_count);
     if ((err = fuse_dispatcher_wait_answer(&fdi))) {
+        if (err == ENOSYS) {
+            fuse_clear_implemented(data, noimplbit);
+            goto local;
+        }
+
         const char *vname = vnode_getname(vp);
         if (err == ENOENT) {
             /*
@@ -93,21 +146,184 @@ fuse_filehandle_get(vnode_t       vp,
 
     foo = fdi.answer;
 
+    /* The daemon did not vouch for the listing we may have cached. */
+    if (vnode_isdir(vp) && !(foo->open_flags & FOPEN_KEEP_CACHE)) {
+        fuse_invalidate_dircache(vp);
+    }
+
     fufh->fh_id = foo->fh;
-    fufh->open_count = 1;
     fufh->open_flags = oflags;
     fufh->fuse_open_flags = foo->open_flags;
+    fufh->owner = owner;
+    fufh->local = false;
 
     fuse_ticket_drop(fdi.ticket);
 
+    return 0;
+
+local:
+    if (vnode_isdir(vp)) {
+        fuse_invalidate_dircache(vp);
+    }
+
+    fufh->fh_id = 0;
+    fufh->open_flags = oflags;
+    fufh->fuse_open_flags = 0;
+    fufh->owner = owner;
+    fufh->local = true;
+
     return 0;
 }
 
+/*
+ * Because of the vagaries of how a filehandle can be used, we try not to
+ * be too smart in here (we try to be smart elsewhere). It is required that
+ * you come in here only if you really do not have the said filehandle--else
+ * we panic.
+ *
+ * This function should be called with fufh_mtx mutex locked.
+ */
 int
-fuse_filehandle_put(vnode_t vp, vfs_context_t context, fufh_type_t fufh_type)
+fuse_filehandle_get(vnode_t       vp,
+                    vfs_context_t context,
+                    fufh_type_t   fufh_type,
+                    int           mode)
+{
+    struct fuse_filehandle *fufh;
+    uid_t owner;
+    int err;
+
+    fuse_trace_printf("fuse_filehandle_get(vp=%p, fufh_type=%d, mode=%x)\n",
+                      vp, fufh_type, mode);
+
+    fufh = &(VTOFUD(vp)->fufh[fufh_type]);
+
+    if (FUFH_IS_VALID(fufh)) {
+        panic("fuse4x: filehandle_get called despite valid fufh (type=%d)",
+              fufh_type);
+        /* NOTREACHED */
+    }
+
+    owner = fuse_filehandle_owner(context);
+    if (fuse_filehandle_reuse(vp, context, fufh_type, owner)) {
+        return 0;
+    }
+
+    err = fuse_filehandle_open(vp, context, fufh_type, mode, owner);
+    if (!err) {
+        fufh->open_count = 1;
+    }
+
+    return err;
+}
+
+/*
+ * With lazy_open, open(2) of a regular file only sets up the handle here;
+ * FUSE_OPEN is sent by fuse_filehandle_realize() when the handle is first
+ * used for I/O. A handle closed before that costs the daemon nothing. The
+ * daemon opts into seeing open errors and open flags that late.
+ *
+ * This function should be called with fufh_mtx mutex locked.
+ */
+int
+fuse_filehandle_get_lazy(vnode_t       vp,
+                         vfs_context_t context,
+                         fufh_type_t   fufh_type,
+                         int           mode)
+{
+    struct fuse_filehandle *fufh = &(VTOFUD(vp)->fufh[fufh_type]);
+    uid_t owner;
+
+    if (!fuse_islazyopen_mp(vnode_mount(vp)) || !vnode_isreg(vp)) {
+        return fuse_filehandle_get(vp, context, fufh_type, mode);
+    }
+
+    if (FUFH_IS_VALID(fufh)) {
+        panic("fuse4x: filehandle_get_lazy called despite valid fufh (type=%d)",
+              fufh_type);
+        /* NOTREACHED */
+    }
+
+    owner = fuse_filehandle_owner(context);
+    if (fuse_filehandle_reuse(vp, context, fufh_type, owner)) {
+        return 0;
+    }
+
+    fufh->fh_id = 0;
+    fufh->open_count = 1;
+    fufh->open_flags = fuse_filehandle_xlate_to_oflags(fufh_type);
+    fufh->fuse_open_flags = 0;
+    fufh->owner = owner;
+    fufh->lazy = true;
+    fufh->unapplied = false;
+    fufh->local = false;
+
+    return 0;
+}
+
+/*
+ * Sends the FUSE_OPEN a lazily opened handle still owes the daemon. Open
+ * flags in the answer that open(2) would have acted on are left for
+ * fuse_internal_open_late(): pushing and dropping pages cannot be done
+ * with fufh_mtx held, nor from strategy.
+ *
+ * This function should be called with fufh_mtx mutex locked.
+ */
+int
+fuse_filehandle_realize(vnode_t vp, vfs_context_t context,
+                        fufh_type_t fufh_type)
+{
+    struct fuse_filehandle *fufh = &(VTOFUD(vp)->fufh[fufh_type]);
+    int err;
+
+    if (!fufh->lazy) {
+        return 0;
+    }
+
+    err = fuse_filehandle_open(vp, context, fufh_type, 0 /* mode */,
+                               fufh->owner);
+    if (!err) {
+        fufh->lazy = false;
+        fufh->unapplied = (fufh->fuse_open_flags &
+                           (FOPEN_DIRECT_IO | FOPEN_PURGE_UBC)) != 0;
+    }
+
+    return err;
+}
+
+static int
+fuse_filehandle_release_callback(struct fuse_ticket *ticket, __unused uio_t uio)
+{
+    fuse_ticket_drop(ticket);
+
+    return 0;
+}
+
+/*
+ * Nothing can be done about a failed release, so nobody waits for the
+ * answer. The message queue keeps the release ahead of a later FORGET.
+ */
+static void
+fuse_filehandle_release_send(mount_t mp, uint64_t nodeid, int op,
+                             uint64_t fh_id, int32_t flags,
+                             vfs_context_t context)
 {
     struct fuse_dispatcher  fdi;
     struct fuse_release_in *fri;
+
+    fuse_dispatcher_init(&fdi, sizeof(*fri));
+    fuse_dispatcher_make(&fdi, op, mp, nodeid, context);
+    fri = fdi.indata;
+    fri->fh = fh_id;
+    fri->flags = flags;
+
+    fuse_insert_callback(fdi.ticket, fuse_filehandle_release_callback);
+    fuse_insert_message(fdi.ticket);
+}
+
+int
+fuse_filehandle_put(vnode_t vp, vfs_context_t context, fufh_type_t fufh_type)
+{
     struct fuse_vnode_data *fvdat = VTOFUD(vp);
     struct fuse_filehandle *fufh  = NULL;
 
@@ -122,25 +338,226 @@ fuse_filehandle_put(vnode_t vp, vfs_context_t context, fufh_type_t fufh_type)
         /* NOTREACHED */
     }
 
-    if (fuse_isdeadfs(vp)) {
-        goto out;
+    /* Never used: the daemon does not know about it. */
+    if (fufh->lazy) {
+        fufh->lazy = false;
+        OSIncrementAtomic((SInt32 *)&fuse_fh_opens_avoided);
+        return 0;
     }
 
-    int op = vnode_isdir(vp) ? FUSE_RELEASEDIR : FUSE_RELEASE;
-    fuse_dispatcher_init(&fdi, sizeof(*fri));
-    fuse_dispatcher_make_vp(&fdi, op, vp, context);
-    fri = fdi.indata;
-    fri->fh = fufh->fh_id;
-    fri->flags = fufh->open_flags;
+    /* A made-up OPENDIR handle gets a listing too. */
+    if (fufh->dirbuf) {
+        fuse_dirbuf_free(fufh->dirbuf);
+        fufh->dirbuf = NULL;
+    }
 
-    int err = fuse_dispatcher_wait_answer(&fdi);
-    if (!err) {
-        fuse_ticket_drop(fdi.ticket);
+    if (fufh->local) {
+        goto done;
     }
 
+    if (fuse_isdeadfs(vp)) {
+        goto out;
+    }
+
+    fuse_filehandle_release_send(vnode_mount(vp), VTOI(vp),
+                                 vnode_isdir(vp) ? FUSE_RELEASEDIR : FUSE_RELEASE,
+                                 fufh->fh_id, fufh->open_flags, context);
+
 out:
     OSDecrementAtomic((SInt32 *)&fuse_fh_current);
+
+done:
     fuse_invalidate_attr(vp);
 
-    return err;
+    return 0;
+}
+
+/*
+ * Handles the daemon would have to reopen right away are not released when
+ * their last user is done with them. They are parked for release_delay
+ * seconds instead, and fuse_filehandle_get() takes them back without an
+ * upcall. A per-mount reaper thread releases the ones nobody wanted; it
+ * runs while there are parked handles. No more than release_budget handles
+ * are parked on a mount at a time.
+ */
+static void
+fuse_filehandle_reaper(void *param, __unused wait_result_t wr)
+{
+    struct fuse_data *data = param;
+    struct fuse_filehandle *fufh;
+    struct timespec uptsp;
+    struct timespec ts;
+    uint64_t nodeid;
+    uint64_t fh_id;
+    int32_t flags;
+    int op;
+
+    fuse_lck_mtx_lock(data->park_mtx);
+    while ((fufh = TAILQ_FIRST(&data->park_head))) {
+        nanouptime(&uptsp);
+        if (!data->dead && fuse_timespec_cmp(&uptsp, &fufh->park_expire, <)) {
+            ts.tv_sec = fufh->park_expire.tv_sec - uptsp.tv_sec;
+            ts.tv_nsec = fufh->park_expire.tv_nsec - uptsp.tv_nsec;
+            if (ts.tv_nsec < 0) {
+                ts.tv_sec--;
+                ts.tv_nsec += 1000000000;
+            }
+            (void)fuse_msleep(&data->park_head, data->park_mtx, PINOD,
+                              "fu_park", &ts);
+            continue;
+        }
+
+        /*
+         * Reclaim waits for releasing to clear, so the release is queued
+         * ahead of the vnode's FORGET.
+         */
+        TAILQ_REMOVE(&data->park_head, fufh, park_link);
+        data->park_count--;
+        fufh->parked = false;
+        fufh->releasing = true;
+
+        nodeid = VTOI(fufh->park_vp);
+        op = vnode_isdir(fufh->park_vp) ? FUSE_RELEASEDIR : FUSE_RELEASE;
+        fh_id = fufh->fh_id;
+        flags = fufh->open_flags;
+        fuse_lck_mtx_unlock(data->park_mtx);
+
+        if (!data->dead) {
+            fuse_filehandle_release_send(data->mp, nodeid, op, fh_id, flags,
+                                         NULL);
+        }
+        OSDecrementAtomic((SInt32 *)&fuse_fh_current);
+
+        fuse_lck_mtx_lock(data->park_mtx);
+        fufh->releasing = false;
+        fuse_wakeup(fufh);
+    }
+    data->reaper_running = false;
+    fuse_wakeup(&data->reaper_running);
+    fuse_lck_mtx_unlock(data->park_mtx);
+
+    thread_terminate(current_thread());
+}
+
+/*
+ * Called instead of fuse_filehandle_put() when the last user of a handle is
+ * done with it. Should be called with fufh_mtx mutex locked.
+ */
+int
+fuse_filehandle_park(vnode_t vp, vfs_context_t context, fufh_type_t fufh_type)
+{
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_filehandle *fufh = &(VTOFUD(vp)->fufh[fufh_type]);
+    struct timespec uptsp;
+    thread_t thread;
+    bool start = false;
+
+    if ((data->release_delay.tv_sec == 0) || fufh->lazy || fufh->local ||
+        fuse_isdeadfs(vp) || !(vnode_isreg(vp) || vnode_isdir(vp))) {
+        return fuse_filehandle_put(vp, context, fufh_type);
+    }
+
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(data->park_mtx);
+    if (data->park_count >= data->release_budget) {
+        fuse_lck_mtx_unlock(data->park_mtx);
+        return fuse_filehandle_put(vp, context, fufh_type);
+    }
+
+    fufh->parked = true;
+    fufh->park_vp = vp;
+    fufh->park_expire = data->release_delay;
+    fuse_timespec_add(&fufh->park_expire, &uptsp);
+    TAILQ_INSERT_TAIL(&data->park_head, fufh, park_link);
+    data->park_count++;
+
+    if (!data->reaper_running) {
+        data->reaper_running = true;
+        start = true;
+    }
+    fuse_lck_mtx_unlock(data->park_mtx);
+
+    if (fufh->dirbuf) {
+        fuse_dirbuf_free(fufh->dirbuf);
+        fufh->dirbuf = NULL;
+    }
+
+    fuse_invalidate_attr(vp);
+
+    if (start) {
+        if (kernel_thread_start(fuse_filehandle_reaper, data,
+                                &thread) != KERN_SUCCESS) {
+            /* The next park tries again; reclaim releases it otherwise. */
+            log("fuse4x: cannot start the filehandle reaper\n");
+            fuse_lck_mtx_lock(data->park_mtx);
+            data->reaper_running = false;
+            fuse_lck_mtx_unlock(data->park_mtx);
+        } else {
+            thread_deallocate(thread);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Releases the parked handles of a vnode right away, e.g. before it is
+ * removed or reclaimed. Should be called with fufh_mtx mutex locked, or
+ * from reclaim.
+ */
+void
+fuse_filehandle_unpark(vnode_t vp, vfs_context_t context)
+{
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_filehandle *fufh;
+    bool parked;
+    int type;
+
+    for (type = 0; type < FUFH_MAXTYPE; type++) {
+        fufh = &(fvdat->fufh[type]);
+
+        fuse_lck_mtx_lock(data->park_mtx);
+        while (fufh->releasing) {
+            (void)fuse_msleep(fufh, data->park_mtx, PINOD, "fu_unpk", NULL);
+        }
+        parked = fufh->parked;
+        if (parked) {
+            TAILQ_REMOVE(&data->park_head, fufh, park_link);
+            data->park_count--;
+            fufh->parked = false;
+            fuse_wakeup(&data->park_head);
+        }
+        fuse_lck_mtx_unlock(data->park_mtx);
+
+        if (parked) {
+            (void)fuse_filehandle_put(vp, context, type);
+        }
+    }
+}
+
+/* Waits for the reaper to exit. */
+void
+fuse_filehandle_reaper_drain(struct fuse_data *data)
+{
+    fuse_lck_mtx_lock(data->park_mtx);
+    while (data->reaper_running) {
+        fuse_wakeup(&data->park_head);
+        (void)fuse_msleep(&data->reaper_running, data->park_mtx, PINOD,
+                          "fu_reap", NULL);
+    }
+    fuse_lck_mtx_unlock(data->park_mtx);
+}
+
+void
+fuse_dirbuf_free(struct fuse_dirbuf *dirbuf)
+{
+    if (dirbuf->fill) {
+        fuse_dircache_release(dirbuf->fill);
+    }
+    if (dirbuf->data) {
+        FUSE_OSFree(dirbuf->data, dirbuf->allocsize, fuse_malloc_tag);
+    }
+    FUSE_OSFree(dirbuf, sizeof(struct fuse_dirbuf), fuse_malloc_tag);
 }
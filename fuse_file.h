@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/queue.h>
 #include <sys/types.h>
 #include <sys/vnode.h>
 
@@ -21,11 +22,44 @@ typedef enum fufh_type {
     FUFH_MAXTYPE = 3,
 } fufh_type_t;
 
+/*
+ * Last READDIR(PLUS) reply of a directory handle, with the directory offset
+ * of its first entry.
+ */
+struct fuse_dircache;
+
+struct fuse_dirbuf {
+    void   *data;
+    size_t  allocsize;
+    size_t  len;
+    off_t   offset;
+    bool    plus;
+
+    /* directory cache listing being built from the replies, if any */
+    struct fuse_dircache *fill;
+    uint32_t              fill_gen;
+    off_t                 fill_next;
+};
+
+void fuse_dirbuf_free(struct fuse_dirbuf *dirbuf);
+
 struct fuse_filehandle {
     uint64_t fh_id;
     int32_t  open_count; // usage_count is a better name?
     int32_t  open_flags;
     int32_t  fuse_open_flags;
+    struct fuse_dirbuf *dirbuf; // directories only, protected by fufh_mtx
+    uid_t    owner;      // user the daemon opened the handle for
+    bool     lazy;       // FUSE_OPEN not sent yet, protected by fufh_mtx
+    bool     unapplied;  // late open flags not acted on, protected by fufh_mtx
+    bool     local;      // made up after OPEN(DIR) returned ENOSYS
+
+    /* delayed release, protected by the mount's park_mtx */
+    bool     parked;     // closed, but not released to the daemon yet
+    bool     releasing;  // being released by the reaper
+    vnode_t  park_vp;
+    struct timespec park_expire;
+    TAILQ_ENTRY(fuse_filehandle) park_link;
 };
 typedef struct fuse_filehandle * fuse_filehandle_t;
 
@@ -159,7 +193,21 @@ out:
 int fuse_filehandle_get(vnode_t vp, vfs_context_t context,
                         fufh_type_t fufh_type, int mode);
 
+int fuse_filehandle_get_lazy(vnode_t vp, vfs_context_t context,
+                             fufh_type_t fufh_type, int mode);
+
+int fuse_filehandle_realize(vnode_t vp, vfs_context_t context,
+                            fufh_type_t fufh_type);
+
 int fuse_filehandle_put(vnode_t vp, vfs_context_t context,
                         fufh_type_t fufh_type);
 
+int fuse_filehandle_park(vnode_t vp, vfs_context_t context,
+                         fufh_type_t fufh_type);
+
+void fuse_filehandle_unpark(vnode_t vp, vfs_context_t context);
+
+struct fuse_data;
+void fuse_filehandle_reaper_drain(struct fuse_data *data);
+
 #endif /* _FUSE_FILE_H_ */
@@ -18,10 +18,12 @@
 #include <libkern/OSMalloc.h>
 #include <libkern/locks.h>
 #include <mach/mach_types.h>
+#include <sys/attr.h>
 #include <sys/dirent.h>
 #include <sys/disk.h>
 #include <sys/errno.h>
 #include <sys/fcntl.h>
+#include <sys/file.h>
 #include <sys/kernel_types.h>
 #include <sys/mount.h>
 #include <sys/proc.h>
@@ -42,6 +44,107 @@
 
 /* access */
 
+/*
+ * Fills in the identity part of an access cache key. Returns false if the
+ * caller's group list does not fit, in which case nothing is cached.
+ */
+static bool
+fuse_internal_access_key(kauth_cred_t cred, uint32_t mask,
+                         struct fuse_access_entry *key)
+{
+#ifdef MAC_OS_X_VERSION_10_7
+    posix_cred_t pcred = &(cred->cr_posix);
+#else
+    kauth_cred_t pcred = cred;
+#endif
+
+    if ((pcred->cr_ngroups < 0) || (pcred->cr_ngroups > NGROUPS)) {
+        return false;
+    }
+
+    key->uid = kauth_cred_getuid(cred);
+    key->ngroups = pcred->cr_ngroups;
+    memcpy(key->groups, pcred->cr_groups, key->ngroups * sizeof(gid_t));
+    key->mask = mask;
+
+    return true;
+}
+
+static __inline__
+bool
+fuse_internal_access_match(struct fuse_access_entry *entry,
+                           struct fuse_access_entry *key)
+{
+    return (entry->uid == key->uid) && (entry->mask == key->mask) &&
+           (entry->ngroups == key->ngroups) &&
+           !memcmp(entry->groups, key->groups, key->ngroups * sizeof(gid_t));
+}
+
+/* Also returns the cache generation to hand to the enter that follows. */
+static bool
+fuse_internal_access_cache_lookup(struct fuse_vnode_data   *fvdat,
+                                  struct fuse_access_entry *key,
+                                  int *err, uint32_t *gen)
+{
+    struct timespec uptsp;
+    bool found = false;
+
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    for (int i = 0; i < FUSE_ACCESS_CACHE_SIZE; i++) {
+        struct fuse_access_entry *entry = &fvdat->access_cache[i];
+
+        if (fuse_internal_access_match(entry, key) &&
+            fuse_timespec_cmp(&uptsp, &entry->expires, <=)) {
+            *err = entry->err;
+            found = true;
+            break;
+        }
+    }
+    *gen = fvdat->access_cache_gen;
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    return found;
+}
+
+static void
+fuse_internal_access_cache_enter(struct fuse_vnode_data   *fvdat,
+                                 struct fuse_access_entry *key,
+                                 int err, uint32_t gen)
+{
+    struct fuse_access_entry *entry = NULL;
+    struct timespec uptsp;
+
+    /*
+     * The daemon controls how long a decision may be reused through the
+     * attribute timeout: once the attributes expire the mode, owner or ACL
+     * might have changed behind our back. An answer to a request sent
+     * before the last invalidation (chmod, chown, ...) is not kept.
+     */
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    if ((gen == fvdat->access_cache_gen) &&
+        fuse_timespec_cmp(&uptsp, &fvdat->attr_valid, <)) {
+        for (int i = 0; i < FUSE_ACCESS_CACHE_SIZE; i++) {
+            if (fuse_internal_access_match(&fvdat->access_cache[i], key)) {
+                entry = &fvdat->access_cache[i];
+                break;
+            }
+        }
+        if (!entry) {
+            entry = &fvdat->access_cache[fvdat->access_cache_next];
+            fvdat->access_cache_next =
+                (fvdat->access_cache_next + 1) % FUSE_ACCESS_CACHE_SIZE;
+        }
+        *entry = *key;
+        entry->err = err;
+        entry->expires = fvdat->attr_valid;
+    }
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+}
+
 __private_extern__
 int
 fuse_internal_access(vnode_t                   vp,
@@ -55,6 +158,9 @@ fuse_internal_access(vnode_t                   vp,
     struct fuse_dispatcher fdi;
     struct fuse_access_in *fai;
     struct fuse_data      *data;
+    struct fuse_access_entry key;
+    bool cacheable;
+    uint32_t gen = 0;
 
     fuse_trace_printf_func();
 
@@ -112,6 +218,16 @@ fuse_internal_access(vnode_t                   vp,
         mask |= W_OK;
     }
 
+    cacheable = fuse_internal_access_key(vfs_context_ucred(context), mask,
+                                         &key);
+
+    if (cacheable &&
+        fuse_internal_access_cache_lookup(VTOFUD(vp), &key, &err, &gen)) {
+        OSIncrementAtomic((SInt32 *)&fuse_access_cache_hits);
+        return err;
+    }
+    OSIncrementAtomic((SInt32 *)&fuse_access_cache_misses);
+
     bzero(&fdi, sizeof(fdi));
 
     fuse_dispatcher_init(&fdi, sizeof(*fai));
@@ -125,6 +241,10 @@ fuse_internal_access(vnode_t                   vp,
         fuse_ticket_drop(fdi.ticket);
     }
 
+    if (cacheable && (err == 0 || err == EACCES || err == EPERM)) {
+        fuse_internal_access_cache_enter(VTOFUD(vp), &key, err, gen);
+    }
+
     if (err == ENOSYS) {
         /*
          * Make sure we don't come in here again.
@@ -150,580 +270,3053 @@ fuse_internal_access(vnode_t                   vp,
     return err;
 }
 
-#ifdef FUSE4X_ENABLE_EXCHANGE
+/* copy */
 
-/* exchange */
+/* Finds an open handle of vp for reading or writing and realizes it. */
+static int
+fuse_internal_copy_fufh(vnode_t                  vp,
+                        bool                     write,
+                        vfs_context_t            context,
+                        struct fuse_filehandle **fufhp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_filehandle *fufh;
+
+    fufh_type_t fufh_type = write ? FUFH_WRONLY : FUFH_RDONLY;
+    int err;
 
+    fufh = &(fvdat->fufh[fufh_type]);
+    if (!FUFH_IS_VALID(fufh)) {
+        fufh_type = FUFH_RDWR;
+        fufh = &(fvdat->fufh[fufh_type]);
+        if (!FUFH_IS_VALID(fufh)) {
+            return EBADF;
+        }
+    }
+
+    fuse_lck_mtx_lock(fvdat->fufh_mtx);
+    err = fuse_filehandle_realize(vp, context, fufh_type);
+    fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+
+    *fufhp = fufh;
+
+    return err;
+}
+
+/*
+ * FUSE4XIOC_COPYRANGE on vp: the daemon copies the data with
+ * FUSE_COPY_FILE_RANGE. Dirty pages of the source range are pushed out
+ * first; the destination range is dropped from the cache around the copy,
+ * which runs with the truncate lock of vp held exclusive and that of the
+ * source shared. With FUSE_COPYRANGE_WHOLE the destination is truncated to
+ * the source size after the copy.
+ */
 __private_extern__
 int
-fuse_internal_exchange(vnode_t       fvp,
-                       const char   *fname,
-                       size_t        flen,
-                       vnode_t       tvp,
-                       const char   *tname,
-                       size_t        tlen,
-                       int           options,
-                       vfs_context_t context)
+fuse_internal_copy_range(vnode_t                     vp,
+                         struct fuse_copyrange_args *args,
+                         int                         fflag,
+                         vfs_context_t               context)
 {
-    struct fuse_dispatcher fdi;
-    struct fuse_exchange_in *fei;
-    struct fuse_vnode_data *ffud = VTOFUD(fvp);
-    struct fuse_vnode_data *tfud = VTOFUD(tvp);
-    vnode_t fdvp = ffud->parentvp;
-    vnode_t tdvp = tfud->parentvp;
-    int err = 0;
+    struct fuse_vnode_data         *fvdat = VTOFUD(vp);
+    struct fuse_vnode_data         *sfvdat;
+    struct fuse_data               *data  = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_filehandle         *sfufh;
+    struct fuse_filehandle         *dfufh;
+    struct fuse_dispatcher          fdi;
+    struct fuse_copy_file_range_in *fcfri;
+
+    vnode_t  svp = NULLVP;
+    int      sflags;
+    off_t    soff;
+    off_t    doff;
+    off_t    left;
+    off_t    copied = 0;
+    uint64_t chunk;
+    uint32_t done;
+    bool     whole = (args->flags & FUSE_COPYRANGE_WHOLE);
+    int      err;
+
+    if (!fuse_implemented(data, FSESS_NOIMPLBIT(COPY_FILE_RANGE))) {
+        return ENOTSUP;
+    }
 
-    fuse_dispatcher_init(&fdi, sizeof(*fei) + flen + tlen + 2);
-    fuse_dispatcher_make_vp(&fdi, FUSE_EXCHANGE, fvp, context);
+    if (!(fflag & FWRITE)) {
+        return EBADF;
+    }
 
-    fei = fdi.indata;
-    fei->olddir = VTOI(fdvp);
-    fei->newdir = VTOI(tdvp);
-    fei->options = (uint64_t)options;
+    if (!vnode_isreg(vp)) {
+        return EINVAL;
+    }
 
-    memcpy((char *)fdi.indata + sizeof(*fei), fname, flen);
-    ((char *)fdi.indata)[sizeof(*fei) + flen] = '\0';
+    if (vnode_vfsisrdonly(vp)) {
+        return EROFS;
+    }
 
-    memcpy((char *)fdi.indata + sizeof(*fei) + flen + 1, tname, tlen);
-    ((char *)fdi.indata)[sizeof(*fei) + flen + tlen + 1] = '\0';
+    if ((err = file_flags(args->src_fd, &sflags))) {
+        return err;
+    }
 
-    ubc_msync(fvp, (off_t)0, (off_t)ffud->filesize, NULL,
-              UBC_PUSHALL | UBC_INVALIDATE | UBC_SYNC);
-    ubc_msync(tvp, (off_t)0, (off_t)tfud->filesize, NULL,
-              UBC_PUSHALL | UBC_INVALIDATE | UBC_SYNC);
+    if (!(sflags & FREAD)) {
+        return EBADF;
+    }
 
-    if (!(err = fuse_dispatcher_wait_answer(&fdi))) {
-        fuse_ticket_drop(fdi.ticket);
+    if ((err = file_vnode(args->src_fd, &svp))) {
+        return err;
     }
 
-    if (err == 0) {
-        if (fdvp) {
-            fuse_invalidate_attr(fdvp);
+    if ((err = vnode_getwithref(svp))) {
+        file_drop(args->src_fd);
+        return err;
+    }
+
+    if (vnode_mount(svp) != vnode_mount(vp)) {
+        err = EXDEV;
+        goto out;
+    }
+
+    if (!vnode_isreg(svp)) {
+        err = EINVAL;
+        goto out;
+    }
+
+    sfvdat = VTOFUD(svp);
+
+    if (whole) {
+        args->src_offset = 0;
+        args->dst_offset = 0;
+        args->length = sfvdat->filesize;
+
+        if (svp == vp) {
+            /* A file is a copy of itself already. */
+            goto out;
         }
-        if (tdvp != fdvp) {
-            if (tdvp) {
-                fuse_invalidate_attr(tdvp);
-            }
+    }
+
+    soff = (off_t)args->src_offset;
+    doff = (off_t)args->dst_offset;
+    left = (off_t)args->length;
+
+    if ((soff < 0) || (doff < 0) || (left < 0) ||
+        (left > OFF_MAX - ((soff > doff) ? soff : doff))) {
+        err = EINVAL;
+        goto out;
+    }
+
+    /* As with copy_file_range(2), a file is not copied onto itself. */
+    if ((svp == vp) && (soff < doff + left) && (doff < soff + left)) {
+        err = EINVAL;
+        goto out;
+    }
+
+    if ((err = fuse_internal_copy_fufh(svp, false, context, &sfufh)) ||
+        (err = fuse_internal_copy_fufh(vp, true, context, &dfufh))) {
+        goto out;
+    }
+
+    /*
+     * The source must not be truncated under the copy either. Both locks
+     * are taken in address order, as for exchange.
+     */
+    if (svp == vp) {
+        fuse_lck_rw_lock_exclusive(fvdat->truncatelock);
+    } else if (sfvdat < fvdat) {
+        fuse_lck_rw_lock_shared(sfvdat->truncatelock);
+        fuse_lck_rw_lock_exclusive(fvdat->truncatelock);
+    } else {
+        fuse_lck_rw_lock_exclusive(fvdat->truncatelock);
+        fuse_lck_rw_lock_shared(sfvdat->truncatelock);
+    }
+
+    if (ubc_pages_resident(svp)) {
+        (void)ubc_msync(svp, soff, soff + left, NULL, UBC_PUSHDIRTY | UBC_SYNC);
+    }
+
+    fuse_invalidate_extents(vp);
+    if (ubc_pages_resident(vp)) {
+        (void)ubc_msync(vp, doff, doff + left, NULL,
+                        UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
+    }
+
+    while (copied < left) {
+        chunk = (uint64_t)(left - copied);
+        if (chunk > FUSE_COPY_RANGE_CHUNK) {
+            chunk = FUSE_COPY_RANGE_CHUNK;
         }
 
-        fuse_invalidate_attr(fvp);
-        fuse_invalidate_attr(tvp);
+        fuse_dispatcher_init(&fdi, sizeof(*fcfri));
+        fuse_dispatcher_make_vp(&fdi, FUSE_COPY_FILE_RANGE, svp, context);
+        fcfri = fdi.indata;
+        fcfri->fh_in = sfufh->fh_id;
+        fcfri->off_in = soff + copied;
+        fcfri->nodeid_out = VTOI(vp);
+        fcfri->fh_out = dfufh->fh_id;
+        fcfri->off_out = doff + copied;
+        fcfri->len = chunk;
+        fcfri->flags = 0;
 
-        cache_purge(fvp);
-        cache_purge(tvp);
+        if ((err = fuse_dispatcher_wait_answer(&fdi))) {
+            if (err == ENOSYS) {
+                fuse_clear_implemented(data, FSESS_NOIMPLBIT(COPY_FILE_RANGE));
+                err = ENOTSUP;
+            }
+            break;
+        }
 
-        /* Swap sizes */
-        off_t tmpfilesize = ffud->filesize;
-        ffud->filesize = tfud->filesize;
-        tfud->filesize = tmpfilesize;
-        ubc_setsize(fvp, (off_t)ffud->filesize);
-        ubc_setsize(tvp, (off_t)tfud->filesize);
+        done = ((struct fuse_write_out *)fdi.answer)->size;
+        fuse_ticket_drop(fdi.ticket);
 
-        fuse_compat_exchange(fvp, tvp);
+        if (done > chunk) {
+            err = EINVAL;
+            break;
+        }
 
-        /*
-         * Another approach (will need additional kernel support to work):
-         *
-        vnode_t tmpvp = ffud->vp;
-        ffud->vp = tfud->vp;
-        tfud->vp = tmpvp;
+        copied += done;
 
-        vnode_t tmpparentvp = ffud->parentvp;
-        ffud->parentvp = tfud->parentvp;
-        tfud->parentvp = tmpparentvp;
+        if (done < chunk) {
+            break;
+        }
+    }
 
-        off_t tmpfilesize = ffud->filesize;
-        ffud->filesize = tfud->filesize;
-        tfud->filesize = tmpfilesize;
+    if (copied) {
+        if (doff + copied > fvdat->filesize) {
+            fvdat->filesize = doff + copied;
+            ubc_setsize(vp, fvdat->filesize);
+        }
+        if (ubc_pages_resident(vp)) {
+            (void)ubc_msync(vp, doff, doff + copied, NULL,
+                            UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
+        }
+        fuse_invalidate_attr(vp);
+        OSAddAtomic64((SInt64)copied, (SInt64 *)&fuse_copy_bytes_offloaded);
+        /* Like write(2), report what was done rather than the error. */
+        err = 0;
+    }
 
-        struct fuse_vnode_data tmpfud;
-        memcpy(&tmpfud, ffud, sizeof(struct fuse_vnode_data));
-        memcpy(ffud, tfud, sizeof(struct fuse_vnode_data));
-        memcpy(tfud, &tmpfud, sizeof(struct fuse_vnode_data));
+    if (svp != vp) {
+        fuse_lck_rw_done(sfvdat->truncatelock);
+    }
+    fuse_lck_rw_done(fvdat->truncatelock);
 
-        HNodeExchangeFromFSNode(ffud, tfud);
-        *
-        */
+    /*
+     * A whole-file copy overwrites the destination in place and only cuts
+     * off its old tail once all of the source made it across, so a daemon
+     * that fails or refuses the copy leaves the old contents alone.
+     */
+    if (whole && !err && copied == left && fvdat->filesize > left) {
+        struct vnode_attr va;
+
+        VATTR_INIT(&va);
+        VATTR_SET(&va, va_data_size, left);
+        err = vnode_setattr(vp, &va, context);
     }
 
+    args->length = copied;
+
+out:
+    vnode_put(svp);
+    file_drop(args->src_fd);
+
     return err;
 }
 
-#endif /* FUSE4X_ENABLE_EXCHANGE */
+/* direct_io */
 
-/* fsync */
+/*
+ * One request of a direct_io stream. The ring of them is allocated per call
+ * rather than on the stack, which vnop_read and vnop_write share with the
+ * cluster layer; if that fails the stream runs one request at a time.
+ */
+struct fuse_direct_slot {
+    struct fuse_dispatcher fdi;
+    uint32_t               size;
+};
 
-__private_extern__
-int
-fuse_internal_fsync_callback(struct fuse_ticket *ticket, __unused uio_t uio)
+static struct fuse_direct_slot *
+fuse_internal_direct_slots(uint32_t *depth, struct fuse_direct_slot *one)
 {
-    fuse_trace_printf_func();
+    struct fuse_direct_slot *slot = NULL;
 
-    if (ticket->aw_ohead.error == ENOSYS) {
-        if (fuse_ticket_opcode(ticket) == FUSE_FSYNC) {
-            fuse_clear_implemented(ticket->data, FSESS_NOIMPLBIT(FSYNC));
-        } else if (fuse_ticket_opcode(ticket) == FUSE_FSYNCDIR) {
-            fuse_clear_implemented(ticket->data, FSESS_NOIMPLBIT(FSYNCDIR));
-        } else {
-            log("fuse4x: unexpected opcode in sync handling\n");
-        }
+    if (*depth > 1) {
+        slot = FUSE_OSMalloc(*depth * sizeof(*slot), fuse_malloc_tag);
+    }
+    if (!slot) {
+        *depth = 1;
+        slot = one;
     }
 
-    fuse_ticket_drop(ticket);
+    return slot;
+}
 
-    return 0;
+static void
+fuse_internal_direct_slots_free(struct fuse_direct_slot *slot, uint32_t depth,
+                                struct fuse_direct_slot *one)
+{
+    if (slot != one) {
+        FUSE_OSFree(slot, depth * sizeof(*slot), fuse_malloc_tag);
+    }
 }
 
+/*
+ * Reads uio straight from the daemon, keeping up to direct_io_depth READ
+ * requests in flight. Answers are copied out in offset order; a short one
+ * is the end of the file and whatever was asked for past it is dropped.
+ * Cached pages of the range that are dirty, through mmap or hybrid_io,
+ * are pushed out first. The caller holds the truncate lock shared.
+ */
 __private_extern__
 int
-fuse_internal_fsync(vnode_t                 vp,
-                    vfs_context_t           context,
-                    struct fuse_filehandle *fufh,
-                    void                   *param)
+fuse_internal_direct_read(vnode_t                 vp,
+                          uio_t                   uio,
+                          struct fuse_filehandle *fufh,
+                          vfs_context_t           context)
 {
-    int err = 0;
-    int op = FUSE_FSYNC;
-    struct fuse_fsync_in *ffsi;
-    struct fuse_dispatcher *dispatcher = param;
+    struct fuse_data        *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_direct_slot  one;
+    struct fuse_direct_slot *slot;
+    struct fuse_read_in     *fri;
+
+    uint32_t depth = data->direct_io_depth;
+    uint32_t head  = 0;
+    uint32_t count = 0;
+    uint32_t i;
+    off_t    next  = uio_offset(uio);
+    off_t    end   = next + uio_resid(uio);
+    bool     done  = false;
+    int      err   = 0;
+    int      res;
+
+    if (ubc_pages_resident(vp)) {
+        (void)ubc_msync(vp, next, end, NULL, UBC_PUSHDIRTY | UBC_SYNC);
+    }
 
-    const bool wait_for_completion = true;
+    slot = fuse_internal_direct_slots(&depth, &one);
 
-    fuse_trace_printf_func();
+    while (count || (!done && next < end)) {
 
-    dispatcher->iosize = sizeof(*ffsi);
-    dispatcher->ticket = NULL;
-    if (vnode_isdir(vp)) {
-        op = FUSE_FSYNCDIR;
-    }
+        while (!done && count < depth && next < end) {
+            i = (head + count) % depth;
+            fuse_dispatcher_init(&slot[i].fdi, sizeof(*fri));
+            fuse_dispatcher_make_vp(&slot[i].fdi, FUSE_READ, vp, context);
+            fri = slot[i].fdi.indata;
+            fri->fh = fufh->fh_id;
+            fri->offset = next;
+            fri->size = (uint32_t)min((size_t)(end - next), data->iosize);
+            slot[i].size = fri->size;
+            fuse_dispatcher_send(&slot[i].fdi);
+            next += slot[i].size;
+            count++;
+        }
 
-    fuse_dispatcher_make_vp(dispatcher, op, vp, context);
-    ffsi = dispatcher->indata;
-    ffsi->fh = fufh->fh_id;
+        i = head;
+        head = (head + 1) % depth;
+        count--;
 
-    ffsi->fsync_flags = 1; /* datasync */
+        if ((res = fuse_dispatcher_wait_sent(&slot[i].fdi))) {
+            if (!err) {
+                err = res;
+            }
+            done = true;
+            continue;
+        }
 
-    if (wait_for_completion) {
-        if ((err = fuse_dispatcher_wait_answer(dispatcher))) {
-            if (err == ENOSYS) {
-                if (op == FUSE_FSYNC) {
-                    fuse_clear_implemented(dispatcher->ticket->data,
-                                           FSESS_NOIMPLBIT(FSYNC));
-                } else if (op == FUSE_FSYNCDIR) {
-                    fuse_clear_implemented(dispatcher->ticket->data,
-                                           FSESS_NOIMPLBIT(FSYNCDIR));
-                }
+        if (!done) {
+            err = uiomove(slot[i].fdi.answer,
+                          (int)min(slot[i].size, slot[i].fdi.iosize), uio);
+            if (err || slot[i].fdi.iosize < slot[i].size) {
+                done = true;
             }
-            goto out;
-        } else {
-            fuse_ticket_drop(dispatcher->ticket);
         }
-    } else {
-        fuse_insert_callback(dispatcher->ticket, fuse_internal_fsync_callback);
-        fuse_insert_message(dispatcher->ticket);
+
+        fuse_ticket_drop(slot[i].fdi.ticket);
     }
 
-out:
+    fuse_internal_direct_slots_free(slot, depth, &one);
+
     return err;
 }
 
-/* getattr sidekicks */
+/*
+ * Writes uio straight to the daemon, keeping up to direct_io_depth WRITE
+ * requests in flight. Only what the daemon acknowledged without a gap from
+ * the start counts as written: after a short write the rest is sent again,
+ * and after an error uio is rolled back to the end of that stretch.
+ * Cached pages of the range are pushed out and dropped before and after,
+ * so that neither they nor the write overwrite the other. The caller holds
+ * the truncate lock shared.
+ */
 __private_extern__
 int
-fuse_internal_loadxtimes(vnode_t vp, struct vnode_attr *out_vap,
-                         vfs_context_t context)
+fuse_internal_direct_write(vnode_t                 vp,
+                           uio_t                   uio,
+                           struct fuse_filehandle *fufh,
+                           vfs_context_t           context)
 {
-    struct vnode_attr *in_vap = VTOVA(vp);
-    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
-    struct fuse_dispatcher fdi;
-    struct fuse_getxtimes_out *fgxo = NULL;
-    int isvroot = vnode_isvroot(vp);
-    struct timespec t = { 0, 0 };
-    const struct timespec kZeroTime = { 0, 0 };
-    int err = 0;
-
-    if (!(data->dataflags & FSESS_XTIMES)) {
-        /* We don't return anything. */
-        goto out;
-    }
-
-    if (VTOFUD(vp)->c_flag & C_XTIMES_VALID) {
-        VATTR_RETURN(out_vap, va_backup_time, in_vap->va_backup_time);
-        VATTR_RETURN(out_vap, va_create_time, in_vap->va_create_time);
-        goto out;
+    struct fuse_data        *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_direct_slot  one;
+    struct fuse_direct_slot *slot;
+    struct fuse_write_in    *fwi;
+    struct fuse_write_out   *fwo;
+
+    uint32_t depth = data->direct_io_depth;
+    uint32_t head;
+    uint32_t count;
+    uint32_t i;
+    off_t    first   = uio_offset(uio);
+    off_t    written = first;
+    off_t    end     = first + uio_resid(uio);
+    off_t    start;
+    bool     sending;
+    bool     broken;
+    int      err = 0;
+    int      res;
+
+    fuse_invalidate_extents(vp);
+
+    if (ubc_pages_resident(vp)) {
+        (void)ubc_msync(vp, first, end, NULL,
+                        UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
     }
 
-    if (!fuse_implemented(data, FSESS_NOIMPLBIT(GETXTIMES))) {
-        goto fake;
-    }
+    slot = fuse_internal_direct_slots(&depth, &one);
+
+    while (!err && written < end) {
+        start   = written;
+        head    = 0;
+        count   = 0;
+        sending = true;
+        broken  = false;
+
+        while (count || (sending && uio_resid(uio) > 0)) {
+
+            while (sending && count < depth && uio_resid(uio) > 0) {
+                i = (head + count) % depth;
+                slot[i].size = (uint32_t)min((size_t)uio_resid(uio),
+                                             data->iosize);
+                fuse_dispatcher_init(&slot[i].fdi,
+                                     sizeof(*fwi) + slot[i].size);
+                fuse_dispatcher_make_vp(&slot[i].fdi, FUSE_WRITE, vp, context);
+                fwi = slot[i].fdi.indata;
+                fwi->fh = fufh->fh_id;
+                fwi->offset = uio_offset(uio);
+                fwi->size = slot[i].size;
+
+                err = uiomove((char *)slot[i].fdi.indata + sizeof(*fwi),
+                              (int)slot[i].size, uio);
+                if (err) {
+                    fuse_ticket_drop(slot[i].fdi.ticket);
+                    sending = false;
+                    break;
+                }
 
-    if (fuse_isdeadfs(vp) && isvroot) {
-        goto fake;
-    }
+                fuse_dispatcher_send(&slot[i].fdi);
+                count++;
+            }
 
-    if (!data->inited && isvroot) {
-        goto fake;
-    }
+            if (!count) {
+                break;
+            }
 
-    err = fuse_dispatcher_simple_putget_vp(&fdi, FUSE_GETXTIMES, vp, context);
-    if (err) {
-        /* We don't ever treat this as a hard error. */
-        err = 0;
-        goto fake;
-    }
+            i = head;
+            head = (head + 1) % depth;
+            count--;
 
-    fgxo = (struct fuse_getxtimes_out *)fdi.answer;
+            if ((res = fuse_dispatcher_wait_sent(&slot[i].fdi))) {
+                if (!err) {
+                    err = res;
+                }
+                sending = false;
+                broken = true;
+                continue;
+            }
 
-    t.tv_sec = (time_t)fgxo->bkuptime; /* XXX: truncation */
-    t.tv_nsec = fgxo->bkuptimensec;
-    VATTR_RETURN(in_vap, va_backup_time, t);
-    VATTR_RETURN(out_vap, va_backup_time, t);
+            if (!broken) {
+                fwo = (struct fuse_write_out *)slot[i].fdi.answer;
+                if (fwo->size > slot[i].size) {
+                    err = EINVAL;
+                    sending = false;
+                    broken = true;
+                } else {
+                    written += fwo->size;
+                    if (fwo->size < slot[i].size) {
+                        sending = false;
+                        broken = true;
+                    }
+                }
+            }
 
-    t.tv_sec = (time_t)fgxo->crtime; /* XXX: truncation */
-    t.tv_nsec = fgxo->crtimensec;
-    VATTR_RETURN(in_vap, va_create_time, t);
-    VATTR_RETURN(out_vap, va_create_time, t);
+            fuse_ticket_drop(slot[i].fdi.ticket);
+        }
 
-    fuse_ticket_drop(fdi.ticket);
+        uio_setresid(uio, end - written);
+        uio_setoffset(uio, written);
 
-    VTOFUD(vp)->c_flag |= C_XTIMES_VALID;
+        if (written == start) {
+            /* The daemon took nothing; leave it as a short write. */
+            break;
+        }
+    }
 
-    goto out;
+    fuse_internal_direct_slots_free(slot, depth, &one);
 
-fake:
-    VATTR_RETURN(out_vap, va_backup_time, kZeroTime);
-    VATTR_RETURN(out_vap, va_create_time, kZeroTime);
+    if (ubc_pages_resident(vp)) {
+        (void)ubc_msync(vp, first, end, NULL,
+                        UBC_PUSHDIRTY | UBC_SYNC | UBC_INVALIDATE);
+    }
 
-out:
     return err;
 }
 
-/* setattr sidekicks */
+/*
+ * With hybrid_io, decides whether a read or write of a cached file goes
+ * straight to the daemon instead. Large I/O that picks up where the last
+ * one ended is taken to be streaming, which gains nothing from the page
+ * cache; reads also need the file itself to be large. io_next is not
+ * locked: a race only costs a wrong guess. Returns the handle to use, or
+ * NULL to go through the cluster layer.
+ */
 __private_extern__
-int
-fuse_internal_attr_vat2fsai(mount_t                 mp,
-                            vnode_t                 vp,
-                            struct vnode_attr      *vap,
-                            struct fuse_setattr_in *fsai,
-                            uint64_t               *newsize)
+struct fuse_filehandle *
+fuse_internal_hybrid_fufh(vnode_t       vp,
+                          uio_t         uio,
+                          bool          write,
+                          vfs_context_t context)
 {
-    /*
-     * XXX: Locking
-     *
-     * We need to worry about the file size changing in setattr(). If the call
-     * is indeed altering the size, then:
-     *
-     * lock_exclusive(truncatelock)
-     *   lock(nodelock)
-     *     set the new size
-     *   unlock(nodelock)
-     *   adjust ubc
-     *   lock(nodelock)
-     *     do cleanup
-     *   unlock(nodelock)
-     * unlock(truncatelock)
-     * ...
-     */
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_filehandle *fufh;
 
-    int sizechanged = 0;
-    uid_t nuid;
-    gid_t ngid;
+    fufh_type_t  fufh_type = write ? FUFH_WRONLY : FUFH_RDONLY;
+    off_t        offset    = uio_offset(uio);
+    user_ssize_t resid     = uio_resid(uio);
+    bool         streaming;
+    int          err;
 
-    fsai->valid = 0;
+    if (!fuse_ishybridio_mp(vnode_mount(vp)) || fuse_isnoubc(vp)) {
+        return NULL;
+    }
 
-    if (newsize) {
-        *newsize = 0;
+    streaming = (offset == fvdat->io_next);
+    fvdat->io_next = offset + resid;
+
+    if (!streaming || resid < fuse_hybrid_io_min) {
+        return NULL;
     }
 
-    nuid = VATTR_IS_ACTIVE(vap, va_uid) ? vap->va_uid : (uid_t)VNOVAL;
-    if (nuid != (uid_t)VNOVAL) {
-        fsai->uid = nuid;
-        fsai->valid |= FATTR_UID;
+    if (!write && fvdat->filesize < fuse_hybrid_io_min) {
+        return NULL;
     }
-    VATTR_SET_SUPPORTED(vap, va_uid);
 
-    ngid = VATTR_IS_ACTIVE(vap, va_gid) ? vap->va_gid : (gid_t)VNOVAL;
-    if (ngid != (gid_t)VNOVAL) {
-        fsai->gid = ngid;
-        fsai->valid |= FATTR_GID;
+    fufh = &(fvdat->fufh[fufh_type]);
+    if (!FUFH_IS_VALID(fufh)) {
+        fufh_type = FUFH_RDWR;
+        fufh = &(fvdat->fufh[fufh_type]);
+        if (!FUFH_IS_VALID(fufh)) {
+            return NULL;
+        }
     }
-    VATTR_SET_SUPPORTED(vap, va_gid);
 
-    if (VATTR_IS_ACTIVE(vap, va_data_size)) {
+    fuse_lck_mtx_lock(fvdat->fufh_mtx);
+    err = fuse_filehandle_realize(vp, context, fufh_type);
+    fuse_lck_mtx_unlock(fvdat->fufh_mtx);
 
-        // Truncate to a new value.
-        fsai->size = vap->va_data_size;
-        sizechanged = 1;
-        if (newsize) {
-            *newsize = vap->va_data_size;
-        }
-        fsai->valid |= FATTR_SIZE;
+    return (err ? NULL : fufh);
+}
 
-        if (vp) {
-            struct fuse_filehandle *fufh = NULL;
-            fufh_type_t fufh_type = FUFH_WRONLY;
-            struct fuse_vnode_data *fvdat = VTOFUD(vp);
+#ifdef FUSE4X_ENABLE_EXCHANGE
 
-            fufh = &(fvdat->fufh[fufh_type]);
+/* exchange */
 
-            if (!FUFH_IS_VALID(fufh)) {
-                fufh_type = FUFH_RDWR;
-                fufh = &(fvdat->fufh[fufh_type]);
-                if (!FUFH_IS_VALID(fufh)) {
-                    fufh = NULL;
-                }
-            }
+__private_extern__
+int
+fuse_internal_exchange(vnode_t       fvp,
+                       const char   *fname,
+                       size_t        flen,
+                       vnode_t       tvp,
+                       const char   *tname,
+                       size_t        tlen,
+                       int           options,
+                       vfs_context_t context)
+{
+    struct fuse_dispatcher fdi;
+    struct fuse_exchange_in *fei;
+    struct fuse_vnode_data *ffud = VTOFUD(fvp);
+    struct fuse_vnode_data *tfud = VTOFUD(tvp);
+    vnode_t fdvp = ffud->parentvp;
+    vnode_t tdvp = tfud->parentvp;
+    int err = 0;
 
-            if (fufh) {
-                fsai->fh = fufh->fh_id;
-                fsai->valid |= FATTR_FH;
+    fuse_dispatcher_init(&fdi, sizeof(*fei) + flen + tlen + 2);
+    fuse_dispatcher_make_vp(&fdi, FUSE_EXCHANGE, fvp, context);
+
+    fei = fdi.indata;
+    fei->olddir = VTOI(fdvp);
+    fei->newdir = VTOI(tdvp);
+    fei->options = (uint64_t)options;
+
+    memcpy((char *)fdi.indata + sizeof(*fei), fname, flen);
+    ((char *)fdi.indata)[sizeof(*fei) + flen] = '\0';
+
+    memcpy((char *)fdi.indata + sizeof(*fei) + flen + 1, tname, tlen);
+    ((char *)fdi.indata)[sizeof(*fei) + flen + tlen + 1] = '\0';
+
+    ubc_msync(fvp, (off_t)0, (off_t)ffud->filesize, NULL,
+              UBC_PUSHALL | UBC_INVALIDATE | UBC_SYNC);
+    ubc_msync(tvp, (off_t)0, (off_t)tfud->filesize, NULL,
+              UBC_PUSHALL | UBC_INVALIDATE | UBC_SYNC);
+
+    if (!(err = fuse_dispatcher_wait_answer(&fdi))) {
+        fuse_ticket_drop(fdi.ticket);
+    }
+
+    if (err == 0) {
+        if (fdvp) {
+            fuse_invalidate_attr(fdvp);
+            fuse_invalidate_dircache(fdvp);
+        }
+        if (tdvp != fdvp) {
+            if (tdvp) {
+                fuse_invalidate_attr(tdvp);
+                fuse_invalidate_dircache(tdvp);
             }
         }
-    }
-    VATTR_SET_SUPPORTED(vap, va_data_size);
 
-    /*
-     * Possible timestamps:
-     *
-     * Mac OS X                                          Linux  FUSE API
-     *
-     * va_access_time    last access time                atime  atime
-     * va_backup_time    last backup time                -      -
-     * va_change_time    last metadata change time       ctime* -
-     * va_create_time    creation time                   -      -
-     * va_modify_time    last data modification time     mtime  mtime
-     *
-     */
+        fuse_invalidate_attr(fvp);
+        fuse_invalidate_attr(tvp);
 
-    if (VATTR_IS_ACTIVE(vap, va_access_time)) {
-        fsai->atime = vap->va_access_time.tv_sec;
-        /* XXX: truncation */
-        fsai->atimensec = (uint32_t)vap->va_access_time.tv_nsec;
-        fsai->valid |=  FATTR_ATIME;
-    }
-    VATTR_SET_SUPPORTED(vap, va_access_time);
+        cache_purge(fvp);
+        cache_purge(tvp);
 
-    if (VATTR_IS_ACTIVE(vap, va_modify_time)) {
-        fsai->mtime = vap->va_modify_time.tv_sec;
-        /* XXX: truncation */
-        fsai->mtimensec = (uint32_t)vap->va_modify_time.tv_nsec;
-        fsai->valid |=  FATTR_MTIME;
-    }
-    VATTR_SET_SUPPORTED(vap, va_modify_time);
+        /* Swap sizes; lock in address order against a reverse exchange. */
+        struct fuse_vnode_data *lo = (ffud < tfud) ? ffud : tfud;
+        struct fuse_vnode_data *hi = (ffud < tfud) ? tfud : ffud;
+        fuse_lck_rw_lock_exclusive(lo->truncatelock);
+        fuse_lck_rw_lock_exclusive(hi->truncatelock);
+        off_t tmpfilesize = ffud->filesize;
+        ffud->filesize = tfud->filesize;
+        tfud->filesize = tmpfilesize;
+        ubc_setsize(fvp, (off_t)ffud->filesize);
+        ubc_setsize(tvp, (off_t)tfud->filesize);
+        fuse_lck_rw_done(hi->truncatelock);
+        fuse_lck_rw_done(lo->truncatelock);
 
-    if (VATTR_IS_ACTIVE(vap, va_backup_time) && fuse_isxtimes_mp(mp)) {
-        fsai->bkuptime = vap->va_backup_time.tv_sec;
-        /* XXX: truncation */
-        fsai->bkuptimensec = (uint32_t)vap->va_backup_time.tv_nsec;
-        fsai->valid |= FATTR_BKUPTIME;
-        VATTR_SET_SUPPORTED(vap, va_backup_time);
-    }
+        fuse_compat_exchange(fvp, tvp);
 
-    if (VATTR_IS_ACTIVE(vap, va_change_time)) {
-        if (fuse_isxtimes_mp(mp)) {
-            fsai->chgtime = vap->va_change_time.tv_sec;
-            /* XXX: truncation */
-            fsai->chgtimensec = (uint32_t)vap->va_change_time.tv_nsec;
+        /*
+         * Another approach (will need additional kernel support to work):
+         *
+        vnode_t tmpvp = ffud->vp;
+        ffud->vp = tfud->vp;
+        tfud->vp = tmpvp;
+
+        vnode_t tmpparentvp = ffud->parentvp;
+        ffud->parentvp = tfud->parentvp;
+        tfud->parentvp = tmpparentvp;
+
+        off_t tmpfilesize = ffud->filesize;
+        ffud->filesize = tfud->filesize;
+        tfud->filesize = tmpfilesize;
+
+        struct fuse_vnode_data tmpfud;
+        memcpy(&tmpfud, ffud, sizeof(struct fuse_vnode_data));
+        memcpy(ffud, tfud, sizeof(struct fuse_vnode_data));
+        memcpy(tfud, &tmpfud, sizeof(struct fuse_vnode_data));
+
+        HNodeExchangeFromFSNode(ffud, tfud);
+        *
+        */
+    }
+
+    return err;
+}
+
+#endif /* FUSE4X_ENABLE_EXCHANGE */
+
+/* fsync */
+
+__private_extern__
+int
+fuse_internal_fsync_callback(struct fuse_ticket *ticket, __unused uio_t uio)
+{
+    fuse_trace_printf_func();
+
+    if (ticket->aw_ohead.error == ENOSYS) {
+        if (fuse_ticket_opcode(ticket) == FUSE_FSYNC) {
+            fuse_clear_implemented(ticket->data, FSESS_NOIMPLBIT(FSYNC));
+        } else if (fuse_ticket_opcode(ticket) == FUSE_FSYNCDIR) {
+            fuse_clear_implemented(ticket->data, FSESS_NOIMPLBIT(FSYNCDIR));
+        } else {
+            log("fuse4x: unexpected opcode in sync handling\n");
+        }
+    }
+
+    fuse_ticket_drop(ticket);
+
+    return 0;
+}
+
+/*
+ * Answer to a FLUSH nobody waited for. A failure is kept for the next
+ * fsync(2) of the file to report.
+ */
+__private_extern__
+int
+fuse_internal_flush_callback(struct fuse_ticket *ticket, __unused uio_t uio)
+{
+    struct fuse_data *data = ticket->data;
+    struct fuse_vnode_data tt = {
+        .nodeid = ((struct fuse_in_header *)ticket->ms_fiov.base)->nodeid
+    };
+    struct fuse_vnode_data *fvdat;
+    int err = ticket->aw_ohead.error;
+
+    fuse_trace_printf_func();
+
+    if (err == ENOSYS) {
+        fuse_clear_implemented(data, FSESS_NOIMPLBIT(FLUSH));
+    } else if (err && !ticket->killed) {
+        /* The vnode may be gone; node_mtx keeps it from going meanwhile. */
+        fuse_lck_mtx_lock(data->node_mtx);
+        fvdat = RB_FIND(fuse_data_nodes, &data->nodes_head, &tt);
+        if (fvdat && !fvdat->flush_error) {
+            fvdat->flush_error = err;
+        }
+        fuse_lck_mtx_unlock(data->node_mtx);
+    }
+
+    fuse_ticket_drop(ticket);
+
+    return 0;
+}
+
+/* Returns and clears the error of an earlier async FLUSH, if any. */
+__private_extern__
+int
+fuse_internal_flush_error(vnode_t vp)
+{
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    int err;
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    err = fvdat->flush_error;
+    fvdat->flush_error = 0;
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    return err;
+}
+
+__private_extern__
+int
+fuse_internal_fsync(vnode_t                 vp,
+                    vfs_context_t           context,
+                    struct fuse_filehandle *fufh,
+                    void                   *param)
+{
+    int err = 0;
+    int op = FUSE_FSYNC;
+    struct fuse_fsync_in *ffsi;
+    struct fuse_dispatcher *dispatcher = param;
+
+    const bool wait_for_completion = true;
+
+    fuse_trace_printf_func();
+
+    /* The daemon has not opened a lazy handle, so has nothing to sync. */
+    if (fufh->lazy) {
+        return 0;
+    }
+
+    dispatcher->iosize = sizeof(*ffsi);
+    dispatcher->ticket = NULL;
+    if (vnode_isdir(vp)) {
+        op = FUSE_FSYNCDIR;
+    }
+
+    fuse_dispatcher_make_vp(dispatcher, op, vp, context);
+    ffsi = dispatcher->indata;
+    ffsi->fh = fufh->fh_id;
+
+    ffsi->fsync_flags = 1; /* datasync */
+
+    if (wait_for_completion) {
+        if ((err = fuse_dispatcher_wait_answer(dispatcher))) {
+            if (err == ENOSYS) {
+                if (op == FUSE_FSYNC) {
+                    fuse_clear_implemented(dispatcher->ticket->data,
+                                           FSESS_NOIMPLBIT(FSYNC));
+                } else if (op == FUSE_FSYNCDIR) {
+                    fuse_clear_implemented(dispatcher->ticket->data,
+                                           FSESS_NOIMPLBIT(FSYNCDIR));
+                }
+            }
+            goto out;
+        } else {
+            fuse_ticket_drop(dispatcher->ticket);
+        }
+    } else {
+        fuse_insert_callback(dispatcher->ticket, fuse_internal_fsync_callback);
+        fuse_insert_message(dispatcher->ticket);
+    }
+
+out:
+    return err;
+}
+
+/* getattr sidekicks */
+
+__private_extern__
+int
+fuse_internal_attr_revalidate_callback(struct fuse_ticket *ticket, uio_t uio)
+{
+    struct fuse_data *data = ticket->data;
+    struct fuse_attr_out *fao = NULL;
+    struct fuse_vnode_data *fvdat;
+    uint64_t nodeid;
+    long hint = 0;
+
+    fuse_trace_printf_func();
+
+    nodeid = ((struct fuse_in_header *)ticket->ms_fiov.base)->nodeid;
+
+    if (!ticket->aw_ohead.error && !fuse_ticket_pull(ticket, uio)) {
+        fao = ticket->aw_fiov.base;
+        if ((fao->attr.mode & S_IFMT) == 0) {
+            fao = NULL;
+        }
+    }
+
+    /*
+     * We run on the daemon's write(2) to the device, so we must neither
+     * take an iocount on the vnode (dropping it could call back into the
+     * daemon) nor touch the UBC here. Holding node_mtx keeps the node from
+     * being reclaimed under us; the page cache is brought in line by the
+     * next fuse_internal_attr_loadvap() and the kevent is posted by the
+     * notify worker.
+     */
+    struct fuse_vnode_data tt = {
+        .nodeid = nodeid
+    };
+    fuse_lck_mtx_lock(data->node_mtx);
+    fvdat = RB_FIND(fuse_data_nodes, &data->nodes_head, &tt);
+    if (fvdat && fvdat->vp) {
+        vnode_t vp = fvdat->vp;
+        struct vnode_attr *vap = VTOVA(vp);
+
+        /*
+         * A setattr, write or the like that completed while the request
+         * was in flight makes its answer older than what we know.
+         */
+        if (fvdat->attr_revalidate_gen != data->inflight_gen) {
+            fao = NULL;
+        }
+
+        if (fao && (IFTOVT(fao->attr.mode) == fvdat->vtype)) {
+            /* On async mounts the local size wins, see fat2vat(). */
+            if (vfs_issynchronous(vnode_mount(vp)) &&
+                (off_t)fao->attr.size != (off_t)vap->va_data_size) {
+                hint |= NOTE_WRITE;
+                if ((off_t)fao->attr.size > (off_t)vap->va_data_size) {
+                    hint |= NOTE_EXTEND;
+                }
+            }
+            if ((vap->va_modify_time.tv_sec != (time_t)fao->attr.mtime) ||
+                (vap->va_modify_time.tv_nsec != fao->attr.mtimensec) ||
+                (vap->va_mode != (fao->attr.mode & ~S_IFMT)) ||
+                (vap->va_uid != fao->attr.uid) ||
+                (vap->va_gid != fao->attr.gid) ||
+                (vap->va_nlink != fao->attr.nlink) ||
+                (vap->va_flags != fao->attr.flags)) {
+                hint |= NOTE_ATTRIB;
+            }
+
+            cache_attrs(vp, fao);
+            fvdat->c_flag &= ~C_XTIMES_VALID;
+        }
+
+        fuse_lck_mtx_lock(fvdat->cache_mtx);
+        fvdat->attr_revalidating = false;
+        fuse_lck_mtx_unlock(fvdat->cache_mtx);
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    /* Posting the kevent takes an iocount, so the notify worker does it. */
+    if (hint) {
+        fuse_internal_notify_vnode(data, nodeid, false, hint);
+    }
+
+    fuse_ticket_drop(ticket);
+
+    return 0;
+}
+
+/*
+ * Sends a FUSE_GETATTR whose answer refreshes the attribute cache in the
+ * background. At most one such request is outstanding per vnode. The
+ * answer is dropped if an attribute-changing request completes meanwhile,
+ * the same rule that keeps GETATTRs from being coalesced across one.
+ */
+__private_extern__
+int
+fuse_internal_attr_revalidate(vnode_t vp, vfs_context_t context)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_dispatcher fdi;
+    bool send = false;
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    if (!fvdat->attr_revalidating) {
+        fvdat->attr_revalidating = true;
+        fvdat->attr_revalidate_gen = data->inflight_gen;
+        send = true;
+    }
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    if (!send) {
+        return 0;
+    }
+
+    fuse_dispatcher_init(&fdi, sizeof(struct fuse_getattr_in));
+    fuse_dispatcher_make_vp(&fdi, FUSE_GETATTR, vp, context);
+    bzero(fdi.indata, sizeof(struct fuse_getattr_in));
+
+    fuse_insert_callback(fdi.ticket, fuse_internal_attr_revalidate_callback);
+    fuse_insert_message(fdi.ticket);
+
+    return 0;
+}
+
+__private_extern__
+int
+fuse_internal_loadxtimes(vnode_t vp, struct vnode_attr *out_vap,
+                         vfs_context_t context)
+{
+    struct vnode_attr *in_vap = VTOVA(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_dispatcher fdi;
+    struct fuse_getxtimes_out *fgxo = NULL;
+    int isvroot = vnode_isvroot(vp);
+    struct timespec t = { 0, 0 };
+    const struct timespec kZeroTime = { 0, 0 };
+    int err = 0;
+
+    if (!(data->dataflags & FSESS_XTIMES)) {
+        /* We don't return anything. */
+        goto out;
+    }
+
+    if (VTOFUD(vp)->c_flag & C_XTIMES_VALID) {
+        VATTR_RETURN(out_vap, va_backup_time, in_vap->va_backup_time);
+        VATTR_RETURN(out_vap, va_create_time, in_vap->va_create_time);
+        goto out;
+    }
+
+    if (!fuse_implemented(data, FSESS_NOIMPLBIT(GETXTIMES))) {
+        goto fake;
+    }
+
+    if (fuse_isdeadfs(vp) && isvroot) {
+        goto fake;
+    }
+
+    if (!data->inited && isvroot) {
+        goto fake;
+    }
+
+    err = fuse_dispatcher_simple_putget_vp(&fdi, FUSE_GETXTIMES, vp, context);
+    if (err) {
+        /* We don't ever treat this as a hard error. */
+        err = 0;
+        goto fake;
+    }
+
+    fgxo = (struct fuse_getxtimes_out *)fdi.answer;
+
+    t.tv_sec = (time_t)fgxo->bkuptime; /* XXX: truncation */
+    t.tv_nsec = fgxo->bkuptimensec;
+    VATTR_RETURN(in_vap, va_backup_time, t);
+    VATTR_RETURN(out_vap, va_backup_time, t);
+
+    t.tv_sec = (time_t)fgxo->crtime; /* XXX: truncation */
+    t.tv_nsec = fgxo->crtimensec;
+    VATTR_RETURN(in_vap, va_create_time, t);
+    VATTR_RETURN(out_vap, va_create_time, t);
+
+    fuse_ticket_drop(fdi.ticket);
+
+    VTOFUD(vp)->c_flag |= C_XTIMES_VALID;
+
+    goto out;
+
+fake:
+    VATTR_RETURN(out_vap, va_backup_time, kZeroTime);
+    VATTR_RETURN(out_vap, va_create_time, kZeroTime);
+
+out:
+    return err;
+}
+
+/* setattr sidekicks */
+__private_extern__
+int
+fuse_internal_attr_vat2fsai(mount_t                 mp,
+                            vnode_t                 vp,
+                            struct vnode_attr      *vap,
+                            struct fuse_setattr_in *fsai,
+                            uint64_t               *newsize)
+{
+    /*
+     * XXX: Locking
+     *
+     * We need to worry about the file size changing in setattr(). If the call
+     * is indeed altering the size, then:
+     *
+     * lock_exclusive(truncatelock)
+     *   lock(nodelock)
+     *     set the new size
+     *   unlock(nodelock)
+     *   adjust ubc
+     *   lock(nodelock)
+     *     do cleanup
+     *   unlock(nodelock)
+     * unlock(truncatelock)
+     * ...
+     */
+
+    int sizechanged = 0;
+    uid_t nuid;
+    gid_t ngid;
+
+    fsai->valid = 0;
+
+    if (newsize) {
+        *newsize = 0;
+    }
+
+    nuid = VATTR_IS_ACTIVE(vap, va_uid) ? vap->va_uid : (uid_t)VNOVAL;
+    if (nuid != (uid_t)VNOVAL) {
+        fsai->uid = nuid;
+        fsai->valid |= FATTR_UID;
+    }
+    VATTR_SET_SUPPORTED(vap, va_uid);
+
+    ngid = VATTR_IS_ACTIVE(vap, va_gid) ? vap->va_gid : (gid_t)VNOVAL;
+    if (ngid != (gid_t)VNOVAL) {
+        fsai->gid = ngid;
+        fsai->valid |= FATTR_GID;
+    }
+    VATTR_SET_SUPPORTED(vap, va_gid);
+
+    if (VATTR_IS_ACTIVE(vap, va_data_size)) {
+
+        // Truncate to a new value.
+        fsai->size = vap->va_data_size;
+        sizechanged = 1;
+        if (newsize) {
+            *newsize = vap->va_data_size;
+        }
+        fsai->valid |= FATTR_SIZE;
+
+        if (vp) {
+            struct fuse_filehandle *fufh = NULL;
+            fufh_type_t fufh_type = FUFH_WRONLY;
+            struct fuse_vnode_data *fvdat = VTOFUD(vp);
+
+            fufh = &(fvdat->fufh[fufh_type]);
+
+            if (!FUFH_IS_VALID(fufh)) {
+                fufh_type = FUFH_RDWR;
+                fufh = &(fvdat->fufh[fufh_type]);
+                if (!FUFH_IS_VALID(fufh)) {
+                    fufh = NULL;
+                }
+            }
+
+            if (fufh && !fufh->lazy) {
+                fsai->fh = fufh->fh_id;
+                fsai->valid |= FATTR_FH;
+            }
+        }
+    }
+    VATTR_SET_SUPPORTED(vap, va_data_size);
+
+    /*
+     * Possible timestamps:
+     *
+     * Mac OS X                                          Linux  FUSE API
+     *
+     * va_access_time    last access time                atime  atime
+     * va_backup_time    last backup time                -      -
+     * va_change_time    last metadata change time       ctime* -
+     * va_create_time    creation time                   -      -
+     * va_modify_time    last data modification time     mtime  mtime
+     *
+     */
+
+    if (VATTR_IS_ACTIVE(vap, va_access_time)) {
+        fsai->atime = vap->va_access_time.tv_sec;
+        /* XXX: truncation */
+        fsai->atimensec = (uint32_t)vap->va_access_time.tv_nsec;
+        fsai->valid |=  FATTR_ATIME;
+    }
+    VATTR_SET_SUPPORTED(vap, va_access_time);
+
+    if (VATTR_IS_ACTIVE(vap, va_modify_time)) {
+        fsai->mtime = vap->va_modify_time.tv_sec;
+        /* XXX: truncation */
+        fsai->mtimensec = (uint32_t)vap->va_modify_time.tv_nsec;
+        fsai->valid |=  FATTR_MTIME;
+    }
+    VATTR_SET_SUPPORTED(vap, va_modify_time);
+
+    if (VATTR_IS_ACTIVE(vap, va_backup_time) && fuse_isxtimes_mp(mp)) {
+        fsai->bkuptime = vap->va_backup_time.tv_sec;
+        /* XXX: truncation */
+        fsai->bkuptimensec = (uint32_t)vap->va_backup_time.tv_nsec;
+        fsai->valid |= FATTR_BKUPTIME;
+        VATTR_SET_SUPPORTED(vap, va_backup_time);
+    }
+
+    if (VATTR_IS_ACTIVE(vap, va_change_time)) {
+        if (fuse_isxtimes_mp(mp)) {
+            fsai->chgtime = vap->va_change_time.tv_sec;
+            /* XXX: truncation */
+            fsai->chgtimensec = (uint32_t)vap->va_change_time.tv_nsec;
             fsai->valid |=  FATTR_CHGTIME;
             VATTR_SET_SUPPORTED(vap, va_change_time);
         }
     }
 
-    if (VATTR_IS_ACTIVE(vap, va_create_time) && fuse_isxtimes_mp(mp)) {
-        fsai->crtime = vap->va_create_time.tv_sec;
-        /* XXX: truncation */
-        fsai->crtimensec = (uint32_t)vap->va_create_time.tv_nsec;
-        fsai->valid |= FATTR_CRTIME;
-        VATTR_SET_SUPPORTED(vap, va_create_time);
+    if (VATTR_IS_ACTIVE(vap, va_create_time) && fuse_isxtimes_mp(mp)) {
+        fsai->crtime = vap->va_create_time.tv_sec;
+        /* XXX: truncation */
+        fsai->crtimensec = (uint32_t)vap->va_create_time.tv_nsec;
+        fsai->valid |= FATTR_CRTIME;
+        VATTR_SET_SUPPORTED(vap, va_create_time);
+    }
+
+    if (VATTR_IS_ACTIVE(vap, va_mode)) {
+        fsai->mode = vap->va_mode & ALLPERMS;
+        fsai->mode |= VTTOIF(vnode_vtype(vp));
+        fsai->valid |= FATTR_MODE;
+    }
+    VATTR_SET_SUPPORTED(vap, va_mode);
+
+    if (VATTR_IS_ACTIVE(vap, va_flags)) {
+        fsai->flags = vap->va_flags;
+        fsai->valid |= FATTR_FLAGS;
+    }
+    VATTR_SET_SUPPORTED(vap, va_flags);
+
+    /*
+     * We /are/ OK with va_acl, va_guuid, and va_uuuid passing through here.
+     */
+
+    return sizechanged;
+}
+
+
+/* notify */
+
+/*
+ * Notifications arrive on the daemon's write(2) to the device, so, as in
+ * the revalidation callback above, nodes are found without taking an
+ * iocount and the UBC is left alone: holding node_mtx keeps a node from
+ * being reclaimed, and data invalidations are recorded for the vnode's
+ * next I/O to apply.
+ */
+static __inline__
+struct fuse_vnode_data *
+fuse_internal_notify_node(struct fuse_data *data, uint64_t nodeid)
+{
+    struct fuse_vnode_data tt = {
+        .nodeid = nodeid
+    };
+    struct fuse_vnode_data *fvdat;
+
+    fvdat = RB_FIND(fuse_data_nodes, &data->nodes_head, &tt);
+
+    return ((fvdat && fvdat->vp) ? fvdat : NULL);
+}
+
+/* Reads the NUL-terminated name that ends a notification. */
+static int
+fuse_internal_notify_pull_name(uio_t uio, uint32_t namelen, char *name)
+{
+    int err;
+
+    if (namelen > FUSE_MAXNAMLEN) {
+        return ENAMETOOLONG;
+    }
+
+    if (uio_resid(uio) != (user_ssize_t)(namelen + 1)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove(name, (int)(namelen + 1), uio))) {
+        return err;
+    }
+
+    if (name[namelen] != '\0') {
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+static int
+fuse_internal_notify_inval_inode(struct fuse_data *data, uio_t uio)
+{
+    struct fuse_notify_inval_inode_out fniio;
+    struct fuse_vnode_data *fvdat;
+    long hint = NOTE_ATTRIB;
+    int err;
+
+    if (uio_resid(uio) != (user_ssize_t)sizeof(fniio)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fniio, (int)sizeof(fniio), uio))) {
+        return err;
+    }
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    fvdat = fuse_internal_notify_node(data, fniio.ino);
+    if (fvdat) {
+        vnode_t vp = fvdat->vp;
+
+        fuse_invalidate_attr(vp);
+        fuse_invalidate_access(vp);
+        fuse_invalidate_xattr(vp);
+
+        if (fvdat->vtype == VDIR) {
+            fuse_invalidate_dircache(vp);
+            hint |= NOTE_WRITE;
+        } else if ((fvdat->vtype == VREG) && (fniio.off >= 0)) {
+            /* A non-positive length means up to the end of the file. */
+            off_t end = fvdat->filesize;
+
+            if ((fniio.len > 0) && (fniio.off + fniio.len > fniio.off)) {
+                end = fniio.off + fniio.len;
+            }
+            if (end > fniio.off) {
+                fuse_vnode_inval_range(fvdat, fniio.off, end);
+                hint |= NOTE_WRITE;
+            }
+        }
+    } else {
+        err = ENOENT;
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    if (!err) {
+        fuse_internal_notify_vnode(data, fniio.ino, false, hint);
+    }
+
+    return err;
+}
+
+/*
+ * Names can only be dropped from the name cache through the vnodes they
+ * refer to, which would take an iocount, so the whole directory's names
+ * go. That purge is left to the worker; this drops the cached listing.
+ */
+static void
+fuse_internal_notify_purge_dir(struct fuse_vnode_data *dfvdat)
+{
+    vnode_t dvp = dfvdat->vp;
+
+    fuse_invalidate_attr(dvp);
+    fuse_invalidate_dircache(dvp);
+}
+
+static int
+fuse_internal_notify_inval_entry(struct fuse_data *data, uio_t uio)
+{
+    struct fuse_notify_inval_entry_out fnieo;
+    struct fuse_vnode_data *dfvdat;
+    char name[FUSE_MAXNAMLEN + 1];
+    int err;
+
+    if (uio_resid(uio) < (user_ssize_t)sizeof(fnieo)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fnieo, (int)sizeof(fnieo), uio))) {
+        return err;
+    }
+
+    if ((err = fuse_internal_notify_pull_name(uio, fnieo.namelen, name))) {
+        return err;
+    }
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    dfvdat = fuse_internal_notify_node(data, fnieo.parent);
+    if (dfvdat) {
+        fuse_internal_notify_purge_dir(dfvdat);
+    } else {
+        err = ENOENT;
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    if (!err) {
+        fuse_internal_notify_vnode(data, fnieo.parent, true, NOTE_WRITE);
+    }
+
+    return err;
+}
+
+static int
+fuse_internal_notify_delete(struct fuse_data *data, uio_t uio)
+{
+    struct fuse_notify_delete_out fndo;
+    struct fuse_vnode_data *dfvdat;
+    struct fuse_vnode_data *fvdat = NULL;
+    char name[FUSE_MAXNAMLEN + 1];
+    int err;
+
+    if (uio_resid(uio) < (user_ssize_t)sizeof(fndo)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fndo, (int)sizeof(fndo), uio))) {
+        return err;
+    }
+
+    if ((err = fuse_internal_notify_pull_name(uio, fndo.namelen, name))) {
+        return err;
+    }
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    dfvdat = fuse_internal_notify_node(data, fndo.parent);
+    if (dfvdat) {
+        fuse_internal_notify_purge_dir(dfvdat);
+
+        fvdat = fuse_internal_notify_node(data, fndo.child);
+        if (fvdat) {
+            fuse_invalidate_attr(fvdat->vp);
+        }
+    } else {
+        err = ENOENT;
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    if (!err) {
+        fuse_internal_notify_vnode(data, fndo.parent, true, NOTE_WRITE);
+        if (fvdat) {
+            fuse_internal_notify_vnode(data, fndo.child, true, NOTE_DELETE);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * Storing into and retrieving from the page cache needs an iocount and
+ * UPLs, either of which may wait on the daemon, so those notifications are
+ * queued for a worker thread. So are name cache purges and kevents, which
+ * need an iocount too. The worker runs while the queue is not empty and
+ * fuse_data_destroy() waits for it.
+ */
+#define FUSE_NOTIFY_VNODE 0 /* not a daemon code: purge names, post kevents */
+
+struct fuse_notify_work {
+    STAILQ_ENTRY(fuse_notify_work) link;
+    int      code;
+    bool     purge;    /* cache_purge() the vnode */
+    long     hint;     /* kevent hint to post */
+    vnode_t  vp;
+    uint32_t vid;
+    uint64_t nodeid;
+    uint64_t unique;   /* notify_unique of a retrieve */
+    off_t    offset;
+    size_t   size;
+    size_t   allocsize;
+    char     data[0];  /* bytes to store */
+};
+
+/*
+ * Copies the daemon's bytes into the pages they belong to. The store may
+ * grow the file, so it runs with the truncate lock held exclusive.
+ */
+static void
+fuse_internal_notify_store_apply(vnode_t vp, off_t offset, const char *buf,
+                                 size_t size)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    off_t end = offset + size;
+    off_t pgoff;
+    off_t from;
+    off_t to;
+    upl_t upl;
+    upl_page_info_t *pl;
+    vm_offset_t kaddr;
+    bool valid;
+    int flags;
+
+    if (!vnode_isreg(vp) || fuse_isdirectio(vp) || fuse_isnoubc(vp)) {
+        return;
+    }
+
+    fuse_lck_rw_lock_exclusive(fvdat->truncatelock);
+
+    /* Invalidations that came earlier must not wipe what follows. */
+    fuse_vnode_inval_apply(vp);
+    fuse_invalidate_extents(vp);
+
+    if (end > fvdat->filesize) {
+        fvdat->filesize = end;
+        ubc_setsize(vp, end);
+    }
+
+    for (pgoff = offset & ~PAGE_MASK_64; pgoff < end; pgoff += PAGE_SIZE) {
+        from = max(offset, pgoff);
+        to = min(end, pgoff + PAGE_SIZE);
+
+        if (ubc_create_upl(vp, pgoff, PAGE_SIZE, &upl, &pl,
+                           UPL_FLAGS_NONE) != KERN_SUCCESS) {
+            break;
+        }
+
+        /*
+         * A page that is not cached yet can only be filled if all of it is
+         * known: it is covered whole or up to the end of the file.
+         */
+        valid = upl_valid_page(pl, 0);
+        if (!valid && ((from != pgoff) ||
+                       ((to != pgoff + PAGE_SIZE) && (to < fvdat->filesize)))) {
+            ubc_upl_abort_range(upl, 0, PAGE_SIZE, UPL_ABORT_FREE_ON_EMPTY);
+            continue;
+        }
+
+        if (ubc_upl_map(upl, &kaddr) != KERN_SUCCESS) {
+            ubc_upl_abort_range(upl, 0, PAGE_SIZE, UPL_ABORT_FREE_ON_EMPTY);
+            break;
+        }
+
+        if (!valid) {
+            bzero((void *)kaddr, PAGE_SIZE);
+        }
+        memcpy((char *)kaddr + (from - pgoff), buf + (from - offset),
+               (size_t)(to - from));
+
+        (void)ubc_upl_unmap(upl);
+
+        /* The page matches the daemon now, unless it held local writes. */
+        flags = UPL_COMMIT_FREE_ON_EMPTY;
+        if (!upl_dirty_page(pl, 0)) {
+            flags |= UPL_COMMIT_CLEAR_DIRTY;
+        }
+        ubc_upl_commit_range(upl, 0, PAGE_SIZE, flags);
+
+        OSAddAtomic64((SInt64)(to - from), (SInt64 *)&fuse_notify_store_bytes);
+    }
+
+    fuse_lck_rw_done(fvdat->truncatelock);
+}
+
+/*
+ * Answers a retrieve with the cached pages of the range, up to the first
+ * one that is not cached.
+ */
+static void
+fuse_internal_notify_retrieve_reply(struct fuse_data *data,
+                                    struct fuse_notify_work *work)
+{
+    struct fuse_dispatcher fdi;
+    struct fuse_notify_retrieve_in *fnri;
+    vnode_t vp = work->vp;
+    off_t offset = work->offset;
+    off_t end;
+    off_t pgoff;
+    off_t from;
+    off_t to;
+    upl_t upl;
+    upl_page_info_t *pl;
+    vm_offset_t kaddr;
+    char *buf = NULL;
+    size_t size = 0;
+
+    end = offset + min(work->size, (size_t)data->max_write);
+    if (vp && (end > VTOFUD(vp)->filesize)) {
+        end = VTOFUD(vp)->filesize;
+    }
+
+    if (vp && (end > offset) && vnode_isreg(vp) && !fuse_isdirectio(vp)) {
+        buf = FUSE_OSMalloc((size_t)(end - offset), fuse_malloc_tag);
+    }
+
+    for (pgoff = offset & ~PAGE_MASK_64; buf && (pgoff < end);
+         pgoff += PAGE_SIZE) {
+        from = max(offset, pgoff);
+        to = min(end, pgoff + PAGE_SIZE);
+
+        if (ubc_create_upl(vp, pgoff, PAGE_SIZE, &upl, &pl,
+                           UPL_FLAGS_NONE) != KERN_SUCCESS) {
+            break;
+        }
+
+        if (!upl_valid_page(pl, 0) ||
+            (ubc_upl_map(upl, &kaddr) != KERN_SUCCESS)) {
+            ubc_upl_abort_range(upl, 0, PAGE_SIZE, UPL_ABORT_FREE_ON_EMPTY);
+            break;
+        }
+
+        memcpy(buf + size, (char *)kaddr + (from - pgoff), (size_t)(to - from));
+        size += to - from;
+
+        (void)ubc_upl_unmap(upl);
+        ubc_upl_abort_range(upl, 0, PAGE_SIZE, UPL_ABORT_FREE_ON_EMPTY);
+    }
+
+    fuse_dispatcher_init(&fdi, sizeof(*fnri) + size);
+    fuse_dispatcher_make(&fdi, FUSE_NOTIFY_REPLY, data->mp, work->nodeid, NULL);
+    fdi.finh->unique = work->unique;
+
+    fnri = fdi.indata;
+    bzero(fnri, sizeof(*fnri));
+    fnri->offset = offset;
+    fnri->size = (uint32_t)size;
+    if (size) {
+        memcpy((char *)fdi.indata + sizeof(*fnri), buf, size);
+    }
+
+    /* The daemon does not answer a retrieve reply. */
+    fdi.ticket->invalid = true;
+    fuse_insert_message(fdi.ticket);
+
+    if (buf) {
+        FUSE_OSFree(buf, (size_t)(end - offset), fuse_malloc_tag);
+    }
+}
+
+static void
+fuse_internal_notify_worker(void *param, __unused wait_result_t wr)
+{
+    struct fuse_data *data = param;
+    struct fuse_notify_work *work;
+
+    for (;;) {
+        fuse_lck_mtx_lock(data->notify_mtx);
+        work = STAILQ_FIRST(&data->notify_head);
+        if (!work) {
+            data->notify_running = false;
+            fuse_wakeup(&data->notify_head);
+            fuse_lck_mtx_unlock(data->notify_mtx);
+            break;
+        }
+        STAILQ_REMOVE_HEAD(&data->notify_head, link);
+        fuse_lck_mtx_unlock(data->notify_mtx);
+
+        /* The vid tells whether the vnode was recycled since. */
+        if (work->vp && vnode_getwithvid(work->vp, work->vid)) {
+            work->vp = NULLVP;
+        }
+        if (work->vp && fuse_isdeadfs(work->vp)) {
+            vnode_put(work->vp);
+            work->vp = NULLVP;
+        }
+
+        if (work->code == FUSE_NOTIFY_VNODE) {
+            if (work->vp && work->purge) {
+                cache_purge(work->vp);
+            }
+            if (work->vp && work->hint) {
+                fuse_vnode_notify(work->vp, work->hint);
+            }
+        } else if (work->code == FUSE_NOTIFY_STORE) {
+            if (work->vp) {
+                fuse_internal_notify_store_apply(work->vp, work->offset,
+                                                 work->data, work->size);
+            }
+        } else if (!data->dead) {
+            fuse_internal_notify_retrieve_reply(data, work);
+        }
+
+        if (work->vp) {
+            vnode_put(work->vp);
+        }
+
+        FUSE_OSFree(work, work->allocsize, fuse_malloc_tag);
+    }
+
+    thread_terminate(current_thread());
+}
+
+static int
+fuse_internal_notify_queue(struct fuse_data *data, struct fuse_notify_work *work)
+{
+    thread_t thread;
+    bool start = false;
+
+    fuse_lck_mtx_lock(data->notify_mtx);
+    STAILQ_INSERT_TAIL(&data->notify_head, work, link);
+    if (!data->notify_running) {
+        data->notify_running = true;
+        start = true;
+    }
+    fuse_lck_mtx_unlock(data->notify_mtx);
+
+    if (start) {
+        if (kernel_thread_start(fuse_internal_notify_worker, data,
+                                &thread) != KERN_SUCCESS) {
+            log("fuse4x: cannot start the notification worker\n");
+            fuse_lck_mtx_lock(data->notify_mtx);
+            data->notify_running = false;
+            fuse_lck_mtx_unlock(data->notify_mtx);
+            fuse_internal_notify_drain(data);
+            return ENOMEM;
+        }
+        thread_deallocate(thread);
+    }
+
+    return 0;
+}
+
+/*
+ * Waits for the worker to go idle or, if it could not be started, throws
+ * the queued work away.
+ */
+__private_extern__
+void
+fuse_internal_notify_drain(struct fuse_data *data)
+{
+    struct fuse_notify_work *work;
+
+    fuse_lck_mtx_lock(data->notify_mtx);
+    while (data->notify_running) {
+        (void)fuse_msleep(&data->notify_head, data->notify_mtx, PDROP,
+                          "fu_ntfy", NULL);
+        fuse_lck_mtx_lock(data->notify_mtx);
+    }
+    while ((work = STAILQ_FIRST(&data->notify_head))) {
+        STAILQ_REMOVE_HEAD(&data->notify_head, link);
+        FUSE_OSFree(work, work->allocsize, fuse_malloc_tag);
+    }
+    fuse_lck_mtx_unlock(data->notify_mtx);
+}
+
+static struct fuse_notify_work *
+fuse_internal_notify_work_alloc(struct fuse_data *data, int code,
+                                uint64_t nodeid, size_t datasize)
+{
+    struct fuse_notify_work *work;
+    struct fuse_vnode_data *fvdat;
+    size_t allocsize = sizeof(*work) + datasize;
+
+    work = FUSE_OSMalloc(allocsize, fuse_malloc_tag);
+    if (!work) {
+        return NULL;
+    }
+
+    bzero(work, sizeof(*work));
+    work->code = code;
+    work->nodeid = nodeid;
+    work->allocsize = allocsize;
+
+    fuse_lck_mtx_lock(data->node_mtx);
+    fvdat = fuse_internal_notify_node(data, nodeid);
+    if (fvdat) {
+        work->vp = fvdat->vp;
+        work->vid = vnode_vid(fvdat->vp);
+    }
+    fuse_lck_mtx_unlock(data->node_mtx);
+
+    return work;
+}
+
+/*
+ * Has the worker purge the names of a node and post a kevent for it. Must
+ * be called without node_mtx held.
+ */
+__private_extern__
+void
+fuse_internal_notify_vnode(struct fuse_data *data, uint64_t nodeid,
+                           bool purge, long hint)
+{
+    struct fuse_notify_work *work;
+
+    work = fuse_internal_notify_work_alloc(data, FUSE_NOTIFY_VNODE, nodeid, 0);
+    if (!work) {
+        return;
+    }
+
+    if (!work->vp) {
+        FUSE_OSFree(work, work->allocsize, fuse_malloc_tag);
+        return;
+    }
+
+    work->purge = purge;
+    work->hint = hint;
+
+    (void)fuse_internal_notify_queue(data, work);
+}
+
+static int
+fuse_internal_notify_store(struct fuse_data *data, uio_t uio)
+{
+    struct fuse_notify_store_out fnso;
+    struct fuse_notify_work *work;
+    int err;
+
+    if (uio_resid(uio) < (user_ssize_t)sizeof(fnso)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fnso, (int)sizeof(fnso), uio))) {
+        return err;
+    }
+
+    if ((uio_resid(uio) != (user_ssize_t)fnso.size) ||
+        (fnso.offset > (uint64_t)(OFF_MAX - fnso.size))) {
+        return EINVAL;
+    }
+
+    if (fnso.size > data->userkernel_bufsize) {
+        return EFBIG;
+    }
+
+    work = fuse_internal_notify_work_alloc(data, FUSE_NOTIFY_STORE,
+                                           fnso.nodeid, fnso.size);
+    if (!work) {
+        return ENOMEM;
+    }
+
+    if (!work->vp) {
+        FUSE_OSFree(work, work->allocsize, fuse_malloc_tag);
+        return ENOENT;
+    }
+
+    work->offset = (off_t)fnso.offset;
+    work->size = fnso.size;
+
+    if ((err = uiomove(work->data, (int)fnso.size, uio))) {
+        FUSE_OSFree(work, work->allocsize, fuse_malloc_tag);
+        return err;
+    }
+
+    return fuse_internal_notify_queue(data, work);
+}
+
+static int
+fuse_internal_notify_retrieve(struct fuse_data *data, uio_t uio)
+{
+    struct fuse_notify_retrieve_out fnro;
+    struct fuse_notify_work *work;
+    int err;
+
+    if (uio_resid(uio) != (user_ssize_t)sizeof(fnro)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fnro, (int)sizeof(fnro), uio))) {
+        return err;
+    }
+
+    if (fnro.offset > (uint64_t)(OFF_MAX - fnro.size)) {
+        return EINVAL;
+    }
+
+    work = fuse_internal_notify_work_alloc(data, FUSE_NOTIFY_RETRIEVE,
+                                           fnro.nodeid, 0);
+    if (!work) {
+        return ENOMEM;
+    }
+
+    if (!work->vp) {
+        FUSE_OSFree(work, work->allocsize, fuse_malloc_tag);
+        return ENOENT;
+    }
+
+    work->unique = fnro.notify_unique;
+    work->offset = (off_t)fnro.offset;
+    work->size = fnro.size;
+
+    return fuse_internal_notify_queue(data, work);
+}
+
+/* Handles an unsolicited message (unique == 0) from the daemon. */
+__private_extern__
+int
+fuse_internal_notify(struct fuse_data *data, int code, uio_t uio)
+{
+    OSIncrementAtomic((SInt32 *)&fuse_notifications);
+
+    switch (code) {
+    case FUSE_NOTIFY_INVAL_INODE:
+        return fuse_internal_notify_inval_inode(data, uio);
+
+    case FUSE_NOTIFY_INVAL_ENTRY:
+        return fuse_internal_notify_inval_entry(data, uio);
+
+    case FUSE_NOTIFY_STORE:
+        return fuse_internal_notify_store(data, uio);
+
+    case FUSE_NOTIFY_RETRIEVE:
+        return fuse_internal_notify_retrieve(data, uio);
+
+    case FUSE_NOTIFY_DELETE:
+        return fuse_internal_notify_delete(data, uio);
+
+    default:
+        return EINVAL;
+    }
+}
+
+/* open */
+
+/*
+ * Acts on the open flags the daemon answered FUSE_OPEN with: a direct_io
+ * file leaves the page cache for good, and FOPEN_PURGE_UBC (with
+ * FOPEN_PURGE_ATTR) throws away what is cached of it. Returns true if the
+ * vnode is direct_io.
+ */
+__private_extern__
+bool
+fuse_internal_open_flags(vnode_t                 vp,
+                         struct fuse_filehandle *fufh,
+                         vfs_context_t           context)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    long hint = 0;
+
+    if ((fufh->fuse_open_flags & FOPEN_DIRECT_IO) || (fuse_isdirectio(vp))) {
+        /*
+         * direct_io for a vnode implies:
+         * - no ubc for the vnode
+         * - no readahead for the vnode
+         * - nosyncwrites disabled FOR THE ENTIRE MOUNT
+         * - no vncache for the vnode (handled in lookup)
+         */
+        ubc_msync(vp, (off_t)0, ubc_getsize(vp), NULL,
+                  UBC_PUSHALL | UBC_INVALIDATE);
+        vnode_setnocache(vp);
+        vnode_setnoreadahead(vp);
+        fuse_clearnosyncwrites_mp(vnode_mount(vp));
+        fvdat->flag |= FN_DIRECT_IO;
+        return true;
+    }
+
+    if (fufh->fuse_open_flags & FOPEN_PURGE_UBC) {
+        ubc_msync(vp, (off_t)0, ubc_getsize(vp), NULL,
+                  UBC_PUSHALL | UBC_INVALIDATE);
+        fufh->fuse_open_flags &= ~FOPEN_PURGE_UBC;
+        hint |= NOTE_WRITE;
+        if (fufh->fuse_open_flags & FOPEN_PURGE_ATTR) {
+            struct fuse_dispatcher fdi;
+            fuse_invalidate_attr(vp);
+            hint |= NOTE_ATTRIB;
+
+            fuse_dispatcher_init(&fdi, sizeof(struct fuse_getattr_in));
+            fuse_dispatcher_make_vp(&fdi, FUSE_GETATTR, vp, context);
+            bzero(fdi.indata, sizeof(struct fuse_getattr_in));
+
+            int serr = fuse_dispatcher_wait_answer(&fdi);
+            if (!serr) {
+                /* XXX: Could check the sanity/volatility of va_mode here. */
+                if ((((struct fuse_attr_out*)fdi.answer)->attr.mode & S_IFMT)) {
+                    cache_attrs(vp, (struct fuse_attr_out *)fdi.answer);
+                    off_t new_filesize =
+                        ((struct fuse_attr_out *)fdi.answer)->attr.size;
+                    if (new_filesize > fvdat->filesize) {
+                        hint |= NOTE_EXTEND;
+                    }
+                    fuse_lck_rw_lock_exclusive(fvdat->truncatelock);
+                    fvdat->filesize = new_filesize;
+                    ubc_setsize(vp, (off_t)new_filesize);
+                    fuse_lck_rw_done(fvdat->truncatelock);
+                }
+                fuse_ticket_drop(fdi.ticket);
+            }
+            fufh->fuse_open_flags &= ~FOPEN_PURGE_ATTR;
+        }
+        fuse_vnode_notify(vp, hint);
+    }
+
+    return false;
+}
+
+/*
+ * With lazy_open, sends the FUSE_OPEN the handle of an I/O still owes the
+ * daemon and acts on its open flags as open(2) would have. read, write and
+ * mmap call this before they pick a path, where pages may be pushed and
+ * dropped and the vnode may still turn direct_io. A handle that strategy
+ * or another helper had to open gets its flags acted on by the next of
+ * them. Falls back to the FUFH_RDWR handle as the I/O itself does. Called
+ * without fufh_mtx held.
+ */
+__private_extern__
+int
+fuse_internal_open_late(vnode_t       vp,
+                        fufh_type_t   fufh_type,
+                        vfs_context_t context)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_filehandle *fufh;
+    bool unapplied = false;
+    int err;
+
+    fuse_lck_mtx_lock(fvdat->fufh_mtx);
+    if (!FUFH_IS_VALID(&(fvdat->fufh[fufh_type]))) {
+        fufh_type = FUFH_RDWR;
+    }
+    fufh = &(fvdat->fufh[fufh_type]);
+    err = fuse_filehandle_realize(vp, context, fufh_type);
+    if (!err) {
+        unapplied = fufh->unapplied;
+        fufh->unapplied = false;
+    }
+    fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+
+    if (unapplied) {
+        (void)fuse_internal_open_flags(vp, fufh, context);
+    }
+
+    return err;
+}
+
+/* readdir */
+
+/* Sizes of the Darwin dirents for a name of the given length. */
+#define FUSE_DIRENT_COOKED_SIZE(namelen) \
+    ((sizeof(struct dirent) - (FUSE_MAXNAMLEN + 1)) + (((namelen) + 1 + 3) & ~3))
+#define FUSE_DIRENTRY_COOKED_SIZE(namelen) \
+    ((offsetof(struct direntry, d_name) + (namelen) + 1 + 7) & ~7)
+
+/*
+ * Stores an entry at buf as a classic dirent or, for getdirentries64() and
+ * the NFS server (VNODE_READDIR_EXTENDED), as a direntry carrying the full
+ * inode number and the cookie to resume the listing after it. Returns the
+ * record length.
+ */
+static size_t
+fuse_internal_readdir_emit(void       *buf,
+                           bool        extended,
+                           uint64_t    ino,
+                           uint64_t    seekoff,
+                           uint8_t     type,
+                           uint16_t    namelen,
+                           const char *name)
+{
+    size_t reclen;
+
+    if (extended) {
+        struct direntry *dep = (struct direntry *)buf;
+
+        reclen = FUSE_DIRENTRY_COOKED_SIZE(namelen);
+        dep->d_ino     = ino;
+        dep->d_seekoff = seekoff;
+        dep->d_reclen  = reclen;
+        dep->d_namlen  = namelen;
+        dep->d_type    = type;
+        memcpy(dep->d_name, name, namelen);
+        bzero(dep->d_name + namelen,
+              reclen - offsetof(struct direntry, d_name) - namelen);
+    } else {
+        struct dirent *de = (struct dirent *)buf;
+
+        reclen = FUSE_DIRENT_COOKED_SIZE(namelen);
+#ifdef _DARWIN_FEATURE_64_BIT_INODE
+        de->d_ino = ino;
+#else
+        de->d_ino = (ino_t)ino; /* XXX: truncation */
+#endif /* _DARWIN_FEATURE_64_BIT_INODE */
+        de->d_reclen = reclen;
+        de->d_type   = type;
+        de->d_namlen = namelen;
+        memcpy(de->d_name, name, namelen);
+        bzero(de->d_name + namelen,
+              reclen - (sizeof(struct dirent) - (FUSE_MAXNAMLEN + 1)) -
+              namelen);
+    }
+
+    return reclen;
+}
+
+/* Converts a FUSE dirent into a Darwin one at buf. */
+static __inline__
+size_t
+fuse_internal_readdir_cook(mount_t mp, struct fuse_dirent *fudge, void *buf,
+                           bool extended)
+{
+    uint64_t ino = fudge->ino;
+    uint8_t type = fudge->type;
+
+    /* Filter out any ._* files if the mount is configured as such. */
+    if (fuse_skip_apple_double_mp(mp, fudge->name, fudge->namelen)) {
+        ino = 0;
+        type = DT_WHT;
+    }
+
+    return fuse_internal_readdir_emit(buf, extended, ino, fudge->off, type,
+                                      fudge->namelen, fudge->name);
+}
+
+/*
+ * READDIRPLUS costs the daemon a lookup per entry and makes the replies much
+ * bigger, so only use it when the entries are likely to be looked up: for the
+ * first batch of a listing and whenever names in the directory went to the
+ * daemon since the previous batch.
+ */
+static __inline__
+bool
+fuse_internal_readdir_useplus(vnode_t vp, uio_t uio)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+
+    if (!fuse_isreaddirplus_mp(vnode_mount(vp))) {
+        return false;
+    }
+
+    if (fvdat->c_flag & C_ADVISE_RDPLUS) {
+        fvdat->c_flag &= ~C_ADVISE_RDPLUS;
+        return true;
+    }
+
+    return (uio_offset(uio) == 0);
+}
+
+/*
+ * The daemon took a lookup reference for every READDIRPLUS entry other than
+ * "." and "..". Keep it in the entry's vnode, with the attributes and name
+ * cached, or give it back right away.
+ */
+static void
+fuse_internal_readdir_link(vnode_t                dvp,
+                           struct fuse_direntplus *fudgeplus,
+                           vfs_context_t          context)
+{
+    struct fuse_entry_out *feo = &fudgeplus->entry_out;
+    const char *name = fudgeplus->dirent.name;
+    size_t namelen = fudgeplus->dirent.namelen;
+    mount_t mp = vnode_mount(dvp);
+    struct fuse_dispatcher fdi;
+    struct componentname cn;
+    vnode_t vp = NULLVP;
+    vnode_t cvp = NULLVP;
+
+    if (!feo->nodeid) {
+        return;
+    }
+
+    if ((name[0] == '.') &&
+        ((namelen == 1) || ((namelen == 2) && (name[1] == '.')))) {
+        return;
+    }
+
+    if (((feo->attr.mode & S_IFMT) == 0) || (feo->nodeid == FUSE_ROOT_ID) ||
+        fuse_skip_apple_double_mp(mp, (char *)name, namelen) ||
+        FSNodeGetOrCreateFileVNodeByID(&vp, false, feo, mp, dvp,
+                                       context, NULL)) {
+        fuse_internal_forget_send(mp, context, feo->nodeid, 1, &fdi);
+        return;
+    }
+
+    VTOFUD(vp)->nlookup++;
+
+    /* ATTR_FUDGE_CASE */
+    if (vnode_isreg(vp) && fuse_isnoubc(vp)) {
+        VTOFUD(vp)->filesize = feo->attr.size;
+    }
+
+    cache_attrs(vp, feo);
+
+    if (!fuse_isnovncache_mp(mp)) {
+        bzero(&cn, sizeof(cn));
+        cn.cn_nameiop = LOOKUP;
+        cn.cn_flags = MAKEENTRY | ISLASTCN;
+        cn.cn_nameptr = (char *)name;
+        cn.cn_namelen = (int)namelen;
+
+        switch (fuse_vncache_lookup(dvp, &cvp, &cn)) {
+        case 0:
+            fuse_vncache_enter(dvp, vp, &cn);
+            break;
+        case -1:
+            vnode_put(cvp);
+            break;
+        default:
+            break;
+        }
+    }
+
+    vnode_put(vp);
+}
+
+/* Links every entry of a READDIRPLUS reply, see above. */
+static void
+fuse_internal_readdir_linkall(vnode_t       vp,
+                              void         *buf,
+                              size_t        bufsize,
+                              vfs_context_t context)
+{
+    struct fuse_direntplus *fudgeplus;
+    size_t freclen;
+
+    while (bufsize >= FUSE_NAME_OFFSET_DIRENTPLUS) {
+        fudgeplus = (struct fuse_direntplus *)buf;
+        freclen = FUSE_DIRENTPLUS_SIZE(fudgeplus);
+
+        if ((bufsize < freclen) || !fudgeplus->dirent.namelen ||
+            (fudgeplus->dirent.namelen > FUSE_MAXNAMLEN)) {
+            break;
+        }
+
+        fuse_internal_readdir_link(vp, fudgeplus, context);
+
+        buf = (char *)buf + freclen;
+        bufsize -= freclen;
+    }
+}
+
+/* Size of the buffered entry at pos, or 0 if there is no complete one. */
+static size_t
+fuse_internal_readdir_reclen(struct fuse_dirbuf *dirbuf, size_t pos,
+                             struct fuse_dirent **fudgep)
+{
+    size_t nameoff = dirbuf->plus ? FUSE_NAME_OFFSET_DIRENTPLUS : FUSE_NAME_OFFSET;
+    void *buf = (char *)dirbuf->data + pos;
+    size_t freclen;
+
+    if (dirbuf->len - pos < nameoff) {
+        return 0;
+    }
+
+    if (dirbuf->plus) {
+        *fudgep = &((struct fuse_direntplus *)buf)->dirent;
+        freclen = FUSE_DIRENTPLUS_SIZE((struct fuse_direntplus *)buf);
+    } else {
+        *fudgep = (struct fuse_dirent *)buf;
+        freclen = FUSE_DIRENT_SIZE(*fudgep);
+    }
+
+    return (dirbuf->len - pos < freclen) ? 0 : freclen;
+}
+
+/*
+ * Finds the entry of the buffered reply at which a listing resumes. The
+ * first entry is never matched: a read from the start of the buffer (e.g.
+ * after rewinddir(3)) asks the daemon again so that it sees fresh contents.
+ */
+static bool
+fuse_internal_readdir_bufpos(struct fuse_dirbuf *dirbuf, off_t offset,
+                             size_t *pos)
+{
+    struct fuse_dirent *fudge;
+    size_t freclen;
+    size_t cur = 0;
+
+    while ((freclen = fuse_internal_readdir_reclen(dirbuf, cur, &fudge))) {
+        cur += freclen;
+
+        if ((off_t)fudge->off == offset) {
+            /* Resume only if a complete entry follows. */
+            if (!fuse_internal_readdir_reclen(dirbuf, cur, &fudge)) {
+                return false;
+            }
+            *pos = cur;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Feeds a reply that was just fetched into the listing being built for the
+ * directory cache. Listings are built from the start, batch after batch;
+ * a reply that does not continue the listing, or running out of budget,
+ * abandons it. The empty reply at the end publishes it. gen is the
+ * directory cache generation sampled before the reply was asked for, so
+ * a change made while the first batch was in flight drops the listing.
+ */
+static void
+fuse_internal_dircache_fill(vnode_t vp, struct fuse_dirbuf *dirbuf,
+                            uint32_t gen)
+{
+    struct fuse_dircache *fill = dirbuf->fill;
+    struct fuse_dirent *fudge;
+    mount_t mp = vnode_mount(vp);
+    size_t freclen;
+    size_t cur = 0;
+
+    dirbuf->fill = NULL;
+
+    if (dirbuf->offset == 0) {
+        if (fill) {
+            fuse_dircache_release(fill);
+        }
+        dirbuf->fill_gen = gen;
+        if (!(fill = fuse_dircache_alloc())) {
+            return;
+        }
+    } else if (!fill || (dirbuf->offset != dirbuf->fill_next)) {
+        goto abandon;
+    }
+
+    if (dirbuf->len == 0) {
+        fuse_dircache_publish(vp, fill, dirbuf->fill_gen);
+        return;
+    }
+
+    while ((freclen = fuse_internal_readdir_reclen(dirbuf, cur, &fudge))) {
+        if (!fudge->namelen || (fudge->namelen > FUSE_MAXNAMLEN)) {
+            goto abandon;
+        }
+
+        if (!fuse_dircache_grow(fill,
+                                FUSE_DIRENTRY_COOKED_SIZE(fudge->namelen))) {
+            goto abandon;
+        }
+
+        fill->len += fuse_internal_readdir_cook(mp, fudge,
+                                                (char *)fill->data + fill->len,
+                                                true);
+
+        dirbuf->fill_next = fudge->off;
+        cur += freclen;
+    }
+
+    dirbuf->fill = fill;
+    return;
+
+abandon:
+    if (fill) {
+        fuse_dircache_release(fill);
+    }
+}
+
+/*
+ * Answers a listing from the directory cache. Returns false if the offset
+ * the listing resumes at is not one of the cached cookies.
+ */
+static bool
+fuse_internal_dircache_read(struct fuse_dircache *dc,
+                            uio_t                 uio,
+                            bool                  extended,
+                            struct fuse_iov      *cookediov,
+                            int                  *numdirent,
+                            int                  *errp)
+{
+    off_t offset = uio_offset(uio);
+    off_t lastoff = offset;
+    size_t pos = 0;
+    size_t reclen;
+    size_t cookedlen = 0;
+    size_t cookedmax;
+    struct direntry *dep;
+    int n = 0;
+    int err = 0;
+
+    if (offset != 0) {
+        bool found = false;
+
+        while (pos < dc->len) {
+            dep = (struct direntry *)((char *)dc->data + pos);
+            pos += dep->d_reclen;
+            if ((off_t)dep->d_seekoff == offset) {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found) {
+            return false;
+        }
+    }
+
+    cookedmax = min((size_t)uio_resid(uio), dc->len);
+    fiov_adjust(cookediov, cookedmax);
+
+    while (pos < dc->len) {
+        dep = (struct direntry *)((char *)dc->data + pos);
+
+        reclen = extended ? dep->d_reclen :
+                            FUSE_DIRENT_COOKED_SIZE(dep->d_namlen);
+        if (reclen > cookedmax - cookedlen) {
+            break;
+        }
+
+        if (extended) {
+            memcpy((char *)cookediov->base + cookedlen, dep, reclen);
+        } else {
+            (void)fuse_internal_readdir_emit((char *)cookediov->base + cookedlen,
+                                             false, dep->d_ino, dep->d_seekoff,
+                                             dep->d_type, dep->d_namlen,
+                                             dep->d_name);
+        }
+        cookedlen += reclen;
+        lastoff = (off_t)dep->d_seekoff;
+        n++;
+
+        pos += dep->d_reclen;
+    }
+
+    if (cookedlen) {
+        err = uiomove(cookediov->base, (int)cookedlen, uio);
+        if (!err) {
+            uio_setoffset(uio, lastoff);
+        }
+    }
+
+    if (!err && numdirent) {
+        *numdirent = n;
+    }
+
+    *errp = err;
+
+    return true;
+}
+
+/*
+ * Asks the daemon for a full batch of entries regardless of the size of the
+ * caller's buffer and keeps the reply in the directory handle. Later calls
+ * that resume inside it are served from there, so small getdirentries(2)
+ * buffers do not turn into one upcall each.
+ */
+__private_extern__
+int
+fuse_internal_readdir(vnode_t                 vp,
+                      uio_t                   uio,
+                      bool                    extended,
+                      vfs_context_t           context,
+                      struct fuse_filehandle *fufh,
+                      struct fuse_iov        *cookediov,
+                      int                    *numdirent)
+{
+    int err = 0;
+    struct fuse_dispatcher  fdi;
+    struct fuse_read_in    *fri;
+    struct fuse_data       *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_dirbuf     *dirbuf;
+    size_t pos;
+    off_t offset;
+    uint32_t gen;
+    bool plus;
+
+    if (uio_resid(uio) == 0) {
+        return 0;
+    }
+
+    if (fufh->fuse_open_flags & FOPEN_CACHE_DIR) {
+        struct fuse_dircache *dc = fuse_dircache_get(vp);
+        if (dc) {
+            bool served = fuse_internal_dircache_read(dc, uio, extended,
+                                                      cookediov, numdirent,
+                                                      &err);
+            fuse_dircache_release(dc);
+            if (served) {
+                OSIncrementAtomic((SInt32 *)&fuse_dircache_hits);
+                return err;
+            }
+        }
+    }
+
+    /* The buffer is ours until we are done. */
+    fuse_lck_mtx_lock(fvdat->fufh_mtx);
+    dirbuf = fufh->dirbuf;
+    fufh->dirbuf = NULL;
+    fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+
+    /* Note that we DO NOT have a UIO_SYSSPACE here (so no need for p2p I/O). */
+
+    while (uio_resid(uio) > 0) {
+
+        offset = uio_offset(uio);
+
+        if (dirbuf && fuse_internal_readdir_bufpos(dirbuf, offset, &pos)) {
+            OSIncrementAtomic((SInt32 *)&fuse_readdir_upcalls_avoided);
+        } else {
+            plus = fuse_internal_readdir_useplus(vp, uio);
+            gen = fuse_dircache_gen(vp);
+
+            fuse_dispatcher_init(&fdi, sizeof(*fri));
+            fuse_dispatcher_make_vp(&fdi,
+                                    plus ? FUSE_READDIRPLUS : FUSE_READDIR,
+                                    vp, context);
+
+            fri = fdi.indata;
+            fri->fh = fufh->fh_id;
+            fri->offset = offset;
+            fri->size = (typeof(fri->size))min((size_t)FUSE_READDIR_BUFSIZE,
+                                               data->iosize);
+
+            if ((err = fuse_dispatcher_wait_answer(&fdi))) {
+                break;
+            }
+
+            if (!dirbuf) {
+                dirbuf = FUSE_OSMalloc(sizeof(struct fuse_dirbuf),
+                                       fuse_malloc_tag);
+                if (!dirbuf) {
+                    err = ENOMEM;
+                } else {
+                    bzero(dirbuf, sizeof(struct fuse_dirbuf));
+                }
+            }
+
+            if (dirbuf && (dirbuf->allocsize < fdi.iosize)) {
+                if (dirbuf->data) {
+                    FUSE_OSFree(dirbuf->data, dirbuf->allocsize,
+                                fuse_malloc_tag);
+                }
+                dirbuf->len = 0;
+                dirbuf->allocsize = fdi.iosize;
+                dirbuf->data = FUSE_OSMalloc(dirbuf->allocsize,
+                                             fuse_malloc_tag);
+                if (!dirbuf->data) {
+                    dirbuf->allocsize = 0;
+                    err = ENOMEM;
+                }
+            }
+
+            if (plus) {
+                fuse_internal_readdir_linkall(vp, fdi.answer, fdi.iosize,
+                                              context);
+            }
+
+            if (!err) {
+                memcpy(dirbuf->data, fdi.answer, fdi.iosize);
+                dirbuf->len = fdi.iosize;
+                dirbuf->offset = offset;
+                dirbuf->plus = plus;
+
+                if (fufh->fuse_open_flags & FOPEN_CACHE_DIR) {
+                    fuse_internal_dircache_fill(vp, dirbuf, gen);
+                }
+            }
+
+            fuse_ticket_drop(fdi.ticket);
+
+            if (err) {
+                break;
+            }
+
+            pos = 0;
+        }
+
+        if ((err = fuse_internal_readdir_processdata(vp,
+                                                     uio,
+                                                     dirbuf->len - pos,
+                                                     (char *)dirbuf->data + pos,
+                                                     dirbuf->len - pos,
+                                                     cookediov,
+                                                     numdirent,
+                                                     dirbuf->plus,
+                                                     extended))) {
+            break;
+        }
+    }
+
+    if (dirbuf) {
+        fuse_lck_mtx_lock(fvdat->fufh_mtx);
+        if (!fufh->dirbuf) {
+            fufh->dirbuf = dirbuf;
+            dirbuf = NULL;
+        }
+        fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+        if (dirbuf) {
+            fuse_dirbuf_free(dirbuf);
+        }
+    }
+
+    return ((err == -1) ? 0 : err);
+}
+
+/*
+ * Converts a whole READDIR(PLUS) reply into Darwin dirents in cookediov and
+ * hands them to the caller with a single uiomove().
+ */
+__private_extern__
+int
+fuse_internal_readdir_processdata(vnode_t          vp,
+                                  uio_t            uio,
+                         __unused size_t           reqsize,
+                                  void            *buf,
+                                  size_t           bufsize,
+                                  struct fuse_iov *cookediov,
+                                  int             *numdirent,
+                                  bool             plus,
+                                  bool             extended)
+{
+    int err = 0;
+    int cou = 0;
+    int n   = 0;
+    size_t bytesavail;
+    size_t freclen;
+    size_t nameoff = plus ? FUSE_NAME_OFFSET_DIRENTPLUS : FUSE_NAME_OFFSET;
+    size_t cookedlen = 0;
+    size_t cookedmax;
+    off_t lastoff = 0;
+    mount_t mp = vnode_mount(vp);
+
+    struct fuse_dirent     *fudge;
+    struct fuse_direntplus *fudgeplus = NULL;
+
+    if (bufsize < nameoff) {
+        return -1;
+    }
+
+    /*
+     * A Darwin dirent, even an extended one, is never larger than the FUSE
+     * one it comes from.
+     */
+    cookedmax = min((size_t)uio_resid(uio), bufsize);
+    fiov_adjust(cookediov, cookedmax);
+
+    for (;;) {
+
+        if (bufsize < nameoff) {
+            err = 0; /* reply consumed, the caller may ask for more */
+            break;
+        }
+
+        if (plus) {
+            fudgeplus = (struct fuse_direntplus *)buf;
+            fudge = &fudgeplus->dirent;
+            freclen = FUSE_DIRENTPLUS_SIZE(fudgeplus);
+        } else {
+            fudge = (struct fuse_dirent *)buf;
+            freclen = FUSE_DIRENT_SIZE(fudge);
+        }
+
+        cou++;
+
+        if (bufsize < freclen) {
+            err = ((cou == 1) ? -1 : 0);
+            break;
+        }
+
+        /*
+         * if (isbzero(buf, FUSE_NAME_OFFSET)) {
+         *     // zero-pad incomplete buffer
+         *     ...
+         *     err = -1;
+         *     break;
+         * }
+         */
+
+        if (!fudge->namelen) {
+            err = EINVAL;
+            break;
+        }
+
+        if (fudge->namelen > FUSE_MAXNAMLEN) {
+            err = EIO;
+            break;
+        }
+
+        bytesavail = extended ? FUSE_DIRENTRY_COOKED_SIZE(fudge->namelen) :
+                                FUSE_DIRENT_COOKED_SIZE(fudge->namelen);
+
+        if (bytesavail > cookedmax - cookedlen) {
+            err = -1;
+            break;
+        }
+
+        (void)fuse_internal_readdir_cook(mp, fudge,
+                                         (char *)cookediov->base + cookedlen,
+                                         extended);
+
+        cookedlen += bytesavail;
+        lastoff = fudge->off;
+        n++;
+
+        buf = (char *)buf + freclen;
+        bufsize -= freclen;
+    }
+
+    if (cookedlen) {
+        int moveerr = uiomove(cookediov->base, (int)cookedlen, uio);
+        if (moveerr) {
+            err = moveerr;
+        } else {
+            uio_setoffset(uio, lastoff);
+        }
+    }
+
+    if (!err && numdirent) {
+        *numdirent = n;
+    }
+
+    return err;
+}
+
+/* readdirattr */
+
+/* Attributes of the directory entries getdirentriesattr() can ask for. */
+#define FUSE_READDIRATTR_CMN                                               \
+    (ATTR_CMN_NAME | ATTR_CMN_DEVID | ATTR_CMN_FSID | ATTR_CMN_OBJTYPE |   \
+     ATTR_CMN_OBJTAG | ATTR_CMN_OBJID | ATTR_CMN_OBJPERMANENTID |          \
+     ATTR_CMN_PAROBJID | ATTR_CMN_SCRIPT | ATTR_CMN_CRTIME |               \
+     ATTR_CMN_MODTIME | ATTR_CMN_CHGTIME | ATTR_CMN_ACCTIME |              \
+     ATTR_CMN_BKUPTIME | ATTR_CMN_FNDRINFO | ATTR_CMN_OWNERID |            \
+     ATTR_CMN_GRPID | ATTR_CMN_ACCESSMASK | ATTR_CMN_FLAGS |               \
+     ATTR_CMN_USERACCESS | ATTR_CMN_FILEID | ATTR_CMN_PARENTID)
+#define FUSE_READDIRATTR_DIR (ATTR_DIR_LINKCOUNT | ATTR_DIR_MOUNTSTATUS)
+#define FUSE_READDIRATTR_FILE                                              \
+    (ATTR_FILE_LINKCOUNT | ATTR_FILE_TOTALSIZE | ATTR_FILE_ALLOCSIZE |     \
+     ATTR_FILE_IOBLOCKSIZE | ATTR_FILE_DEVTYPE | ATTR_FILE_DATALENGTH |    \
+     ATTR_FILE_DATAALLOCSIZE)
+
+/* Upper bound of a packed entry: the fixed attributes and the name. */
+#define FUSE_READDIRATTR_MAXENTRY (512 + FUSE_MAXNAMLEN + 1 + 3)
+
+#define FUSE_ATTR_PACK(p, type, value)  \
+do {                                    \
+    type v_ = (type)(value);            \
+    memcpy((p), &v_, sizeof(v_));       \
+    (p) += sizeof(v_);                  \
+} while (0)
+
+static __inline__
+void
+fuse_internal_readdirattr_packtime(char **pp, struct timespec *ts,
+                                   bool supported, bool is64)
+{
+    struct timespec zero = { 0, 0 };
+
+    if (!supported) {
+        ts = &zero;
+    }
+
+    if (is64) {
+        FUSE_ATTR_PACK(*pp, int64_t, ts->tv_sec);
+        FUSE_ATTR_PACK(*pp, int64_t, ts->tv_nsec);
+    } else {
+        FUSE_ATTR_PACK(*pp, int32_t, ts->tv_sec); /* XXX: truncation */
+        FUSE_ATTR_PACK(*pp, int32_t, ts->tv_nsec);
+    }
+}
+
+static uint32_t
+fuse_internal_readdirattr_useraccess(vnode_t vp, vfs_context_t context)
+{
+    uint32_t perms = 0;
+
+    if (vnode_isdir(vp)) {
+        if (!vnode_authorize(vp, NULL, KAUTH_VNODE_ACCESS |
+                             KAUTH_VNODE_LIST_DIRECTORY, context)) {
+            perms |= R_OK;
+        }
+        if (!vnode_authorize(vp, NULL, KAUTH_VNODE_ACCESS |
+                             KAUTH_VNODE_ADD_FILE |
+                             KAUTH_VNODE_ADD_SUBDIRECTORY |
+                             KAUTH_VNODE_DELETE_CHILD, context)) {
+            perms |= W_OK;
+        }
+        if (!vnode_authorize(vp, NULL, KAUTH_VNODE_ACCESS |
+                             KAUTH_VNODE_SEARCH, context)) {
+            perms |= X_OK;
+        }
+    } else {
+        if (!vnode_authorize(vp, NULL, KAUTH_VNODE_ACCESS |
+                             KAUTH_VNODE_READ_DATA, context)) {
+            perms |= R_OK;
+        }
+        if (!vnode_authorize(vp, NULL, KAUTH_VNODE_ACCESS |
+                             KAUTH_VNODE_WRITE_DATA, context)) {
+            perms |= W_OK;
+        }
+        if (!vnode_authorize(vp, NULL, KAUTH_VNODE_ACCESS |
+                             KAUTH_VNODE_EXECUTE, context)) {
+            perms |= X_OK;
+        }
+    }
+
+    return perms;
+}
+
+/*
+ * Packs the requested attributes of one entry in getattrlist() layout:
+ * the entry length, the fixed-size attributes in bit order and then the
+ * name. Returns the length of the entry.
+ */
+static size_t
+fuse_internal_readdirattr_pack(vnode_t            vp,
+                               struct attrlist   *alist,
+                               struct vnode_attr *vap,
+                               const char        *name,
+                               size_t             namelen,
+                               char              *buf,
+                               vfs_context_t      context)
+{
+    mount_t mp = vnode_mount(vp);
+    struct vfsstatfs *sfs = vfs_statfs(mp);
+    bool is64 = vfs_context_is64bit(context);
+    attrgroup_t attrs = alist->commonattr;
+    attrreference_t *nameref = NULL;
+    char *p = buf + sizeof(uint32_t);
+    off_t allocsize;
+
+    if (attrs & ATTR_CMN_NAME) {
+        nameref = (attrreference_t *)p;
+        p += sizeof(attrreference_t);
+    }
+    if (attrs & ATTR_CMN_DEVID) {
+        FUSE_ATTR_PACK(p, dev_t, sfs->f_fsid.val[0]);
+    }
+    if (attrs & ATTR_CMN_FSID) {
+        FUSE_ATTR_PACK(p, fsid_t, sfs->f_fsid);
+    }
+    if (attrs & ATTR_CMN_OBJTYPE) {
+        FUSE_ATTR_PACK(p, fsobj_type_t, vap->va_type);
+    }
+    if (attrs & ATTR_CMN_OBJTAG) {
+        FUSE_ATTR_PACK(p, fsobj_tag_t, vnode_tag(vp));
+    }
+    if (attrs & ATTR_CMN_OBJID) {
+        FUSE_ATTR_PACK(p, uint32_t, vap->va_fileid); /* XXX: truncation */
+        FUSE_ATTR_PACK(p, uint32_t, 0);
+    }
+    if (attrs & ATTR_CMN_OBJPERMANENTID) {
+        FUSE_ATTR_PACK(p, uint32_t, vap->va_fileid); /* XXX: truncation */
+        FUSE_ATTR_PACK(p, uint32_t, 0);
+    }
+    if (attrs & ATTR_CMN_PAROBJID) {
+        FUSE_ATTR_PACK(p, uint32_t, vap->va_parentid); /* XXX: truncation */
+        FUSE_ATTR_PACK(p, uint32_t, 0);
+    }
+    if (attrs & ATTR_CMN_SCRIPT) {
+        FUSE_ATTR_PACK(p, text_encoding_t, 0x7E); /* kTextEncodingMacUnicode */
+    }
+    if (attrs & ATTR_CMN_CRTIME) {
+        fuse_internal_readdirattr_packtime(&p, &vap->va_create_time,
+            VATTR_IS_SUPPORTED(vap, va_create_time), is64);
+    }
+    if (attrs & ATTR_CMN_MODTIME) {
+        fuse_internal_readdirattr_packtime(&p, &vap->va_modify_time,
+            true, is64);
+    }
+    if (attrs & ATTR_CMN_CHGTIME) {
+        fuse_internal_readdirattr_packtime(&p, &vap->va_change_time,
+            true, is64);
+    }
+    if (attrs & ATTR_CMN_ACCTIME) {
+        fuse_internal_readdirattr_packtime(&p, &vap->va_access_time,
+            true, is64);
+    }
+    if (attrs & ATTR_CMN_BKUPTIME) {
+        fuse_internal_readdirattr_packtime(&p, &vap->va_backup_time,
+            VATTR_IS_SUPPORTED(vap, va_backup_time), is64);
+    }
+    if (attrs & ATTR_CMN_FNDRINFO) {
+        size_t size = 32;
+        uio_t fuio = uio_create(1, 0, UIO_SYSSPACE, UIO_READ);
+
+        bzero(p, size);
+        if (fuio) {
+            uio_addiov(fuio, CAST_USER_ADDR_T(p), size);
+            (void)VNOP_GETXATTR(vp, XATTR_FINDERINFO_NAME, fuio, &size,
+                                XATTR_NOSECURITY, context);
+            uio_free(fuio);
+        }
+        p += 32;
+    }
+    if (attrs & ATTR_CMN_OWNERID) {
+        FUSE_ATTR_PACK(p, uid_t, vap->va_uid);
+    }
+    if (attrs & ATTR_CMN_GRPID) {
+        FUSE_ATTR_PACK(p, gid_t, vap->va_gid);
+    }
+    if (attrs & ATTR_CMN_ACCESSMASK) {
+        FUSE_ATTR_PACK(p, uint32_t, vap->va_mode);
+    }
+    if (attrs & ATTR_CMN_FLAGS) {
+        FUSE_ATTR_PACK(p, uint32_t, vap->va_flags);
+    }
+    if (attrs & ATTR_CMN_USERACCESS) {
+        FUSE_ATTR_PACK(p, uint32_t,
+                       fuse_internal_readdirattr_useraccess(vp, context));
+    }
+    if (attrs & ATTR_CMN_FILEID) {
+        FUSE_ATTR_PACK(p, uint64_t, vap->va_fileid);
+    }
+    if (attrs & ATTR_CMN_PARENTID) {
+        FUSE_ATTR_PACK(p, uint64_t, vap->va_parentid);
+    }
+
+    if (vap->va_type == VDIR) {
+        attrs = alist->dirattr;
+        if (attrs & ATTR_DIR_LINKCOUNT) {
+            FUSE_ATTR_PACK(p, uint32_t, vap->va_nlink);
+        }
+        if (attrs & ATTR_DIR_MOUNTSTATUS) {
+            FUSE_ATTR_PACK(p, uint32_t,
+                           vnode_mountedhere(vp) ? DIR_MNTSTATUS_MNTPOINT : 0);
+        }
+    } else {
+        attrs = alist->fileattr;
+        allocsize = VATTR_IS_SUPPORTED(vap, va_data_alloc) ?
+            (off_t)vap->va_data_alloc :
+            (off_t)roundup(vap->va_data_size, sfs->f_bsize);
+        if (attrs & ATTR_FILE_LINKCOUNT) {
+            FUSE_ATTR_PACK(p, uint32_t, vap->va_nlink);
+        }
+        if (attrs & ATTR_FILE_TOTALSIZE) {
+            FUSE_ATTR_PACK(p, off_t, vap->va_data_size);
+        }
+        if (attrs & ATTR_FILE_ALLOCSIZE) {
+            FUSE_ATTR_PACK(p, off_t, allocsize);
+        }
+        if (attrs & ATTR_FILE_IOBLOCKSIZE) {
+            FUSE_ATTR_PACK(p, uint32_t, vap->va_iosize);
+        }
+        if (attrs & ATTR_FILE_DEVTYPE) {
+            FUSE_ATTR_PACK(p, uint32_t,
+                           ((vap->va_type == VCHR) || (vap->va_type == VBLK)) ?
+                           vap->va_rdev : 0);
+        }
+        if (attrs & ATTR_FILE_DATALENGTH) {
+            FUSE_ATTR_PACK(p, off_t, vap->va_data_size);
+        }
+        if (attrs & ATTR_FILE_DATAALLOCSIZE) {
+            FUSE_ATTR_PACK(p, off_t, allocsize);
+        }
+    }
+
+    if (nameref) {
+        nameref->attr_dataoffset = (int32_t)(p - (char *)nameref);
+        nameref->attr_length = (uint32_t)(namelen + 1);
+        memcpy(p, name, namelen);
+        bzero(p + namelen, ((namelen + 1 + 3) & ~3) - namelen);
+        p += (namelen + 1 + 3) & ~3;
     }
 
-    if (VATTR_IS_ACTIVE(vap, va_mode)) {
-        fsai->mode = vap->va_mode & ALLPERMS;
-        fsai->mode |= VTTOIF(vnode_vtype(vp));
-        fsai->valid |= FATTR_MODE;
-    }
-    VATTR_SET_SUPPORTED(vap, va_mode);
+    *(uint32_t *)buf = (uint32_t)(p - buf);
 
-    if (VATTR_IS_ACTIVE(vap, va_flags)) {
-        fsai->flags = vap->va_flags;
-        fsai->valid |= FATTR_FLAGS;
+    return (size_t)(p - buf);
+}
+
+/*
+ * Fills in a READDIRPLUS entry the daemon sent without attributes, the
+ * same way a lookup would.
+ */
+static int
+fuse_internal_readdirattr_lookup(vnode_t                 dvp,
+                                 struct fuse_direntplus *fudgeplus,
+                                 vfs_context_t           context)
+{
+    struct fuse_dispatcher fdi;
+    size_t namelen = fudgeplus->dirent.namelen;
+    int err;
+
+    fuse_dispatcher_init(&fdi, namelen + 1);
+    fuse_dispatcher_make_vp(&fdi, FUSE_LOOKUP, dvp, context);
+    memcpy(fdi.indata, fudgeplus->dirent.name, namelen);
+    ((char *)fdi.indata)[namelen] = '\0';
+
+    if ((err = fuse_dispatcher_wait_answer(&fdi))) {
+        return err;
     }
-    VATTR_SET_SUPPORTED(vap, va_flags);
 
-    /*
-     * We /are/ OK with va_acl, va_guuid, and va_uuuid passing through here.
-     */
+    memcpy(&fudgeplus->entry_out, fdi.answer, sizeof(struct fuse_entry_out));
 
-    return sizechanged;
-}
+    fuse_internal_readdir_link(dvp, fudgeplus, context);
 
+    fuse_ticket_drop(fdi.ticket);
 
-/* readdir */
+    return fudgeplus->entry_out.nodeid ? 0 : ENOENT;
+}
 
-__private_extern__
+/*
+ * Lists a directory together with the attributes of its entries, taking
+ * both from READDIRPLUS replies instead of a lookup and a getattr per
+ * entry. Packed entries are staged in cookediov and copied out a batch at
+ * a time; the uio offset is the daemon's cookie, as for readdir.
+ */
 int
-fuse_internal_readdir(vnode_t                 vp,
-                      uio_t                   uio,
-                      vfs_context_t           context,
-                      struct fuse_filehandle *fufh,
-                      struct fuse_iov        *cookediov,
-                      int                    *numdirent)
+fuse_internal_readdirattr(vnode_t                 dvp,
+                          uio_t                   uio,
+                          struct attrlist        *alist,
+                          uint32_t                maxcount,
+                          struct fuse_filehandle *fufh,
+                          struct fuse_iov        *cookediov,
+                          int                    *eofflag,
+                          uint32_t               *actualcount,
+                          vfs_context_t           context)
 {
     int err = 0;
-    struct fuse_dispatcher fdi;
-    struct fuse_read_in   *fri;
-    struct fuse_data      *data;
+    struct fuse_dispatcher  fdi;
+    struct fuse_read_in    *fri;
+    struct fuse_direntplus *fudgeplus;
+    struct fuse_dirent     *fudge;
+    struct fuse_entry_out  *feo;
+    struct vnode_attr       va;
+    mount_t mp = vnode_mount(dvp);
+    struct fuse_data *data = fuse_get_mpdata(mp);
+    vnode_t vp;
+    char *scratch;
+    char *buf;
+    size_t bufsize;
+    size_t freclen;
+    size_t len;
+    size_t cookedlen;
+    size_t cookedmax;
+    off_t lastoff;
+    uint32_t count = 0;
+    uint32_t staged;
+    bool full = false;
+
+    *eofflag = 0;
+    *actualcount = 0;
+
+    if ((alist->bitmapcount != ATTR_BIT_MAP_COUNT) ||
+        (alist->commonattr & ~FUSE_READDIRATTR_CMN) ||
+        (alist->dirattr & ~FUSE_READDIRATTR_DIR) ||
+        (alist->fileattr & ~FUSE_READDIRATTR_FILE) ||
+        alist->volattr || alist->forkattr) {
+        return EINVAL;
+    }
 
-    if (uio_resid(uio) == 0) {
-        return 0;
+    scratch = FUSE_OSMalloc(FUSE_READDIRATTR_MAXENTRY, fuse_malloc_tag);
+    if (!scratch) {
+        return ENOMEM;
     }
 
-    fuse_dispatcher_init(&fdi, 0);
+    cookedmax = max((size_t)data->iosize, (size_t)FUSE_READDIRATTR_MAXENTRY);
+    fiov_adjust(cookediov, cookedmax);
 
-    /* Note that we DO NOT have a UIO_SYSSPACE here (so no need for p2p I/O). */
+    while (!full && (count < maxcount) && (uio_resid(uio) > 0)) {
 
-    while (uio_resid(uio) > 0) {
+        lastoff = uio_offset(uio);
 
-        fdi.iosize = sizeof(*fri);
-        fuse_dispatcher_make_vp(&fdi, FUSE_READDIR, vp, context);
+        fuse_dispatcher_init(&fdi, sizeof(*fri));
+        fuse_dispatcher_make_vp(&fdi, FUSE_READDIRPLUS, dvp, context);
 
         fri = fdi.indata;
         fri->fh = fufh->fh_id;
-        fri->offset = uio_offset(uio);
-        data = fuse_get_mpdata(vnode_mount(vp));
-        fri->size = (typeof(fri->size))min((size_t)uio_resid(uio), data->iosize);
+        fri->offset = lastoff;
+        fri->size = (typeof(fri->size))min((size_t)FUSE_READDIR_BUFSIZE,
+                                           data->iosize);
 
         if ((err = fuse_dispatcher_wait_answer(&fdi))) {
-            goto out;
+            break;
         }
 
-        if ((err = fuse_internal_readdir_processdata(vp,
-                                                     uio,
-                                                     fri->size,
-                                                     fdi.answer,
-                                                     fdi.iosize,
-                                                     cookediov,
-                                                     numdirent))) {
+        if (fdi.iosize == 0) {
+            fuse_ticket_drop(fdi.ticket);
+            *eofflag = 1;
             break;
         }
-    }
-
-/* done: */
 
-    fuse_ticket_drop(fdi.ticket);
+        fuse_internal_readdir_linkall(dvp, fdi.answer, fdi.iosize, context);
 
-out:
-    return ((err == -1) ? 0 : err);
-}
+        buf = fdi.answer;
+        bufsize = fdi.iosize;
+        cookedlen = 0;
+        staged = 0;
 
-__private_extern__
-int
-fuse_internal_readdir_processdata(vnode_t          vp,
-                                  uio_t            uio,
-                         __unused size_t           reqsize,
-                                  void            *buf,
-                                  size_t           bufsize,
-                                  struct fuse_iov *cookediov,
-                                  int             *numdirent)
-{
-    int err = 0;
-    int cou = 0;
-    int n   = 0;
-    size_t bytesavail;
-    size_t freclen;
+        while (bufsize >= FUSE_NAME_OFFSET_DIRENTPLUS) {
+            fudgeplus = (struct fuse_direntplus *)buf;
+            fudge = &fudgeplus->dirent;
+            feo = &fudgeplus->entry_out;
+            freclen = FUSE_DIRENTPLUS_SIZE(fudgeplus);
 
-    struct dirent      *de;
-    struct fuse_dirent *fudge;
+            if ((bufsize < freclen) || !fudge->namelen ||
+                (fudge->namelen > FUSE_MAXNAMLEN)) {
+                err = EIO;
+                break;
+            }
 
-    if (bufsize < FUSE_NAME_OFFSET) {
-        return -1;
-    }
+            if (count >= maxcount) {
+                full = true;
+                break;
+            }
 
-    for (;;) {
+            if (((fudge->name[0] == '.') &&
+                 ((fudge->namelen == 1) ||
+                  ((fudge->namelen == 2) && (fudge->name[1] == '.')))) ||
+                fuse_skip_apple_double_mp(mp, fudge->name, fudge->namelen)) {
+                goto next;
+            }
 
-        if (bufsize < FUSE_NAME_OFFSET) {
-            err = -1;
-            break;
-        }
+            if (!feo->nodeid) {
+                err = fuse_internal_readdirattr_lookup(dvp, fudgeplus, context);
+                if (err == ENOENT) {
+                    err = 0;
+                    goto next; /* gone since the listing was made */
+                }
+                if (err) {
+                    break;
+                }
+            }
 
-        fudge = (struct fuse_dirent *)buf;
-        freclen = FUSE_DIRENT_SIZE(fudge);
+            if ((feo->nodeid == FUSE_ROOT_ID) || ((feo->attr.mode & S_IFMT) == 0)) {
+                goto next;
+            }
 
-        cou++;
+            err = FSNodeGetOrCreateFileVNodeByID(&vp, false, feo, mp, dvp,
+                                                 context, NULL);
+            if (err) {
+                break;
+            }
 
-        if (bufsize < freclen) {
-            err = ((cou == 1) ? -1 : 0);
-            break;
-        }
+            VATTR_INIT(&va);
+            if (alist->commonattr & ATTR_CMN_CRTIME) {
+                VATTR_WANTED(&va, va_create_time);
+            }
+            if (alist->commonattr & ATTR_CMN_BKUPTIME) {
+                VATTR_WANTED(&va, va_backup_time);
+            }
+            fuse_internal_attr_loadvap(vp, &va, context);
 
-        /*
-         * if (isbzero(buf, FUSE_NAME_OFFSET)) {
-         *     // zero-pad incomplete buffer
-         *     ...
-         *     err = -1;
-         *     break;
-         * }
-         */
+            len = fuse_internal_readdirattr_pack(vp, alist, &va, fudge->name,
+                                                 fudge->namelen, scratch,
+                                                 context);
+            vnode_put(vp);
 
-        if (!fudge->namelen) {
-            err = EINVAL;
-            break;
-        }
+            if (len > (size_t)uio_resid(uio) - cookedlen) {
+                full = true;
+                break;
+            }
 
-        if (fudge->namelen > FUSE_MAXNAMLEN) {
-            err = EIO;
-            break;
-        }
+            if (len > cookedmax - cookedlen) {
+                if ((err = uiomove(cookediov->base, (int)cookedlen, uio))) {
+                    break;
+                }
+                uio_setoffset(uio, lastoff);
+                cookedlen = 0;
+                staged = 0;
+            }
 
-        bytesavail = (sizeof(struct dirent) - (FUSE_MAXNAMLEN + 1)) +
-            ((fudge->namelen + 1 + 3) & ~3);
+            memcpy((char *)cookediov->base + cookedlen, scratch, len);
+            cookedlen += len;
+            staged++;
+            count++;
 
-        if (bytesavail > (size_t)uio_resid(uio)) {
-            err = -1;
-            break;
+next:
+            lastoff = fudge->off;
+            buf += freclen;
+            bufsize -= freclen;
         }
 
-        fiov_refresh(cookediov);
-        fiov_adjust(cookediov, bytesavail);
-
-        de = (struct dirent *)cookediov->base;
-#ifdef _DARWIN_FEATURE_64_BIT_INODE
-        de->d_ino = fudge->ino;
-#else
-        de->d_ino = (ino_t)fudge->ino; /* XXX: truncation */
-#endif /* _DARWIN_FEATURE_64_BIT_INODE */
-        de->d_reclen = bytesavail;
-        de->d_type   = fudge->type;
-        de->d_namlen = fudge->namelen;
+        fuse_ticket_drop(fdi.ticket);
 
-        /* Filter out any ._* files if the mount is configured as such. */
-        if (fuse_skip_apple_double_mp(vnode_mount(vp),
-                                      fudge->name, fudge->namelen)) {
-            de->d_ino = 0;
-            de->d_type = DT_WHT;
+        /* Entries packed before a failure are still good. */
+        if (cookedlen) {
+            int moveerr = uiomove(cookediov->base, (int)cookedlen, uio);
+            if (moveerr) {
+                count -= staged;
+                err = moveerr;
+                break;
+            }
         }
 
-        memcpy((char *)cookediov->base +
-               sizeof(struct dirent) - FUSE_MAXNAMLEN - 1,
-               (char *)buf + FUSE_NAME_OFFSET, fudge->namelen);
-        ((char *)cookediov->base)[bytesavail] = '\0';
+        uio_setoffset(uio, lastoff);
 
-        err = uiomove(cookediov->base, (int)cookediov->len, uio);
         if (err) {
             break;
         }
-
-        n++;
-
-        buf = (char *)buf + freclen;
-        bufsize -= freclen;
-        uio_setoffset(uio, fudge->off);
     }
 
-    if (!err && numdirent) {
-        *numdirent = n;
-    }
+    FUSE_OSFree(scratch, FUSE_READDIRATTR_MAXENTRY, fuse_malloc_tag);
 
-    return err;
+    *actualcount = count;
+
+    /* Entries already copied out are not taken back. */
+    return (count ? 0 : err);
 }
 
 /* remove */
@@ -779,6 +3372,7 @@ fuse_internal_remove(vnode_t               dvp,
     }
 
     fuse_invalidate_attr(dvp);
+    fuse_invalidate_dircache(dvp);
     fuse_invalidate_attr(vp);
 
     /*
@@ -839,14 +3433,222 @@ fuse_internal_rename(vnode_t               fdvp,
 
     if (err == 0) {
         fuse_invalidate_attr(fdvp);
+        fuse_invalidate_dircache(fdvp);
         if (tdvp != fdvp) {
             fuse_invalidate_attr(tdvp);
+            fuse_invalidate_dircache(tdvp);
+        }
+    }
+
+    return err;
+}
+
+/* seek */
+
+static bool
+fuse_internal_extent_lookup(struct fuse_vnode_data *fvdat, off_t offset,
+                            off_t *end, bool *hole)
+{
+    bool found = false;
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    for (int i = 0; i < FUSE_EXTENT_CACHE_SIZE; i++) {
+        struct fuse_extent *extent = &fvdat->extent_cache[i];
+
+        if ((extent->start <= offset) && (offset < extent->end)) {
+            *end = extent->end;
+            *hole = extent->hole;
+            found = true;
+            break;
+        }
+    }
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    return found;
+}
+
+/* Remembers an extent, unless the file changed since gen was taken. */
+static void
+fuse_internal_extent_enter(struct fuse_vnode_data *fvdat, uint32_t gen,
+                           off_t start, off_t end, bool hole)
+{
+    struct fuse_extent *extent;
+
+    if (start >= end) {
+        return;
+    }
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    if (fvdat->extent_cache_gen == gen) {
+        extent = &fvdat->extent_cache[fvdat->extent_cache_next];
+        fvdat->extent_cache_next =
+            (fvdat->extent_cache_next + 1) % FUSE_EXTENT_CACHE_SIZE;
+        extent->start = start;
+        extent->end = end;
+        extent->hole = hole;
+    }
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+}
+
+/*
+ * Asks the daemon where the next data or hole (whence) at or after *offset
+ * starts. Whatever lies in between is remembered as hole or data, and ENXIO
+ * for data means the rest of the file is a hole.
+ */
+__private_extern__
+int
+fuse_internal_lseek(vnode_t                 vp,
+                    struct fuse_filehandle *fufh,
+                    off_t                  *offset,
+                    int                     whence,
+                    vfs_context_t           context)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data       *data  = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_dispatcher  fdi;
+    struct fuse_lseek_in   *flsi;
+
+    off_t    start = *offset;
+    uint32_t gen;
+    int      err;
+
+    if (!fuse_implemented(data, FSESS_NOIMPLBIT(LSEEK))) {
+        return ENOSYS;
+    }
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    gen = fvdat->extent_cache_gen;
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    fuse_dispatcher_init(&fdi, sizeof(*flsi));
+    fuse_dispatcher_make_vp(&fdi, FUSE_LSEEK, vp, context);
+    flsi = fdi.indata;
+    flsi->fh = fufh->fh_id;
+    flsi->offset = start;
+    flsi->whence = whence;
+    flsi->padding = 0;
+
+    err = fuse_dispatcher_wait_answer(&fdi);
+    if (err) {
+        if (err == ENOSYS) {
+            fuse_clear_implemented(data, FSESS_NOIMPLBIT(LSEEK));
+        } else if ((err == ENXIO) && (whence == FUSE_LSEEK_DATA)) {
+            fuse_internal_extent_enter(fvdat, gen, start, fvdat->filesize,
+                                       true);
+        }
+        return err;
+    }
+
+    *offset = ((struct fuse_lseek_out *)fdi.answer)->offset;
+    fuse_ticket_drop(fdi.ticket);
+
+    fuse_internal_extent_enter(fvdat, gen, start, *offset,
+                               whence == FUSE_LSEEK_DATA);
+
+    return 0;
+}
+
+/*
+ * lseek(2) with SEEK_HOLE or SEEK_DATA. Without FUSE_LSEEK the whole file
+ * is data, with a hole only at its end.
+ */
+__private_extern__
+int
+fuse_internal_seek_hole(vnode_t       vp,
+                        off_t        *offset,
+                        bool          hole,
+                        vfs_context_t context)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_filehandle *fufh  = NULL;
+
+    off_t next = *offset;
+    int   type;
+    int   err = ENOSYS;
+
+    if (!vnode_isreg(vp)) {
+        return EINVAL;
+    }
+
+    if ((next < 0) || (next >= fvdat->filesize)) {
+        return ENXIO;
+    }
+
+    fuse_lck_mtx_lock(fvdat->fufh_mtx);
+    for (type = 0; type < FUFH_MAXTYPE; type++) {
+        if (FUFH_IS_VALID(&(fvdat->fufh[type]))) {
+            fufh = &(fvdat->fufh[type]);
+            err = fuse_filehandle_realize(vp, context, type);
+            break;
         }
     }
+    fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+
+    if (fufh && !err) {
+        err = fuse_internal_lseek(vp, fufh, &next,
+                                  hole ? FUSE_LSEEK_HOLE : FUSE_LSEEK_DATA,
+                                  context);
+    }
+
+    if (err == ENOSYS) {
+        next = hole ? fvdat->filesize : *offset;
+        err = 0;
+    }
+
+    if (!err) {
+        *offset = next;
+    }
 
     return err;
 }
 
+/*
+ * Tells whether offset lies in a hole of a sparse file, and up to where,
+ * from the extent cache or else by asking the daemon.
+ */
+static int
+fuse_internal_extent(vnode_t                 vp,
+                     struct fuse_filehandle *fufh,
+                     off_t                   offset,
+                     off_t                  *end,
+                     bool                   *hole)
+{
+    off_t next = offset;
+    int   err;
+
+    if (fuse_internal_extent_lookup(VTOFUD(vp), offset, end, hole)) {
+        return 0;
+    }
+
+    err = fuse_internal_lseek(vp, fufh, &next, FUSE_LSEEK_DATA, NULL);
+    if ((err == ENXIO) && (offset < VTOFUD(vp)->filesize)) {
+        *end = VTOFUD(vp)->filesize;
+        *hole = true;
+        return 0;
+    }
+    if (err) {
+        return err;
+    }
+    if (next > offset) {
+        *end = next;
+        *hole = true;
+        return 0;
+    }
+
+    err = fuse_internal_lseek(vp, fufh, &next, FUSE_LSEEK_HOLE, NULL);
+    if (err) {
+        return err;
+    }
+    if (next <= offset) {
+        return EINVAL;
+    }
+
+    *end = next;
+    *hole = false;
+
+    return 0;
+}
+
 /* strategy */
 
 __private_extern__
@@ -876,6 +3678,10 @@ fuse_internal_strategy(vnode_t vp, buf_t bp)
     struct fuse_filehandle *fufh = NULL;
     mount_t mp = vnode_mount(vp);
 
+    bool  sparse;
+    bool  hole;
+    off_t extent_end;
+
     data = fuse_get_mpdata(mp);
 
     biosize = data->blocksize;
@@ -929,6 +3735,7 @@ fuse_internal_strategy(vnode_t vp, buf_t bp)
         OSIncrementAtomic((SInt32 *)&fuse_fh_reuse_count);
 
         /* We're using an existing fufh of type fufh_type. */
+        err = fuse_filehandle_realize(vp, NULL, fufh_type);
     }
     fuse_lck_mtx_unlock(fvdat->fufh_mtx);
 
@@ -1005,10 +3812,28 @@ fuse_internal_strategy(vnode_t vp, buf_t bp)
             mapped = true;
         }
 
+        /* Holes of sparse files are zero-filled here, not fetched. */
+        sparse = (vtype == VREG) && fuse_issparse_mp(mp) &&
+                 fuse_implemented(data, FSESS_NOIMPLBIT(LSEEK));
+
         while (buf_resid(bp) > 0) {
 
             chunksize = min((size_t)buf_resid(bp), data->iosize);
 
+            if (sparse &&
+                !fuse_internal_extent(vp, fufh, offset, &extent_end, &hole)) {
+                chunksize = (size_t)min((off_t)chunksize, extent_end - offset);
+                if (hole) {
+                    bzero(bufdat, chunksize);
+                    buf_setresid(bp, (uint32_t)(buf_resid(bp) - chunksize));
+                    bufdat += chunksize;
+                    offset += chunksize;
+                    OSAddAtomic64((SInt64)chunksize,
+                                  (SInt64 *)&fuse_hole_bytes_filled);
+                    continue;
+                }
+            }
+
             fdi.iosize = sizeof(*fri);
 
             op = FUSE_READ;
@@ -1072,6 +3897,8 @@ fuse_internal_strategy(vnode_t vp, buf_t bp)
             mapped = true;
         }
 
+        fuse_invalidate_extents(vp);
+
         /* Write begin */
 
         buf_setresid(bp, buf_count(bp));
@@ -1304,6 +4131,7 @@ fuse_internal_newentry(vnode_t               dvp,
                                        bufsize, &fdi, context);
     err = fuse_internal_newentry_core(dvp, vpp, cnp, vtype, &fdi, context);
     fuse_invalidate_attr(dvp);
+    fuse_invalidate_dircache(dvp);
 
     return err;
 }
@@ -1417,6 +4245,10 @@ fuse_internal_init_callback(struct fuse_ticket *ticket, __unused uio_t uio)
         data->dataflags |= FSESS_XTIMES;
     }
 
+    if (fiio->flags & FUSE_DO_READDIRPLUS) {
+        data->dataflags |= FSESS_READDIRPLUS;
+    }
+
 out:
     fuse_ticket_drop(ticket);
 
@@ -1445,7 +4277,7 @@ fuse_send_init(struct fuse_data *data, vfs_context_t context)
     fiii->major = FUSE_KERNEL_VERSION;
     fiii->minor = FUSE_KERNEL_MINOR_VERSION;
     fiii->max_readahead = data->iosize * 16;
-    fiii->flags = 0;
+    fiii->flags = FUSE_DO_READDIRPLUS;
 
     fuse_insert_callback(fdi.ticket, fuse_internal_init_callback);
     fuse_insert_message(fdi.ticket);
@@ -16,6 +16,7 @@
 #include <AvailabilityMacros.h>
 #include <kern/clock.h>
 #include <sys/types.h>
+#include <sys/attr.h>
 #include <sys/kauth.h>
 #include <sys/kernel_types.h>
 #include <sys/mount.h>
@@ -325,6 +326,41 @@ fuse_issparse_mp(mount_t mp)
     return (fuse_get_mpdata(mp)->dataflags & FSESS_SPARSE);
 }
 
+static __inline__
+int
+fuse_islazyopen_mp(mount_t mp)
+{
+    return (fuse_get_mpdata(mp)->dataflags & FSESS_LAZY_OPEN);
+}
+
+static __inline__
+int
+fuse_ishybridio_mp(mount_t mp)
+{
+    return (fuse_get_mpdata(mp)->dataflags & FSESS_HYBRID_IO);
+}
+
+static __inline__
+int
+fuse_isreaddirplus_mp(mount_t mp)
+{
+    return (fuse_get_mpdata(mp)->dataflags & FSESS_READDIRPLUS);
+}
+
+static __inline__
+int
+fuse_isstaleattrcache_mp(mount_t mp)
+{
+    return (fuse_get_mpdata(mp)->dataflags & FSESS_STALE_ATTRCACHE);
+}
+
+static __inline__
+int
+fuse_isxattrcache(vnode_t vp)
+{
+    return (fuse_get_mpdata(vnode_mount(vp))->dataflags & FSESS_XATTR_CACHE);
+}
+
 static __inline__
 uint32_t
 fuse_round_powerof2(uint32_t size)
@@ -437,6 +473,38 @@ fuse_internal_access(vnode_t                   vp,
 
 /* attributes */
 
+static __inline__
+void
+fuse_vnode_notify(vnode_t vp, long hint)
+{
+    uint32_t events = 0;
+
+    if (!hint || !vnode_ismonitored(vp)) {
+        return;
+    }
+
+    if (hint & NOTE_WRITE) {
+        events |= VNODE_EVENT_WRITE;
+    }
+    if (hint & NOTE_EXTEND) {
+        events |= VNODE_EVENT_EXTEND;
+    }
+    if (hint & NOTE_ATTRIB) {
+        events |= VNODE_EVENT_ATTRIB;
+    }
+    if (hint & NOTE_DELETE) {
+        events |= VNODE_EVENT_DELETE;
+    }
+
+    (void)vnode_notify(vp, events, NULL);
+}
+
+int
+fuse_internal_attr_revalidate(vnode_t vp, vfs_context_t context);
+
+int
+fuse_internal_attr_revalidate_callback(struct fuse_ticket *ticket, uio_t uio);
+
 int
 fuse_internal_loadxtimes(vnode_t vp, struct vnode_attr *out_vap,
                          vfs_context_t context);
@@ -459,6 +527,27 @@ fuse_internal_attr_fat2vat(vnode_t            vp,
     struct fuse_data *data = fuse_get_mpdata(mp);
     struct fuse_vnode_data *fvdat = VTOFUD(vp);
 
+    if (vap == VTOVA(vp)) {
+        /* Cached access decisions depend on the ownership and permissions. */
+        if ((vap->va_mode != (fat->mode & ~S_IFMT)) ||
+            (vap->va_uid != fat->uid) || (vap->va_gid != fat->gid) ||
+            (vap->va_flags != fat->flags)) {
+            fuse_invalidate_access(vp);
+        }
+        /* So may a directory listing with a new mtime. */
+        if ((fvdat->vtype == VDIR) &&
+            ((vap->va_modify_time.tv_sec != (typeof(t.tv_sec))fat->mtime) ||
+             (vap->va_modify_time.tv_nsec != fat->mtimensec))) {
+            fuse_invalidate_dircache(vp);
+        }
+        /* A new ctime may mean the extended attributes changed remotely. */
+        if (fuse_isxattrcache(vp) &&
+            ((vap->va_change_time.tv_sec != (typeof(t.tv_sec))fat->ctime) ||
+             (vap->va_change_time.tv_nsec != fat->ctimensec))) {
+            fuse_invalidate_xattr(vp);
+        }
+    }
+
     VATTR_INIT(vap);
 
     VATTR_RETURN(vap, va_fsid, vfs_statfs(mp)->f_fsid.val[0]);
@@ -557,9 +646,18 @@ fuse_internal_attr_loadvap(vnode_t vp, struct vnode_attr *out_vap,
         /* The size might have changed remotely. */
         if (fvdat->filesize != (off_t)in_vap->va_data_size) {
             hint |= NOTE_WRITE;
-            /* Remote size overrides what we have. */
-            (void)ubc_msync(vp, (off_t)0, fvdat->filesize, NULL,
-                            UBC_PUSHALL | UBC_INVALIDATE | UBC_SYNC);
+            /*
+             * Remote size overrides what we have. A file that grew was
+             * most likely appended to: only its last page, zero-filled
+             * past the old EOF, is stale. Anything else drops it all.
+             */
+            if ((off_t)in_vap->va_data_size > fvdat->filesize) {
+                fuse_vnode_inval_ubc(vp, fvdat->filesize & ~PAGE_MASK_64,
+                                     fvdat->filesize, UBC_PUSHALL | UBC_SYNC);
+            } else {
+                fuse_vnode_inval_ubc(vp, (off_t)0, fvdat->filesize,
+                                     UBC_PUSHALL | UBC_SYNC);
+            }
             purged = 1;
             if (fvdat->filesize > (off_t)in_vap->va_data_size) {
                 hint |= NOTE_EXTEND;
@@ -605,8 +703,8 @@ fuse_internal_attr_loadvap(vnode_t vp, struct vnode_attr *out_vap,
         fvdat->modify_time.tv_nsec = in_vap->va_modify_time.tv_nsec;
         hint |= NOTE_ATTRIB;
         if (fuse_isautocache_mp(mp) && !purged) {
-            (void)ubc_msync(vp, (off_t)0, fvdat->filesize, NULL,
-                            UBC_PUSHALL | UBC_INVALIDATE | UBC_SYNC);
+            fuse_vnode_inval_ubc(vp, (off_t)0, fvdat->filesize,
+                                 UBC_PUSHALL | UBC_SYNC);
         }
     }
 
@@ -630,6 +728,34 @@ fuse_internal_attr_loadvap(vnode_t vp, struct vnode_attr *out_vap,
     fuse_internal_attr_fat2vat(vp, &(fuse_out)->attr, VTOVA(vp));    \
 } while (0)
 
+/* copy */
+
+int
+fuse_internal_copy_range(vnode_t                     vp,
+                         struct fuse_copyrange_args *args,
+                         int                         fflag,
+                         vfs_context_t               context);
+
+/* direct_io */
+
+int
+fuse_internal_direct_read(vnode_t                 vp,
+                          uio_t                   uio,
+                          struct fuse_filehandle *fufh,
+                          vfs_context_t           context);
+
+int
+fuse_internal_direct_write(vnode_t                 vp,
+                           uio_t                   uio,
+                           struct fuse_filehandle *fufh,
+                           vfs_context_t           context);
+
+struct fuse_filehandle *
+fuse_internal_hybrid_fufh(vnode_t       vp,
+                          uio_t         uio,
+                          bool          write,
+                          vfs_context_t context);
+
 #ifdef FUSE4X_ENABLE_EXCHANGE
 
 /* exchange */
@@ -657,12 +783,43 @@ fuse_internal_fsync(vnode_t                 vp,
 int
 fuse_internal_fsync_callback(struct fuse_ticket *ticket, uio_t uio);
 
+int
+fuse_internal_flush_callback(struct fuse_ticket *ticket, uio_t uio);
+
+int
+fuse_internal_flush_error(vnode_t vp);
+
+
+/* notify */
+
+int
+fuse_internal_notify(struct fuse_data *data, int code, uio_t uio);
+
+void
+fuse_internal_notify_drain(struct fuse_data *data);
+
+void
+fuse_internal_notify_vnode(struct fuse_data *data, uint64_t nodeid,
+                           bool purge, long hint);
+
+/* open */
+
+bool
+fuse_internal_open_flags(vnode_t                 vp,
+                         struct fuse_filehandle *fufh,
+                         vfs_context_t           context);
+
+int
+fuse_internal_open_late(vnode_t       vp,
+                        fufh_type_t   fufh_type,
+                        vfs_context_t context);
 
 /* readdir */
 
 int
 fuse_internal_readdir(vnode_t                 vp,
                       uio_t                   uio,
+                      bool                    extended,
                       vfs_context_t           context,
                       struct fuse_filehandle *fufh,
                       struct fuse_iov        *cookediov,
@@ -675,7 +832,22 @@ fuse_internal_readdir_processdata(vnode_t          vp,
                                   void            *buf,
                                   size_t           bufsize,
                                   struct fuse_iov *cookediov,
-                                  int             *numdirent);
+                                  int             *numdirent,
+                                  bool             plus,
+                                  bool             extended);
+
+/* readdirattr */
+
+int
+fuse_internal_readdirattr(vnode_t                 dvp,
+                          uio_t                   uio,
+                          struct attrlist        *alist,
+                          uint32_t                maxcount,
+                          struct fuse_filehandle *fufh,
+                          struct fuse_iov        *cookediov,
+                          int                    *eofflag,
+                          uint32_t               *actualcount,
+                          vfs_context_t           context);
 
 /* remove */
 
@@ -698,6 +870,21 @@ fuse_internal_rename(vnode_t               fdvp,
                      vfs_context_t         context);
 
 
+/* seek */
+
+int
+fuse_internal_lseek(vnode_t                 vp,
+                    struct fuse_filehandle *fufh,
+                    off_t                  *offset,
+                    int                     whence,
+                    vfs_context_t           context);
+
+int
+fuse_internal_seek_hole(vnode_t       vp,
+                        off_t        *offset,
+                        bool          hole,
+                        vfs_context_t context);
+
 /* strategy */
 
 int
@@ -5,6 +5,7 @@
  */
 
 #include "fuse.h"
+#include "fuse_file.h"
 #include "fuse_internal.h"
 #include "fuse_ipc.h"
 #include "fuse_node.h"
@@ -39,6 +40,13 @@ static __inline__ void fuse_setup_ihead(struct fuse_in_header *ihead,
 
 static fuse_callback_t  fuse_standard_callback;
 
+static int  fuse_inflight_follow(struct fuse_dispatcher *dispatcher,
+                                 struct fuse_inflight  **leaderp);
+static void fuse_inflight_complete(struct fuse_inflight *fif,
+                                   struct fuse_ticket   *ticket,
+                                   int                   err,
+                                   bool                  retry);
+
 
 static __inline__
 void *
@@ -367,12 +375,19 @@ fuse_data_alloc(struct proc *p)
     data->aw_mtx        = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
     data->ticket_mtx    = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
     data->node_mtx      = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr); // TODO: it is better to use spin lock here, they are cheaper
+    data->statfs_mtx    = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    data->inflight_mtx  = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    data->notify_mtx    = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    data->park_mtx      = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
 
     STAILQ_INIT(&data->ms_head);
     TAILQ_INIT(&data->aw_head);
     STAILQ_INIT(&data->freetickets_head);
     TAILQ_INIT(&data->alltickets_head);
     RB_INIT(&data->nodes_head);
+    TAILQ_INIT(&data->inflight_head);
+    STAILQ_INIT(&data->notify_head);
+    TAILQ_INIT(&data->park_head);
 
     data->freeticket_counter = 0;
     data->deadticket_counter = 0;
@@ -386,6 +401,10 @@ fuse_data_destroy(struct fuse_data *data)
 {
     struct fuse_ticket *ticket;
 
+    /* Let the notification worker and the reaper finish with us first. */
+    fuse_internal_notify_drain(data);
+    fuse_filehandle_reaper_drain(data);
+
     lck_mtx_free(data->ms_mtx, fuse_lock_group);
     data->ms_mtx = NULL;
 
@@ -398,6 +417,18 @@ fuse_data_destroy(struct fuse_data *data)
     lck_mtx_free(data->node_mtx, fuse_lock_group);
     data->node_mtx = NULL;
 
+    lck_mtx_free(data->statfs_mtx, fuse_lock_group);
+    data->statfs_mtx = NULL;
+
+    lck_mtx_free(data->inflight_mtx, fuse_lock_group);
+    data->inflight_mtx = NULL;
+
+    lck_mtx_free(data->notify_mtx, fuse_lock_group);
+    data->notify_mtx = NULL;
+
+    lck_mtx_free(data->park_mtx, fuse_lock_group);
+    data->park_mtx = NULL;
+
     while ((ticket = fuse_pop_allticks(data))) {
         fuse_ticket_destroy(ticket);
     }
@@ -733,6 +764,7 @@ fuse_body_audit(struct fuse_ticket *ticket, size_t blen)
         break;
 
     case FUSE_READDIR:
+    case FUSE_READDIRPLUS:
         err = (((struct fuse_read_in *)(
                 (char *)ticket->ms_fiov.base +
                         sizeof(struct fuse_in_header)
@@ -780,6 +812,22 @@ fuse_body_audit(struct fuse_ticket *ticket, size_t blen)
         /* TBD */
         break;
 
+    case FUSE_NOTIFY_REPLY:
+        panic("fuse4x: a callback has been installed for FUSE_NOTIFY_REPLY");
+        break;
+
+    case FUSE_FALLOCATE:
+        err = (blen == 0) ? 0 : EINVAL;
+        break;
+
+    case FUSE_LSEEK:
+        err = (blen == sizeof(struct fuse_lseek_out)) ? 0 : EINVAL;
+        break;
+
+    case FUSE_COPY_FILE_RANGE:
+        err = (blen == sizeof(struct fuse_write_out)) ? 0 : EINVAL;
+        break;
+
     case FUSE_DESTROY:
         err = (blen == 0) ? 0 : EINVAL;
         break;
@@ -852,6 +900,224 @@ fuse_standard_callback(struct fuse_ticket *ticket, uio_t uio)
     return err;
 }
 
+/*
+ * Identical GETATTR requests (same node, credentials and payload) issued
+ * while one of them is still pending are coalesced: the first one is sent
+ * to the daemon and the others sleep on its in-flight record and get a copy
+ * of its answer. A request only joins one sent after the last request that
+ * may have changed attributes was answered, so it never gets attributes
+ * older than a change its caller has already seen. LOOKUP is not coalesced:
+ * each reply is a lookup reference the daemon counts, and a shared one could
+ * be forgotten through the other vnode before this one holds it.
+ */
+struct fuse_inflight {
+    TAILQ_ENTRY(fuse_inflight) link;
+    struct fuse_data *data;
+    size_t            alloc_size;
+
+    uint32_t          waiters; // protected by inflight_mtx
+    bool              done;    // protected by inflight_mtx
+    bool              retry;   // no answer to share, waiters must call the daemon
+    int               err;
+    size_t            answer_len;
+    struct fuse_attr_out answer;
+
+    uint32_t          opcode;
+    uint32_t          gen;
+    uint64_t          nodeid;
+    uint32_t          uid;
+    uint32_t          gid;
+    size_t            inlen;
+    char              indata[0];
+};
+
+static __inline__
+bool
+fuse_inflight_coalescable(enum fuse_opcode opcode)
+{
+    return (opcode == FUSE_GETATTR);
+}
+
+/* Requests whose completion may leave a pending GETATTR answer stale. */
+static __inline__
+bool
+fuse_inflight_mutating(enum fuse_opcode opcode)
+{
+    switch (opcode) {
+    case FUSE_SETATTR:
+    case FUSE_SYMLINK:
+    case FUSE_MKNOD:
+    case FUSE_MKDIR:
+    case FUSE_UNLINK:
+    case FUSE_RMDIR:
+    case FUSE_RENAME:
+    case FUSE_LINK:
+    case FUSE_WRITE:
+    case FUSE_SETXATTR:
+    case FUSE_REMOVEXATTR:
+    case FUSE_CREATE:
+    case FUSE_FALLOCATE:
+    case FUSE_COPY_FILE_RANGE:
+#ifdef __APPLE__
+    case FUSE_EXCHANGE:
+#endif
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/*
+ * Returns -1 if the caller has to send the request itself; *leaderp is then
+ * set if it must publish the answer with fuse_inflight_complete(). Otherwise
+ * the request was answered through an identical pending one and the return
+ * value is that of fuse_dispatcher_wait_answer().
+ */
+static int
+fuse_inflight_follow(struct fuse_dispatcher *dispatcher,
+                     struct fuse_inflight  **leaderp)
+{
+    struct fuse_ticket *ticket = dispatcher->ticket;
+    struct fuse_data *data = ticket->data;
+    struct fuse_in_header *finh = dispatcher->finh;
+    struct fuse_inflight *fif, *new_fif;
+    size_t inlen = finh->len - sizeof(struct fuse_in_header);
+    size_t alloc_size = sizeof(struct fuse_inflight) + inlen;
+    struct fuse_attr_out answer;
+    size_t answer_len = 0;
+    bool last = false;
+    int answer_err = 0;
+    int err = 0;
+
+    *leaderp = NULL;
+
+    new_fif = FUSE_OSMalloc(alloc_size, fuse_malloc_tag);
+    if (!new_fif) {
+        return -1;
+    }
+
+    bzero(new_fif, sizeof(struct fuse_inflight));
+    new_fif->data = data;
+    new_fif->alloc_size = alloc_size;
+    new_fif->opcode = finh->opcode;
+    new_fif->gen = data->inflight_gen;
+    new_fif->nodeid = finh->nodeid;
+    new_fif->uid = finh->uid;
+    new_fif->gid = finh->gid;
+    new_fif->inlen = inlen;
+    memcpy(new_fif->indata, dispatcher->indata, inlen);
+
+    fuse_lck_mtx_lock(data->inflight_mtx);
+
+    TAILQ_FOREACH(fif, &data->inflight_head, link) {
+        if ((fif->opcode == new_fif->opcode) &&
+            (fif->gen == new_fif->gen) &&
+            (fif->nodeid == new_fif->nodeid) &&
+            (fif->uid == new_fif->uid) && (fif->gid == new_fif->gid) &&
+            (fif->inlen == inlen) &&
+            !memcmp(fif->indata, new_fif->indata, inlen)) {
+            break;
+        }
+    }
+
+    if (!fif) {
+        TAILQ_INSERT_TAIL(&data->inflight_head, new_fif, link);
+        fuse_lck_mtx_unlock(data->inflight_mtx);
+        OSIncrementAtomic((SInt32 *)&fuse_coalesce_misses);
+        *leaderp = new_fif;
+        return -1;
+    }
+
+    fif->waiters++;
+    while (!fif->done && !err) {
+        err = fuse_msleep(fif, data->inflight_mtx, PCATCH, "fu_coal", NULL);
+    }
+
+    if (!err) {
+        if (fif->retry) {
+            err = -1;
+        } else {
+            answer_err = fif->err;
+            answer_len = fif->answer_len;
+            memcpy(&answer, &fif->answer, answer_len);
+        }
+    }
+
+    fif->waiters--;
+    last = fif->done && (fif->waiters == 0);
+
+    fuse_lck_mtx_unlock(data->inflight_mtx);
+
+    FUSE_OSFree(new_fif, alloc_size, fuse_malloc_tag);
+    if (last) {
+        FUSE_OSFree(fif, fif->alloc_size, fuse_malloc_tag);
+    }
+
+    if (err == -1) {
+        return err;
+    }
+
+    if (err) { /* interrupted, the request has never been sent */
+        fuse_ticket_drop(ticket);
+        return err;
+    }
+
+    OSIncrementAtomic((SInt32 *)&fuse_coalesce_hits);
+
+    if (answer_err) {
+        dispatcher->answer_errno = answer_err;
+        fuse_ticket_drop(ticket);
+        return answer_err;
+    }
+
+    fiov_adjust(&ticket->aw_fiov, answer_len);
+    memcpy(ticket->aw_fiov.base, &answer, answer_len);
+
+    dispatcher->answer = ticket->aw_fiov.base;
+    dispatcher->iosize = ticket->aw_fiov.len;
+
+    return 0;
+}
+
+/*
+ * Publishes the leader's outcome to the coalesced waiters. With retry set
+ * (interrupted or failed transport) there is nothing to share and each
+ * waiter goes to the daemon on its own.
+ */
+static void
+fuse_inflight_complete(struct fuse_inflight *fif, struct fuse_ticket *ticket,
+                       int err, bool retry)
+{
+    struct fuse_data *data = fif->data;
+
+    fuse_lck_mtx_lock(data->inflight_mtx);
+
+    TAILQ_REMOVE(&data->inflight_head, fif, link);
+
+    if (fif->waiters) {
+        if (!retry && !err) {
+            if (ticket->aw_fiov.len <= sizeof(fif->answer)) {
+                fif->answer_len = ticket->aw_fiov.len;
+                memcpy(&fif->answer, ticket->aw_fiov.base, fif->answer_len);
+            } else {
+                retry = true;
+            }
+        }
+        fif->retry = retry;
+        fif->err = err;
+        fif->done = true;
+        fuse_wakeup(fif);
+        fif = NULL; /* the last waiter frees it */
+    }
+
+    fuse_lck_mtx_unlock(data->inflight_mtx);
+
+    if (fif) {
+        FUSE_OSFree(fif, fif->alloc_size, fuse_malloc_tag);
+    }
+}
+
 void
 fuse_dispatcher_make(struct fuse_dispatcher *dispatcher,
            enum fuse_opcode        op,
@@ -935,17 +1201,13 @@ fuse_dispatcher_make_vp_canfail(struct fuse_dispatcher *dispatcher,
     return fuse_dispatcher_make_canfail(dispatcher, op, vnode_mount(vp), VTOI(vp), context);
 }
 
-/* The function returns 0 in case of success and errorcode in case of error */
-int
-fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher)
+static int
+fuse_dispatcher_collect(struct fuse_dispatcher *dispatcher,
+                        struct fuse_inflight   *leader)
 {
     int err = 0;
     struct fuse_ticket *ticket = dispatcher->ticket;
 
-    dispatcher->answer_errno = 0;
-    fuse_insert_callback(ticket, fuse_standard_callback);
-    fuse_insert_message(ticket);
-
     if ((err = fuse_ticket_wait_answer(ticket))) { /* interrupted */
         fuse_lck_mtx_lock(ticket->aw_mtx);
 
@@ -957,6 +1219,9 @@ fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher)
             /* IPC: explicitly setting to answered */
             ticket->answered = true;
             fuse_lck_mtx_unlock(ticket->aw_mtx);
+            if (leader) {
+                fuse_inflight_complete(leader, ticket, err, true);
+            }
             return err;
         }
     }
@@ -982,10 +1247,79 @@ fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher)
     dispatcher->answer = ticket->aw_fiov.base;
     dispatcher->iosize = ticket->aw_fiov.len;
 
+    if (leader) {
+        fuse_inflight_complete(leader, ticket, 0, false);
+    }
+
     return 0;
 
 out:
+    if (leader) {
+        /* Only answers that came from the daemon are worth sharing. */
+        fuse_inflight_complete(leader, ticket, err, !dispatcher->answer_errno);
+    }
     fuse_ticket_drop(ticket);
 
     return err;
 }
+
+/* The function returns 0 in case of success and errorcode in case of error */
+int
+fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher)
+{
+    int err = 0;
+    struct fuse_ticket *ticket = dispatcher->ticket;
+    struct fuse_data *data = ticket->data;
+    struct fuse_inflight *leader = NULL;
+    bool mutating = fuse_inflight_mutating(fuse_ticket_opcode(ticket));
+
+    dispatcher->answer_errno = 0;
+
+    if (fuse_coalesce_upcalls &&
+        fuse_inflight_coalescable(fuse_ticket_opcode(ticket))) {
+        if ((err = fuse_inflight_follow(dispatcher, &leader)) != -1) {
+            return err;
+        }
+    }
+
+    fuse_insert_callback(ticket, fuse_standard_callback);
+    fuse_insert_message(ticket);
+
+    err = fuse_dispatcher_collect(dispatcher, leader);
+
+    if (mutating) {
+        OSIncrementAtomic((SInt32 *)&data->inflight_gen);
+    }
+
+    return err;
+}
+
+/*
+ * Split version of fuse_dispatcher_wait_answer() for callers that keep
+ * several requests in flight: send queues the request and returns, and
+ * wait_sent collects the answer with the same error conventions.
+ */
+void
+fuse_dispatcher_send(struct fuse_dispatcher *dispatcher)
+{
+    dispatcher->answer_errno = 0;
+
+    fuse_insert_callback(dispatcher->ticket, fuse_standard_callback);
+    fuse_insert_message(dispatcher->ticket);
+}
+
+int
+fuse_dispatcher_wait_sent(struct fuse_dispatcher *dispatcher)
+{
+    struct fuse_data *data = dispatcher->ticket->data;
+    bool mutating = fuse_inflight_mutating(fuse_ticket_opcode(dispatcher->ticket));
+    int err;
+
+    err = fuse_dispatcher_collect(dispatcher, NULL);
+
+    if (mutating) {
+        OSIncrementAtomic((SInt32 *)&data->inflight_gen);
+    }
+
+    return err;
+}
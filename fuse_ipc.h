@@ -55,6 +55,9 @@ do {                                                   \
 
 struct fuse_ticket;
 struct fuse_data;
+struct fuse_inflight;
+struct fuse_notify_work;
+struct fuse_filehandle;
 
 typedef int fuse_callback_t(struct fuse_ticket *ticket, uio_t uio);
 
@@ -137,6 +140,29 @@ struct fuse_data {
     struct timespec            daemon_timeout;
     struct timespec           *daemon_timeout_p;
 
+    lck_mtx_t                 *statfs_mtx;
+    struct fuse_statfs_out     statfs_cache;      // protected by statfs_mtx
+    struct timespec            statfs_valid;      // protected by statfs_mtx
+    struct timespec            statfs_timeout;
+    bool                       statfs_cached;     // protected by statfs_mtx
+    bool                       statfs_refreshing; // protected by statfs_mtx
+
+    lck_mtx_t                 *inflight_mtx;
+    TAILQ_HEAD(, fuse_inflight) inflight_head; // protected by inflight_mtx
+    uint32_t                   inflight_gen;   // bumped as attributes change
+
+    lck_mtx_t                 *notify_mtx;
+    STAILQ_HEAD(, fuse_notify_work) notify_head; // protected by notify_mtx
+    bool                       notify_running;   // protected by notify_mtx
+
+    lck_mtx_t                 *park_mtx;
+    TAILQ_HEAD(, fuse_filehandle) park_head;  // protected by park_mtx
+    uint32_t                   park_count;     // protected by park_mtx
+    bool                       reaper_running; // protected by park_mtx
+    struct timespec            release_delay;
+    uint32_t                   release_budget;
+    uint32_t                   direct_io_depth;
+
     lck_mtx_t                                *node_mtx;
     RB_HEAD(fuse_data_nodes, fuse_vnode_data) nodes_head; // map ino->vnode_data
 };
@@ -169,7 +195,12 @@ enum {
     FSESS_XTIMES              = 1 << 19,
     FSESS_AUTO_CACHE          = 1 << 20,
     FSESS_NATIVE_XATTR        = 1 << 21,
-    FSESS_SPARSE              = 1 << 22
+    FSESS_SPARSE              = 1 << 22,
+    FSESS_XATTR_CACHE         = 1 << 23,
+    FSESS_STALE_ATTRCACHE     = 1 << 24,
+    FSESS_READDIRPLUS         = 1 << 25,
+    FSESS_LAZY_OPEN           = 1 << 26,
+    FSESS_HYBRID_IO           = 1 << 27
 };
 
 static __inline__
@@ -227,6 +258,9 @@ int  fuse_dispatcher_make_vp_canfail(struct fuse_dispatcher *dispatcher, enum fu
 
 int  fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher);
 
+void fuse_dispatcher_send(struct fuse_dispatcher *dispatcher);
+int  fuse_dispatcher_wait_sent(struct fuse_dispatcher *dispatcher);
+
 static __inline__
 int
 fuse_dispatcher_simple_putget_vp(struct fuse_dispatcher *dispatcher, enum fuse_opcode op,
@@ -56,6 +56,11 @@
  *  - add umask flag to input argument of open, mknod and mkdir
  *  - add notification messages for invalidation of inodes and
  *    directory entries
+ *  - add FUSE_NOTIFY_DELETE (numbered as in protocol 7.18)
+ *  - add FUSE_NOTIFY_STORE and FUSE_NOTIFY_RETRIEVE (as in protocol 7.15)
+ *  - add FUSE_FALLOCATE (numbered as in protocol 7.19)
+ *  - add FUSE_LSEEK (numbered as in protocol 7.24)
+ *  - add FUSE_COPY_FILE_RANGE (numbered as in protocol 7.28)
  */
 
 #ifndef _LINUX_FUSE_H
@@ -173,10 +178,12 @@ struct fuse_file_lock {
  * FOPEN_DIRECT_IO: bypass page cache for this open file
  * FOPEN_KEEP_CACHE: don't invalidate the data cache on open
  * FOPEN_NONSEEKABLE: the file is not seekable
+ * FOPEN_CACHE_DIR: allow caching this directory
  */
 #define FOPEN_DIRECT_IO		(1 << 0)
 #define FOPEN_KEEP_CACHE	(1 << 1)
 #define FOPEN_NONSEEKABLE	(1 << 2)
+#define FOPEN_CACHE_DIR		(1 << 3)
 #ifdef __APPLE__
 #define FOPEN_PURGE_ATTR	(1 << 30)
 #define FOPEN_PURGE_UBC		(1 << 31)
@@ -195,6 +202,7 @@ struct fuse_file_lock {
 #define FUSE_EXPORT_SUPPORT	(1 << 4)
 #define FUSE_BIG_WRITES		(1 << 5)
 #define FUSE_DONT_MASK		(1 << 6)
+#define FUSE_DO_READDIRPLUS	(1 << 13)
 #ifdef __APPLE__
 #define FUSE_CASE_INSENSITIVE	(1 << 29)
 #define FUSE_VOL_RENAME		(1 << 30)
@@ -298,6 +306,11 @@ enum fuse_opcode {
 	FUSE_DESTROY       = 38,
 	FUSE_IOCTL         = 39,
 	FUSE_POLL          = 40,
+	FUSE_NOTIFY_REPLY  = 41,
+	FUSE_FALLOCATE     = 43,
+	FUSE_READDIRPLUS   = 44,
+	FUSE_LSEEK         = 46,
+	FUSE_COPY_FILE_RANGE = 47,
 #ifdef __APPLE__
 	FUSE_SETVOLNAME    = 61,
 	FUSE_GETXTIMES     = 62,
@@ -312,6 +325,9 @@ enum fuse_notify_code {
 	FUSE_NOTIFY_POLL   = 1,
 	FUSE_NOTIFY_INVAL_INODE = 2,
 	FUSE_NOTIFY_INVAL_ENTRY = 3,
+	FUSE_NOTIFY_STORE = 4,
+	FUSE_NOTIFY_RETRIEVE = 5,
+	FUSE_NOTIFY_DELETE = 6,
 	FUSE_NOTIFY_CODE_MAX,
 };
 
@@ -611,6 +627,42 @@ struct fuse_notify_poll_wakeup_out {
 	__u64	kh;
 };
 
+/* fallocate mode bits, as in linux/falloc.h */
+#define FUSE_FALLOC_FL_KEEP_SIZE	0x01
+
+struct fuse_fallocate_in {
+	__u64	fh;
+	__u64	offset;
+	__u64	length;
+	__u32	mode;
+	__u32	padding;
+};
+
+/* whence values of fuse_lseek_in, as on Linux */
+#define FUSE_LSEEK_DATA	3
+#define FUSE_LSEEK_HOLE	4
+
+struct fuse_lseek_in {
+	__u64	fh;
+	__u64	offset;
+	__u32	whence;
+	__u32	padding;
+};
+
+struct fuse_lseek_out {
+	__u64	offset;
+};
+
+struct fuse_copy_file_range_in {
+	__u64	fh_in;
+	__u64	off_in;
+	__u64	nodeid_out;
+	__u64	fh_out;
+	__u64	off_out;
+	__u64	len;
+	__u64	flags;
+};
+
 struct fuse_in_header {
 	__u32	len;
 	__u32	opcode;
@@ -641,6 +693,16 @@ struct fuse_dirent {
 #define FUSE_DIRENT_SIZE(d) \
 	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + (d)->namelen)
 
+struct fuse_direntplus {
+	struct fuse_entry_out entry_out;
+	struct fuse_dirent dirent;
+};
+
+#define FUSE_NAME_OFFSET_DIRENTPLUS \
+	offsetof(struct fuse_direntplus, dirent.name)
+#define FUSE_DIRENTPLUS_SIZE(d) \
+	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + (d)->dirent.namelen)
+
 struct fuse_notify_inval_inode_out {
 	__u64	ino;
 	__s64	off;
@@ -653,4 +715,36 @@ struct fuse_notify_inval_entry_out {
 	__u32	padding;
 };
 
+struct fuse_notify_store_out {
+	__u64	nodeid;
+	__u64	offset;
+	__u32	size;
+	__u32	padding;
+};
+
+struct fuse_notify_retrieve_out {
+	__u64	notify_unique;
+	__u64	nodeid;
+	__u64	offset;
+	__u32	size;
+	__u32	padding;
+};
+
+/* Matches the size of fuse_write_in */
+struct fuse_notify_retrieve_in {
+	__u64	dummy1;
+	__u64	offset;
+	__u32	size;
+	__u32	dummy2;
+	__u64	dummy3;
+	__u64	dummy4;
+};
+
+struct fuse_notify_delete_out {
+	__u64	parent;
+	__u64	child;
+	__u32	namelen;
+	__u32	padding;
+};
+
 #endif /* _LINUX_FUSE_H */
@@ -25,10 +25,459 @@ static int fuse_vnode_compare(struct fuse_vnode_data *d1, struct fuse_vnode_data
 
 RB_GENERATE(fuse_data_nodes, fuse_vnode_data, nodes_link, fuse_vnode_compare);
 
+static void
+fuse_xattr_cache_purge(struct fuse_vnode_data *fvdat)
+{
+    struct fuse_xattr_entry *entry;
+
+    while ((entry = TAILQ_FIRST(&fvdat->xattr_cache))) {
+        TAILQ_REMOVE(&fvdat->xattr_cache, entry, link);
+        FUSE_OSFree(entry, entry->allocsize, fuse_malloc_tag);
+    }
+    fvdat->xattr_cache_count = 0;
+
+    if (fvdat->xattr_list) {
+        FUSE_OSFree(fvdat->xattr_list, fvdat->xattr_list_size,
+                    fuse_malloc_tag);
+        fvdat->xattr_list = NULL;
+    }
+    fvdat->xattr_list_size = 0;
+    fvdat->xattr_list_valid = false;
+}
+
+/*
+ * Cached extended attributes are only trusted while the attributes they
+ * were fetched under are valid; a ctime change purges them altogether.
+ */
+static bool
+fuse_xattr_cache_isvalid(struct fuse_vnode_data *fvdat)
+{
+    struct timespec uptsp;
+
+    nanouptime(&uptsp);
+    return fuse_timespec_cmp(&uptsp, &fvdat->attr_valid, <=);
+}
+
+static int
+fuse_xattr_cache_copyout(void *value, size_t size, uio_t uio, size_t *sizep)
+{
+    *sizep = size;
+
+    if (!uio) {
+        return 0;
+    }
+
+    if ((user_ssize_t)size > uio_resid(uio)) {
+        return ERANGE;
+    }
+
+    return uiomove((char *)value, (int)size, uio);
+}
+
+void
+fuse_invalidate_xattr(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+
+    if (fvdat) {
+        fuse_lck_mtx_lock(fvdat->cache_mtx);
+        fuse_xattr_cache_purge(fvdat);
+        fuse_lck_mtx_unlock(fvdat->cache_mtx);
+    }
+}
+
+bool
+fuse_xattr_cache_lookup(vnode_t vp, const char *name, uio_t uio,
+                        size_t *sizep, int *err)
+{
+    struct fuse_vnode_data  *fvdat = VTOFUD(vp);
+    struct fuse_xattr_entry *entry;
+    bool found = false;
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+
+    if (!fuse_xattr_cache_isvalid(fvdat)) {
+        goto out;
+    }
+
+    TAILQ_FOREACH(entry, &fvdat->xattr_cache, link) {
+        if (strcmp(entry->name, name) == 0) {
+            break;
+        }
+    }
+
+    if (entry) {
+        if (entry->err) {
+            *err = entry->err;
+            found = true;
+        } else if (!uio || entry->value) {
+            *err = fuse_xattr_cache_copyout(entry->value, entry->size,
+                                            uio, sizep);
+            found = true;
+        }
+    } else if (fvdat->xattr_list_valid &&
+               (fvdat->xattr_list || fvdat->xattr_list_size == 0)) {
+        /* A name missing from a complete listing does not exist. */
+        const char *cp = fvdat->xattr_list;
+        const char *end = cp + fvdat->xattr_list_size;
+
+        found = true;
+        while (cp < end) {
+            size_t len = 0;
+            while ((cp + len < end) && cp[len] != '\0') {
+                len++;
+            }
+            if (strncmp(cp, name, len) == 0 && name[len] == '\0') {
+                found = false;
+                break;
+            }
+            cp += len + 1;
+        }
+        if (found) {
+            *err = ENOATTR;
+        }
+    }
+
+out:
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    return found;
+}
+
+void
+fuse_xattr_cache_enter(vnode_t vp, const char *name, const void *value,
+                       size_t size, int err)
+{
+    struct fuse_vnode_data  *fvdat = VTOFUD(vp);
+    struct fuse_xattr_entry *entry;
+    size_t namelen = strlen(name);
+    size_t allocsize;
+
+    if (value && size > fuse_xattr_cache_max_size) {
+        value = NULL;
+    }
+
+    allocsize = sizeof(*entry) + namelen + 1 + (value ? size : 0);
+    entry = FUSE_OSMalloc(allocsize, fuse_malloc_tag);
+    if (!entry) {
+        return;
+    }
+
+    entry->allocsize = allocsize;
+    entry->err = err;
+    entry->size = size;
+    memcpy(entry->name, name, namelen + 1);
+    if (value) {
+        entry->value = entry->name + namelen + 1;
+        memcpy(entry->value, value, size);
+    } else {
+        entry->value = NULL;
+    }
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+
+    struct fuse_xattr_entry *old;
+    TAILQ_FOREACH(old, &fvdat->xattr_cache, link) {
+        if (strcmp(old->name, name) == 0) {
+            break;
+        }
+    }
+
+    if (old && !old->err && old->value && !value && !err &&
+        old->size == size) {
+        /* Do not replace a known value with a mere size. */
+        FUSE_OSFree(entry, allocsize, fuse_malloc_tag);
+        entry = NULL;
+    } else if (old) {
+        TAILQ_REMOVE(&fvdat->xattr_cache, old, link);
+        FUSE_OSFree(old, old->allocsize, fuse_malloc_tag);
+        fvdat->xattr_cache_count--;
+    } else if (fvdat->xattr_cache_count >= FUSE_XATTR_CACHE_MAXENTRIES) {
+        old = TAILQ_FIRST(&fvdat->xattr_cache);
+        TAILQ_REMOVE(&fvdat->xattr_cache, old, link);
+        FUSE_OSFree(old, old->allocsize, fuse_malloc_tag);
+        fvdat->xattr_cache_count--;
+    }
+
+    if (entry) {
+        TAILQ_INSERT_TAIL(&fvdat->xattr_cache, entry, link);
+        fvdat->xattr_cache_count++;
+    }
+
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+}
+
+bool
+fuse_xattr_cache_list_lookup(vnode_t vp, uio_t uio, size_t *sizep, int *err)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    bool found = false;
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    if (fuse_xattr_cache_isvalid(fvdat) && fvdat->xattr_list_valid &&
+        (!uio || fvdat->xattr_list || fvdat->xattr_list_size == 0)) {
+        *err = fuse_xattr_cache_copyout(fvdat->xattr_list,
+                                        fvdat->xattr_list_size, uio, sizep);
+        found = true;
+    }
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    return found;
+}
+
+void
+fuse_xattr_cache_list_enter(vnode_t vp, const void *list, size_t size)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    void *copy = NULL;
+
+    if (list && size > 0 && size <= fuse_xattr_cache_max_size) {
+        copy = FUSE_OSMalloc(size, fuse_malloc_tag);
+        if (copy) {
+            memcpy(copy, list, size);
+        }
+    }
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    if (!copy && fvdat->xattr_list_valid && fvdat->xattr_list &&
+        fvdat->xattr_list_size == size) {
+        /* Keep the names we already have. */
+    } else {
+        if (fvdat->xattr_list) {
+            FUSE_OSFree(fvdat->xattr_list, fvdat->xattr_list_size,
+                        fuse_malloc_tag);
+        }
+        fvdat->xattr_list = copy;
+        fvdat->xattr_list_size = size;
+        fvdat->xattr_list_valid = true;
+    }
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+}
+
+struct fuse_dircache *
+fuse_dircache_alloc(void)
+{
+    struct fuse_dircache *dc;
+
+    dc = FUSE_OSMalloc(sizeof(struct fuse_dircache), fuse_malloc_tag);
+    if (dc) {
+        bzero(dc, sizeof(struct fuse_dircache));
+        dc->refcount = 1;
+    }
+
+    return dc;
+}
+
+/*
+ * Makes room for size more bytes. Fails once all listings together would
+ * exceed the dircache_max_size tunable (a soft limit, checked unlocked).
+ */
+bool
+fuse_dircache_grow(struct fuse_dircache *dc, size_t size)
+{
+    size_t newsize;
+    void *data;
+
+    if (dc->len + size <= dc->allocsize) {
+        return true;
+    }
+
+    newsize = max(max(dc->allocsize * 2, dc->len + size), (size_t)PAGE_SIZE);
+    if ((size_t)fuse_dircache_bytes + (newsize - dc->allocsize) >
+        fuse_dircache_max_size) {
+        return false;
+    }
+
+    data = FUSE_OSMalloc(newsize, fuse_malloc_tag);
+    if (!data) {
+        return false;
+    }
+
+    if (dc->data) {
+        memcpy(data, dc->data, dc->len);
+        FUSE_OSFree(dc->data, dc->allocsize, fuse_malloc_tag);
+    }
+    OSAddAtomic((SInt32)(newsize - dc->allocsize),
+                (SInt32 *)&fuse_dircache_bytes);
+
+    dc->data = data;
+    dc->allocsize = newsize;
+
+    return true;
+}
+
+void
+fuse_dircache_release(struct fuse_dircache *dc)
+{
+    if (OSDecrementAtomic(&dc->refcount) != 1) {
+        return;
+    }
+
+    if (dc->data) {
+        FUSE_OSFree(dc->data, dc->allocsize, fuse_malloc_tag);
+        OSAddAtomic(-(SInt32)dc->allocsize, (SInt32 *)&fuse_dircache_bytes);
+    }
+    FUSE_OSFree(dc, sizeof(struct fuse_dircache), fuse_malloc_tag);
+}
+
+/* Returns a reference to the directory's listing, if there is one. */
+struct fuse_dircache *
+fuse_dircache_get(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_dircache *dc;
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    dc = fvdat->dircache;
+    if (dc) {
+        OSIncrementAtomic(&dc->refcount);
+    }
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    return dc;
+}
+
+/*
+ * Invalidations bump the generation; a listing that was started under an
+ * older one is stale and gets dropped instead of published.
+ */
+uint32_t
+fuse_dircache_gen(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    uint32_t gen;
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    gen = fvdat->dircache_gen;
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    return gen;
+}
+
+/* Consumes the caller's reference to dc. */
+void
+fuse_dircache_publish(vnode_t vp, struct fuse_dircache *dc, uint32_t gen)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_dircache *old = NULL;
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    if (fvdat->dircache_gen == gen) {
+        old = fvdat->dircache;
+        fvdat->dircache = dc;
+        dc = NULL;
+    }
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    if (old) {
+        fuse_dircache_release(old);
+    }
+    if (dc) {
+        fuse_dircache_release(dc);
+    }
+}
+
+/*
+ * Records a range of the page cache to be thrown away. Used where the UBC
+ * must not be touched, such as while handling a notification on the
+ * daemon's write(2); the next read, write, open or mmap applies it.
+ */
+void
+fuse_vnode_inval_range(struct fuse_vnode_data *fvdat, off_t start, off_t end)
+{
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    if (fvdat->inval_end > fvdat->inval_start) {
+        if (start < fvdat->inval_start) {
+            fvdat->inval_start = start;
+        }
+        if (end > fvdat->inval_end) {
+            fvdat->inval_end = end;
+        }
+    } else {
+        fvdat->inval_start = start;
+        fvdat->inval_end = end;
+    }
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+}
+
+void
+fuse_vnode_inval_apply(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    off_t start;
+    off_t end;
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    start = fvdat->inval_start;
+    end = fvdat->inval_end;
+    fvdat->inval_start = 0;
+    fvdat->inval_end = 0;
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    if ((end > start) && vnode_isreg(vp)) {
+        fuse_vnode_inval_ubc(vp, start, end, UBC_PUSHDIRTY | UBC_SYNC);
+    }
+}
+
+/*
+ * Throws away the cached pages of [start, end) of a regular file, pushing
+ * them out first as flags say, and accounts for the bytes dropped and for
+ * the bytes of the file that stay cached.
+ */
+void
+fuse_vnode_inval_ubc(vnode_t vp, off_t start, off_t end, int flags)
+{
+    off_t filesize = VTOFUD(vp)->filesize;
+
+    if (end > filesize) {
+        end = filesize;
+    }
+    fuse_invalidate_extents(vp);
+
+    if (start >= end) {
+        return;
+    }
+
+    (void)ubc_msync(vp, start, end, NULL, flags | UBC_INVALIDATE);
+
+    OSAddAtomic64((SInt64)(end - start), (SInt64 *)&fuse_inval_bytes);
+    OSAddAtomic64((SInt64)(filesize - (end - start)),
+                  (SInt64 *)&fuse_inval_bytes_kept);
+}
+
+void
+fuse_invalidate_dircache(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_dircache *dc;
+
+    if (!fvdat) {
+        return;
+    }
+
+    fuse_lck_mtx_lock(fvdat->cache_mtx);
+    dc = fvdat->dircache;
+    fvdat->dircache = NULL;
+    fvdat->dircache_gen++;
+    fuse_lck_mtx_unlock(fvdat->cache_mtx);
+
+    if (dc) {
+        fuse_dircache_release(dc);
+    }
+}
+
 void
 fuse_vnode_data_destroy(struct fuse_vnode_data *fvdat)
 {
+    fuse_xattr_cache_purge(fvdat);
+
+    if (fvdat->dircache) {
+        fuse_dircache_release(fvdat->dircache);
+    }
+
     lck_mtx_free(fvdat->fufh_mtx, fuse_lock_group);
+    lck_rw_free(fvdat->truncatelock, fuse_lock_group);
+    lck_mtx_free(fvdat->cache_mtx, fuse_lock_group);
 
     FUSE_OSFree(fvdat, sizeof(*fvdat), fuse_malloc_tag);
 }
@@ -117,6 +566,8 @@ FSNodeGetOrCreateFileVNodeByID(vnode_t               *vnPtr,
         }
         fvdat->fufh_mtx = lck_mtx_alloc_init(fuse_lock_group,
                                              fuse_lock_attr);
+        fvdat->truncatelock = lck_rw_alloc_init(fuse_lock_group,
+                                                fuse_lock_attr);
 
         /* flags */
         fvdat->flag         = 0;
@@ -143,6 +594,11 @@ FSNodeGetOrCreateFileVNodeByID(vnode_t               *vnPtr,
         fvdat->nlookup             = 0;
         fvdat->vtype               = vtyp;
 
+        /* caches */
+        fvdat->cache_mtx = lck_mtx_alloc_init(fuse_lock_group,
+                                              fuse_lock_attr);
+        TAILQ_INIT(&fvdat->xattr_cache);
+
         params.vnfs_mp     = mp;
         params.vnfs_vtype  = vtyp;
         params.vnfs_str    = NULL;
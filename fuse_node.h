@@ -41,6 +41,61 @@ enum {
 #define C_TOUCH_CHGTIME      0x000020000
 #define C_TOUCH_MODTIME      0x000040000
 #define C_XTIMES_VALID       0x000080000
+#define C_ADVISE_RDPLUS      0x000100000
+
+/*
+ * Recent FUSE_ACCESS answers. An entry is keyed by the caller's uid, its
+ * group list and the requested access mask, and stays valid for as long as
+ * the attributes it was obtained with.
+ */
+#define FUSE_ACCESS_CACHE_SIZE 4
+#define FUSE_EXTENT_CACHE_SIZE 4
+
+struct fuse_access_entry {
+    uid_t           uid;
+    uint32_t        ngroups;
+    gid_t           groups[NGROUPS];
+    uint32_t        mask;
+    int             err;
+    struct timespec expires;
+};
+
+/* A stretch of a sparse file that is known to be all hole or all data. */
+struct fuse_extent {
+    off_t start;
+    off_t end;
+    bool  hole;
+};
+
+/*
+ * Extended attribute cache, enabled with the xattr_cache mount option. Values
+ * up to the xattr_cache_max_size tunable are kept along with negative
+ * (ENOATTR) answers and the listxattr name set. Everything is dropped when
+ * the attributes report a new ctime or an xattr is changed through us.
+ */
+#define FUSE_XATTR_CACHE_MAXENTRIES 32
+
+struct fuse_xattr_entry {
+    TAILQ_ENTRY(fuse_xattr_entry) link;
+    size_t  allocsize;
+    int     err;     /* 0 or ENOATTR */
+    size_t  size;    /* size of the value */
+    void   *value;   /* NULL if only the size is known */
+    char    name[0];
+};
+
+/*
+ * Complete listing of a directory opened with FOPEN_CACHE_DIR, kept as
+ * extended dirents whose d_seekoff is the daemon's cookie for the entry
+ * after them. Published listings never change and are reference counted,
+ * so they are copied out without cache_mtx held.
+ */
+struct fuse_dircache {
+    SInt32  refcount;
+    size_t  allocsize;
+    size_t  len;
+    void   *data;
+};
 
 struct fuse_vnode_data {
 
@@ -58,6 +113,9 @@ struct fuse_vnode_data {
     /** I/O **/
     struct     fuse_filehandle fufh[FUFH_MAXTYPE];
     lck_mtx_t                 *fufh_mtx;
+    lck_rw_t                  *truncatelock; /* shared for I/O, exclusive to change the size */
+    int                        flush_error; /* of an async FLUSH, protected by node_mtx */
+    off_t                      io_next; /* where the last read or write ended */
 
     /** flags **/
     uint32_t   flag;
@@ -71,6 +129,26 @@ struct fuse_vnode_data {
     off_t             filesize;
     uint64_t          nlookup;
     enum vtype        vtype;
+
+    /** caches **/
+    lck_mtx_t                *cache_mtx;
+    struct fuse_access_entry  access_cache[FUSE_ACCESS_CACHE_SIZE];
+    uint32_t                  access_cache_next;
+    uint32_t                  access_cache_gen;
+    struct fuse_extent        extent_cache[FUSE_EXTENT_CACHE_SIZE];
+    uint32_t                  extent_cache_next;
+    uint32_t                  extent_cache_gen;
+    TAILQ_HEAD(, fuse_xattr_entry) xattr_cache;
+    uint32_t                  xattr_cache_count;
+    bool                      xattr_list_valid;
+    void                     *xattr_list;  /* NULL if only the size is known */
+    size_t                    xattr_list_size;
+    bool                      attr_revalidating;
+    uint32_t                  attr_revalidate_gen; /* inflight_gen at send */
+    struct fuse_dircache     *dircache;
+    uint32_t                  dircache_gen;
+    off_t                     inval_start; /* pending page cache invalidation */
+    off_t                     inval_end;
 };
 typedef struct fuse_vnode_data * fusenode_t;
 
@@ -97,6 +175,59 @@ fuse_invalidate_attr(vnode_t vp)
     }
 }
 
+static __inline__
+void
+fuse_invalidate_access(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+
+    if (fvdat) {
+        fuse_lck_mtx_lock(fvdat->cache_mtx);
+        bzero(fvdat->access_cache, sizeof(fvdat->access_cache));
+        fvdat->access_cache_gen++;
+        fuse_lck_mtx_unlock(fvdat->cache_mtx);
+    }
+}
+
+/* To be called whenever the data of the file may have changed. */
+static __inline__
+void
+fuse_invalidate_extents(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+
+    if (fvdat) {
+        fuse_lck_mtx_lock(fvdat->cache_mtx);
+        bzero(fvdat->extent_cache, sizeof(fvdat->extent_cache));
+        fvdat->extent_cache_gen++;
+        fuse_lck_mtx_unlock(fvdat->cache_mtx);
+    }
+}
+
+void fuse_invalidate_xattr(vnode_t vp);
+
+bool fuse_xattr_cache_lookup(vnode_t vp, const char *name, uio_t uio,
+                             size_t *sizep, int *err);
+void fuse_xattr_cache_enter(vnode_t vp, const char *name, const void *value,
+                            size_t size, int err);
+bool fuse_xattr_cache_list_lookup(vnode_t vp, uio_t uio, size_t *sizep,
+                                  int *err);
+void fuse_xattr_cache_list_enter(vnode_t vp, const void *list, size_t size);
+
+void fuse_invalidate_dircache(vnode_t vp);
+
+struct fuse_dircache *fuse_dircache_alloc(void);
+bool fuse_dircache_grow(struct fuse_dircache *dc, size_t size);
+void fuse_dircache_release(struct fuse_dircache *dc);
+struct fuse_dircache *fuse_dircache_get(vnode_t vp);
+uint32_t fuse_dircache_gen(vnode_t vp);
+void fuse_dircache_publish(vnode_t vp, struct fuse_dircache *dc, uint32_t gen);
+
+void fuse_vnode_inval_range(struct fuse_vnode_data *fvdat, off_t start,
+                            off_t end);
+void fuse_vnode_inval_apply(vnode_t vp);
+void fuse_vnode_inval_ubc(vnode_t vp, off_t start, off_t end, int flags);
+
 void fuse_vnode_init(vnode_t vp, struct fuse_vnode_data *fvdat,
                      uint64_t nodeid, enum vtype vtyp, uint64_t parentid);
 void fuse_vnode_ditch(vnode_t vp, vfs_context_t context);
@@ -14,16 +14,38 @@
 #include <sys/types.h>
 #include <sys/sysctl.h>
 
-/* NB: none of these are bigger than unsigned 32-bit. */
+/*
+ * NB: the uint64_t ones are cumulative byte counts (SYSCTL_QUAD); none of
+ * the others are bigger than unsigned 32-bit.
+ */
 
+uint32_t fuse_access_cache_hits      = 0;                                  // r
+uint32_t fuse_access_cache_misses    = 0;                                  // r
 int32_t  fuse_admin_group            = 0;                                  // rw
 int32_t  fuse_allow_other            = 0;                                  // rw
 uint32_t fuse_api_major              = FUSE_KERNEL_VERSION;                // r
 uint32_t fuse_api_minor              = FUSE_KERNEL_MINOR_VERSION;          // r
+uint32_t fuse_attr_stale_histogram[FUSE_ATTR_STALE_BUCKETS] = { 0 };       // r
+uint32_t fuse_attr_stale_window      = FUSE_DEFAULT_ATTR_STALE_WINDOW;     // rw
+uint32_t fuse_coalesce_hits          = 0;                                  // r
+uint32_t fuse_coalesce_misses        = 0;                                  // r
+int32_t  fuse_coalesce_upcalls       = 1;                                  // rw
+uint64_t fuse_copy_bytes_offloaded   = 0;                                  // r
+int32_t  fuse_dircache_bytes         = 0;                                  // r
+uint32_t fuse_dircache_hits          = 0;                                  // r
+uint32_t fuse_dircache_max_size      = FUSE_DEFAULT_DIRCACHE_MAX_SIZE;     // rw
 int32_t  fuse_fh_current             = 0;                                  // r
+uint32_t fuse_fh_opens_avoided       = 0;                                  // r
 uint32_t fuse_fh_reuse_count         = 0;                                  // r
+uint32_t fuse_fh_unparked            = 0;                                  // r
 uint32_t fuse_fh_upcall_count        = 0;                                  // r
 uint32_t fuse_fh_zombies             = 0;                                  // r
+uint64_t fuse_hole_bytes_filled      = 0;                                  // r
+uint32_t fuse_hybrid_io_min          = FUSE_DEFAULT_HYBRID_IO_MIN;         // rw
+uint64_t fuse_inval_bytes            = 0;                                  // r
+uint64_t fuse_inval_bytes_kept       = 0;                                  // r
+uint64_t fuse_io_cached_bytes        = 0;                                  // r
+uint64_t fuse_io_direct_bytes        = 0;                                  // r
 int32_t  fuse_iov_credit             = FUSE_DEFAULT_IOV_CREDIT;            // rw
 int32_t  fuse_iov_current            = 0;                                  // r
 uint32_t fuse_iov_permanent_bufsize  = FUSE_DEFAULT_IOV_PERMANENT_BUFSIZE; // rw
@@ -35,10 +57,17 @@ uint32_t fuse_lookup_cache_overrides = 0;                                  // r
 uint32_t fuse_max_freetickets        = FUSE_DEFAULT_MAX_FREE_TICKETS;      // rw
 uint32_t fuse_max_tickets            = 0;                                  // rw
 int32_t  fuse_mount_count            = 0;                                  // r
+uint32_t fuse_notifications          = 0;                                  // r
+uint64_t fuse_notify_store_bytes     = 0;                                  // r
+uint32_t fuse_readdir_upcalls_avoided = 0;                                 // r
 int32_t  fuse_realloc_count          = 0;                                  // r
+uint32_t fuse_statfs_upcalls_avoided = 0;                                  // r
 int32_t  fuse_tickets_current        = 0;                                  // r
 uint32_t fuse_userkernel_bufsize     = FUSE_DEFAULT_USERKERNEL_BUFSIZE;    // rw
 int32_t  fuse_vnodes_current         = 0;                                  // r
+uint32_t fuse_xattr_cache_hits       = 0;                                  // r
+uint32_t fuse_xattr_cache_max_size   = FUSE_DEFAULT_XATTR_CACHE_MAX_SIZE;  // rw
+uint32_t fuse_xattr_cache_misses     = 0;                                  // r
 #ifdef FUSE4X_ENABLE_MACFUSE_MODE
 int32_t  fuse_macfuse_mode           = 0;                                  // w
 #endif
@@ -311,10 +340,46 @@ SYSCTL_PROC(_vfs_generic_fuse4x_control,   // our parent
             "fuse4x Controls: Print Vnodes for the Given File System");
 
 /* fuse.counters */
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, access_cache_hits, CTLFLAG_RD,
+           &fuse_access_cache_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, access_cache_misses, CTLFLAG_RD,
+           &fuse_access_cache_misses, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, attr_stale_10ms, CTLFLAG_RD,
+           &fuse_attr_stale_histogram[0], 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, attr_stale_100ms, CTLFLAG_RD,
+           &fuse_attr_stale_histogram[1], 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, attr_stale_1s, CTLFLAG_RD,
+           &fuse_attr_stale_histogram[2], 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, attr_stale_10s, CTLFLAG_RD,
+           &fuse_attr_stale_histogram[3], 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, attr_stale_longer, CTLFLAG_RD,
+           &fuse_attr_stale_histogram[4], 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, coalesce_hits, CTLFLAG_RD,
+           &fuse_coalesce_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, coalesce_misses, CTLFLAG_RD,
+           &fuse_coalesce_misses, 0, "");
+SYSCTL_QUAD(_vfs_generic_fuse4x_counters, OID_AUTO, copy_bytes_offloaded, CTLFLAG_RD,
+            &fuse_copy_bytes_offloaded, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, dircache_hits, CTLFLAG_RD,
+           &fuse_dircache_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, filehandle_opens_avoided,
+           CTLFLAG_RD, &fuse_fh_opens_avoided, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, filehandle_reuse, CTLFLAG_RD,
            &fuse_fh_reuse_count, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, filehandle_unparked, CTLFLAG_RD,
+           &fuse_fh_unparked, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, filehandle_upcalls, CTLFLAG_RD,
            &fuse_fh_upcall_count, 0, "");
+SYSCTL_QUAD(_vfs_generic_fuse4x_counters, OID_AUTO, hole_bytes_filled, CTLFLAG_RD,
+            &fuse_hole_bytes_filled, "");
+SYSCTL_QUAD(_vfs_generic_fuse4x_counters, OID_AUTO, inval_bytes, CTLFLAG_RD,
+            &fuse_inval_bytes, "");
+SYSCTL_QUAD(_vfs_generic_fuse4x_counters, OID_AUTO, inval_bytes_kept, CTLFLAG_RD,
+            &fuse_inval_bytes_kept, "");
+SYSCTL_QUAD(_vfs_generic_fuse4x_counters, OID_AUTO, io_cached_bytes, CTLFLAG_RD,
+            &fuse_io_cached_bytes, "");
+SYSCTL_QUAD(_vfs_generic_fuse4x_counters, OID_AUTO, io_direct_bytes, CTLFLAG_RD,
+            &fuse_io_direct_bytes, "");
 SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, lookup_cache_hits, CTLFLAG_RD,
            &fuse_lookup_cache_hits, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, lookup_cache_misses, CTLFLAG_RD,
@@ -323,8 +388,22 @@ SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, lookup_cache_overrides,
            CTLFLAG_RD, &fuse_lookup_cache_overrides, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, memory_reallocs, CTLFLAG_RD,
            &fuse_realloc_count, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, notifications, CTLFLAG_RD,
+           &fuse_notifications, 0, "");
+SYSCTL_QUAD(_vfs_generic_fuse4x_counters, OID_AUTO, notify_store_bytes, CTLFLAG_RD,
+            &fuse_notify_store_bytes, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, readdir_upcalls_avoided, CTLFLAG_RD,
+           &fuse_readdir_upcalls_avoided, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, statfs_upcalls_avoided, CTLFLAG_RD,
+           &fuse_statfs_upcalls_avoided, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, xattr_cache_hits, CTLFLAG_RD,
+           &fuse_xattr_cache_hits, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, xattr_cache_misses, CTLFLAG_RD,
+           &fuse_xattr_cache_misses, 0, "");
 
 /* fuse.resourceusage */
+SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, dircache_bytes, CTLFLAG_RD,
+           &fuse_dircache_bytes, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, filehandles, CTLFLAG_RD,
            &fuse_fh_current, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, filehandles_zombies, CTLFLAG_RD,
@@ -347,6 +426,14 @@ SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, admin_group, CTLFLAG_RW,
            &fuse_admin_group, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, allow_other, CTLFLAG_RW,
            &fuse_allow_other, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, attr_stale_window, CTLFLAG_RW,
+           &fuse_attr_stale_window, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, coalesce_upcalls, CTLFLAG_RW,
+           &fuse_coalesce_upcalls, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, dircache_max_size, CTLFLAG_RW,
+           &fuse_dircache_max_size, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, hybrid_io_min, CTLFLAG_RW,
+           &fuse_hybrid_io_min, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, iov_credit, CTLFLAG_RW,
            &fuse_iov_credit, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, iov_permanent_bufsize, CTLFLAG_RW,
@@ -364,6 +451,8 @@ SYSCTL_PROC(_vfs_generic_fuse4x_tunables,          // our parent
             sysctl_fuse4x_tunables_userkernel_bufsize_handler,
             "I",                        // our data type (integer)
             "fuse4x Tunables");        // our description
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, xattr_cache_max_size, CTLFLAG_RW,
+           &fuse_xattr_cache_max_size, 0, "");
 
 /* fuse.version */
 SYSCTL_INT(_vfs_generic_fuse4x_version, OID_AUTO, api_major, CTLFLAG_RD,
@@ -387,12 +476,37 @@ static struct sysctl_oid *fuse_sysctl_list[] =
     &sysctl__vfs_generic_fuse4x_control_macfuse_mode,
 #endif
     &sysctl__vfs_generic_fuse4x_control_print_vnodes,
+    &sysctl__vfs_generic_fuse4x_counters_access_cache_hits,
+    &sysctl__vfs_generic_fuse4x_counters_access_cache_misses,
+    &sysctl__vfs_generic_fuse4x_counters_attr_stale_10ms,
+    &sysctl__vfs_generic_fuse4x_counters_attr_stale_100ms,
+    &sysctl__vfs_generic_fuse4x_counters_attr_stale_1s,
+    &sysctl__vfs_generic_fuse4x_counters_attr_stale_10s,
+    &sysctl__vfs_generic_fuse4x_counters_attr_stale_longer,
+    &sysctl__vfs_generic_fuse4x_counters_coalesce_hits,
+    &sysctl__vfs_generic_fuse4x_counters_coalesce_misses,
+    &sysctl__vfs_generic_fuse4x_counters_copy_bytes_offloaded,
+    &sysctl__vfs_generic_fuse4x_counters_dircache_hits,
+    &sysctl__vfs_generic_fuse4x_counters_filehandle_opens_avoided,
     &sysctl__vfs_generic_fuse4x_counters_filehandle_reuse,
+    &sysctl__vfs_generic_fuse4x_counters_filehandle_unparked,
     &sysctl__vfs_generic_fuse4x_counters_filehandle_upcalls,
+    &sysctl__vfs_generic_fuse4x_counters_hole_bytes_filled,
+    &sysctl__vfs_generic_fuse4x_counters_inval_bytes,
+    &sysctl__vfs_generic_fuse4x_counters_inval_bytes_kept,
+    &sysctl__vfs_generic_fuse4x_counters_io_cached_bytes,
+    &sysctl__vfs_generic_fuse4x_counters_io_direct_bytes,
     &sysctl__vfs_generic_fuse4x_counters_lookup_cache_hits,
     &sysctl__vfs_generic_fuse4x_counters_lookup_cache_misses,
     &sysctl__vfs_generic_fuse4x_counters_lookup_cache_overrides,
     &sysctl__vfs_generic_fuse4x_counters_memory_reallocs,
+    &sysctl__vfs_generic_fuse4x_counters_notifications,
+    &sysctl__vfs_generic_fuse4x_counters_notify_store_bytes,
+    &sysctl__vfs_generic_fuse4x_counters_readdir_upcalls_avoided,
+    &sysctl__vfs_generic_fuse4x_counters_statfs_upcalls_avoided,
+    &sysctl__vfs_generic_fuse4x_counters_xattr_cache_hits,
+    &sysctl__vfs_generic_fuse4x_counters_xattr_cache_misses,
+    &sysctl__vfs_generic_fuse4x_resourceusage_dircache_bytes,
     &sysctl__vfs_generic_fuse4x_resourceusage_filehandles,
     &sysctl__vfs_generic_fuse4x_resourceusage_filehandles_zombies,
     &sysctl__vfs_generic_fuse4x_resourceusage_ipc_iovs,
@@ -404,11 +518,16 @@ static struct sysctl_oid *fuse_sysctl_list[] =
     &sysctl__vfs_generic_fuse4x_resourceusage_vnodes,
     &sysctl__vfs_generic_fuse4x_tunables_admin_group,
     &sysctl__vfs_generic_fuse4x_tunables_allow_other,
+    &sysctl__vfs_generic_fuse4x_tunables_attr_stale_window,
+    &sysctl__vfs_generic_fuse4x_tunables_coalesce_upcalls,
+    &sysctl__vfs_generic_fuse4x_tunables_dircache_max_size,
+    &sysctl__vfs_generic_fuse4x_tunables_hybrid_io_min,
     &sysctl__vfs_generic_fuse4x_tunables_iov_credit,
     &sysctl__vfs_generic_fuse4x_tunables_iov_permanent_bufsize,
     &sysctl__vfs_generic_fuse4x_tunables_max_freetickets,
     &sysctl__vfs_generic_fuse4x_tunables_max_tickets,
     &sysctl__vfs_generic_fuse4x_tunables_userkernel_bufsize,
+    &sysctl__vfs_generic_fuse4x_tunables_xattr_cache_max_size,
     &sysctl__vfs_generic_fuse4x_version_api_major,
     &sysctl__vfs_generic_fuse4x_version_api_minor,
     &sysctl__vfs_generic_fuse4x_version_number,
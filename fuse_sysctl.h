@@ -8,12 +8,31 @@
 
 #include "fuse.h"
 
+extern uint32_t fuse_access_cache_hits;
+extern uint32_t fuse_access_cache_misses;
 extern int32_t  fuse_admin_group;
 extern int32_t  fuse_allow_other;
+extern uint32_t fuse_attr_stale_histogram[FUSE_ATTR_STALE_BUCKETS];
+extern uint32_t fuse_attr_stale_window;
+extern uint32_t fuse_coalesce_hits;
+extern uint32_t fuse_coalesce_misses;
+extern int32_t  fuse_coalesce_upcalls;
+extern uint64_t fuse_copy_bytes_offloaded;
+extern int32_t  fuse_dircache_bytes;
+extern uint32_t fuse_dircache_hits;
+extern uint32_t fuse_dircache_max_size;
 extern int32_t  fuse_fh_current;
+extern uint32_t fuse_fh_opens_avoided;
 extern uint32_t fuse_fh_reuse_count;
+extern uint32_t fuse_fh_unparked;
 extern uint32_t fuse_fh_upcall_count;
 extern uint32_t fuse_fh_zombies;
+extern uint64_t fuse_hole_bytes_filled;
+extern uint32_t fuse_hybrid_io_min;
+extern uint64_t fuse_inval_bytes;
+extern uint64_t fuse_inval_bytes_kept;
+extern uint64_t fuse_io_cached_bytes;
+extern uint64_t fuse_io_direct_bytes;
 extern int32_t  fuse_iov_credit;
 extern int32_t  fuse_iov_current;
 extern uint32_t fuse_iov_permanent_bufsize;
@@ -23,10 +42,17 @@ extern uint32_t fuse_lookup_cache_overrides;
 extern uint32_t fuse_max_tickets;
 extern uint32_t fuse_max_freetickets;
 extern int32_t  fuse_mount_count;
+extern uint32_t fuse_notifications;
+extern uint64_t fuse_notify_store_bytes;
+extern uint32_t fuse_readdir_upcalls_avoided;
 extern int32_t  fuse_realloc_count;
+extern uint32_t fuse_statfs_upcalls_avoided;
 extern int32_t  fuse_tickets_current;
 extern uint32_t fuse_userkernel_bufsize;
 extern int32_t  fuse_vnodes_current;
+extern uint32_t fuse_xattr_cache_hits;
+extern uint32_t fuse_xattr_cache_max_size;
+extern uint32_t fuse_xattr_cache_misses;
 
 #ifdef FUSE4X_COUNT_MEMORY
 extern int32_t  fuse_memory_allocated;
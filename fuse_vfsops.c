@@ -164,6 +164,34 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
         return EINVAL;
     }
 
+    if (!(fusefs_args.altflags & FUSE_MOPT_STATFS_TIMEOUT)) {
+        fusefs_args.statfs_timeout = FUSE_DEFAULT_STATFS_TIMEOUT;
+    } else if ((fusefs_args.statfs_timeout > FUSE_MAX_STATFS_TIMEOUT) ||
+               (fusefs_args.statfs_timeout < FUSE_MIN_STATFS_TIMEOUT)) {
+        return EINVAL;
+    }
+
+    if (!(fusefs_args.altflags & FUSE_MOPT_RELEASE_DELAY)) {
+        fusefs_args.release_delay = FUSE_DEFAULT_RELEASE_DELAY;
+    } else if ((fusefs_args.release_delay > FUSE_MAX_RELEASE_DELAY) ||
+               (fusefs_args.release_delay < FUSE_MIN_RELEASE_DELAY)) {
+        return EINVAL;
+    }
+
+    if (!(fusefs_args.altflags & FUSE_MOPT_RELEASE_BUDGET)) {
+        fusefs_args.release_budget = FUSE_DEFAULT_RELEASE_BUDGET;
+    } else if ((fusefs_args.release_budget > FUSE_MAX_RELEASE_BUDGET) ||
+               (fusefs_args.release_budget < FUSE_MIN_RELEASE_BUDGET)) {
+        return EINVAL;
+    }
+
+    if (!(fusefs_args.altflags & FUSE_MOPT_DIRECT_IO_DEPTH)) {
+        fusefs_args.direct_io_depth = FUSE_DEFAULT_DIRECT_IO_DEPTH;
+    } else if ((fusefs_args.direct_io_depth > FUSE_MAX_DIRECT_IO_DEPTH) ||
+               (fusefs_args.direct_io_depth < FUSE_MIN_DIRECT_IO_DEPTH)) {
+        return EINVAL;
+    }
+
     if (fusefs_args.altflags & FUSE_MOPT_SPARSE) {
         mntopts |= FSESS_SPARSE;
     }
@@ -172,6 +200,18 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
         mntopts |= FSESS_AUTO_CACHE;
     }
 
+    if (fusefs_args.altflags & FUSE_MOPT_STALE_ATTRCACHE) {
+        mntopts |= FSESS_STALE_ATTRCACHE;
+    }
+
+    if (fusefs_args.altflags & FUSE_MOPT_LAZY_OPEN) {
+        mntopts |= FSESS_LAZY_OPEN;
+    }
+
+    if (fusefs_args.altflags & FUSE_MOPT_HYBRID_IO) {
+        mntopts |= FSESS_HYBRID_IO;
+    }
+
     if (fusefs_args.altflags & FUSE_MOPT_AUTO_XATTR) {
         if (fusefs_args.altflags & FUSE_MOPT_NATIVE_XATTR) {
             return EINVAL;
@@ -181,6 +221,13 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
         mntopts |= FSESS_NATIVE_XATTR;
     }
 
+    if (fusefs_args.altflags & FUSE_MOPT_XATTR_CACHE) {
+        if (mntopts & FSESS_AUTO_XATTR) {
+            return EINVAL;
+        }
+        mntopts |= FSESS_XATTR_CACHE;
+    }
+
     if (fusefs_args.altflags & FUSE_MOPT_JAIL_SYMLINKS) {
         mntopts |= FSESS_JAIL_SYMLINKS;
     }
@@ -387,6 +434,14 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
         data->daemon_timeout_p = NULL;
     }
 
+    data->statfs_timeout.tv_sec = fusefs_args.statfs_timeout;
+    data->statfs_timeout.tv_nsec = 0;
+
+    data->release_delay.tv_sec = fusefs_args.release_delay;
+    data->release_delay.tv_nsec = 0;
+    data->release_budget = fusefs_args.release_budget;
+    data->direct_io_depth = fusefs_args.direct_io_depth;
+
     data->max_read = max_read;
     data->fssubtype = fusefs_args.fssubtype;
     data->noimplflags = (uint64_t)0;
@@ -727,6 +782,18 @@ handle_capabilities_and_attributes(mount_t mp, struct vfs_attr *attr)
             VOL_CAP_INT_EXTENDED_ATTR;
     }
 
+    /* getdirentriesattr(2) is served from READDIRPLUS replies. */
+    if (data->dataflags & FSESS_READDIRPLUS) {
+        attr->f_capabilities.capabilities[VOL_CAPABILITIES_INTERFACES] |=
+            VOL_CAP_INT_READDIRATTR;
+    }
+
+    /* F_PREALLOCATE goes to FUSE_FALLOCATE unless the daemon lacks it. */
+    if (fuse_implemented(data, FSESS_NOIMPLBIT(FALLOCATE))) {
+        attr->f_capabilities.capabilities[VOL_CAPABILITIES_INTERFACES] |=
+            VOL_CAP_INT_ALLOCATE;
+    }
+
     /* Don't set the EXCHANGEDATA capability if it's known not to be
      * implemented in the FUSE daemon. */
     if (fuse_implemented(data, FSESS_NOIMPLBIT(EXCHANGE))) {
@@ -879,6 +946,84 @@ handle_capabilities_and_attributes(mount_t mp, struct vfs_attr *attr)
     VFSATTR_SET_SUPPORTED(attr, f_attributes);
 }
 
+static void
+fuse_statfs_cache_enter(struct fuse_data *data, struct fuse_statfs_out *fsfo)
+{
+    struct timespec uptsp;
+
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(data->statfs_mtx);
+    memcpy(&data->statfs_cache, fsfo, sizeof(*fsfo));
+    data->statfs_valid = data->statfs_timeout;
+    fuse_timespec_add(&data->statfs_valid, &uptsp);
+    data->statfs_cached = true;
+    fuse_lck_mtx_unlock(data->statfs_mtx);
+}
+
+static int
+fuse_statfs_callback(struct fuse_ticket *ticket, uio_t uio)
+{
+    struct fuse_data *data = ticket->data;
+
+    if (!ticket->aw_ohead.error && !fuse_ticket_pull(ticket, uio)) {
+        fuse_statfs_cache_enter(data, ticket->aw_fiov.base);
+    }
+
+    fuse_lck_mtx_lock(data->statfs_mtx);
+    data->statfs_refreshing = false;
+    fuse_lck_mtx_unlock(data->statfs_mtx);
+
+    fuse_ticket_drop(ticket);
+
+    return 0;
+}
+
+/*
+ * Copies out the cached statfs reply, if there is one. A reply that has
+ * outlived statfs_timeout is still used, but the first caller to notice
+ * sends a FUSE_STATFS in the background to refresh it.
+ */
+static bool
+fuse_statfs_cache_get(struct fuse_data *data, struct fuse_statfs_out *fsfo,
+                      vfs_context_t context)
+{
+    struct timespec uptsp;
+    bool found = false;
+    bool refresh = false;
+
+    if (data->statfs_timeout.tv_sec == 0) {
+        return false;
+    }
+
+    nanouptime(&uptsp);
+
+    fuse_lck_mtx_lock(data->statfs_mtx);
+    if (data->statfs_cached) {
+        memcpy(fsfo, &data->statfs_cache, sizeof(*fsfo));
+        found = true;
+        if (fuse_timespec_cmp(&uptsp, &data->statfs_valid, <=)) {
+            OSIncrementAtomic((SInt32 *)&fuse_statfs_upcalls_avoided);
+        } else if (!data->statfs_refreshing) {
+            data->statfs_refreshing = true;
+            refresh = true;
+        }
+    }
+    fuse_lck_mtx_unlock(data->statfs_mtx);
+
+    if (refresh) {
+        struct fuse_dispatcher fdi;
+
+        fuse_dispatcher_init(&fdi, 0);
+        fuse_dispatcher_make(&fdi, FUSE_STATFS, data->mp, FUSE_ROOT_ID,
+                             context);
+        fuse_insert_callback(fdi.ticket, fuse_statfs_callback);
+        fuse_insert_message(fdi.ticket);
+    }
+
+    return found;
+}
+
 static errno_t
 fuse_vfsop_getattr(mount_t mp, struct vfs_attr *attr, vfs_context_t context)
 {
@@ -887,7 +1032,7 @@ fuse_vfsop_getattr(mount_t mp, struct vfs_attr *attr, vfs_context_t context)
 
     struct fuse_dispatcher  fdi;
     struct fuse_statfs_out *fsfo;
-    struct fuse_statfs_out  faked;
+    struct fuse_statfs_out  statfs;
     struct fuse_data       *data;
 
     fuse_trace_printf_vfsop();
@@ -905,6 +1050,10 @@ fuse_vfsop_getattr(mount_t mp, struct vfs_attr *attr, vfs_context_t context)
         goto dostatfs;
     }
 
+    if (fuse_statfs_cache_get(data, &statfs, context)) {
+        goto dostatfs;
+    }
+
     fuse_dispatcher_init(&fdi, 0);
     fuse_dispatcher_make(&fdi, FUSE_STATFS, mp, FUSE_ROOT_ID, context);
     if ((err = fuse_dispatcher_wait_answer(&fdi))) {
@@ -920,13 +1069,18 @@ fuse_vfsop_getattr(mount_t mp, struct vfs_attr *attr, vfs_context_t context)
         return err;
     }
 
+    memcpy(&statfs, fdi.answer, sizeof(statfs));
+    fuse_ticket_drop(fdi.ticket);
+
+    if (data->statfs_timeout.tv_sec) {
+        fuse_statfs_cache_enter(data, &statfs);
+    }
+
 dostatfs:
     if (faking) {
-        bzero(&faked, sizeof(faked));
-        fsfo = &faked;
-    } else {
-        fsfo = fdi.answer;
+        bzero(&statfs, sizeof(statfs));
     }
+    fsfo = &statfs;
 
     if (fsfo->st.bsize == 0) {
         fsfo->st.bsize = FUSE_DEFAULT_IOSIZE;
@@ -1036,9 +1190,6 @@ dostatfs:
     VFSATTR_RETURN(attr, f_signature, OSSwapBigToHostInt16(FUSEFS_SIGNATURE));
     VFSATTR_RETURN(attr, f_carbon_fsid, 0);
 
-    if (!faking)
-        fuse_ticket_drop(fdi.ticket);
-
     return 0;
 }
 
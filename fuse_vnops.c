@@ -41,9 +41,18 @@
 
 #define COM_APPLE_ "com.apple."
 
+/* What lseek(2) turns SEEK_HOLE and SEEK_DATA into, as in newer <sys/fsctl.h>. */
+#ifndef FSIOC_FIOSEEKHOLE
+#define FSIOC_FIOSEEKHOLE _IOWR('A', 16, off_t)
+#endif
+#ifndef FSIOC_FIOSEEKDATA
+#define FSIOC_FIOSEEKDATA _IOWR('A', 17, off_t)
+#endif
+
 
 // vnode operation declarations
 static int fuse_vnop_access(struct vnop_access_args *ap);
+static int fuse_vnop_allocate(struct vnop_allocate_args *ap);
 static int fuse_vnop_blktooff(struct vnop_blktooff_args *ap);
 static int fuse_vnop_blockmap(struct vnop_blockmap_args *ap);
 static int fuse_vnop_close(struct vnop_close_args *ap);
@@ -68,6 +77,7 @@ static int fuse_vnop_pageout(struct vnop_pageout_args *ap);
 static int fuse_vnop_pathconf(struct vnop_pathconf_args *ap);
 static int fuse_vnop_read(struct vnop_read_args *ap);
 static int fuse_vnop_readdir(struct vnop_readdir_args *ap);
+static int fuse_vnop_readdirattr(struct vnop_readdirattr_args *ap);
 static int fuse_vnop_readlink(struct vnop_readlink_args *ap);
 static int fuse_vnop_reclaim(struct vnop_reclaim_args *ap);
 static int fuse_vnop_remove(struct vnop_remove_args *ap);
@@ -138,6 +148,129 @@ fuse_vnop_access(struct vnop_access_args *ap)
     return fuse_internal_access(vp, action, context);
 }
 
+/*
+    struct vnop_allocate_args {
+        struct vnodeop_desc *a_desc;
+        vnode_t              a_vp;
+        off_t                a_length;
+        u_int32_t            a_flags;
+        off_t               *a_bytesallocated;
+        off_t                a_offset;
+        vfs_context_t        a_context;
+    };
+*/
+static
+int
+fuse_vnop_allocate(struct vnop_allocate_args *ap)
+{
+    vnode_t       vp      = ap->a_vp;
+    off_t         length  = ap->a_length;
+    u_int32_t     flags   = ap->a_flags;
+    off_t         offset  = ap->a_offset;
+    vfs_context_t context = ap->a_context;
+
+    struct fuse_dispatcher     fdi;
+    struct fuse_fallocate_in  *ffi;
+    struct fuse_filehandle    *fufh;
+    struct fuse_vnode_data    *fvdat = VTOFUD(vp);
+    struct fuse_data          *data;
+
+    fufh_type_t fufh_type = FUFH_WRONLY;
+    bool        keepsize;
+    int         err;
+
+    fuse_trace_printf_vnop();
+
+    *ap->a_bytesallocated = 0;
+
+    if (fuse_isdeadfs(vp)) {
+        return ENXIO;
+    }
+
+    if (!vnode_isreg(vp)) {
+        if (vnode_isdir(vp)) {
+            return EISDIR;
+        } else {
+            return EPERM;
+        }
+    }
+
+    if (vnode_vfsisrdonly(vp)) {
+        return EROFS;
+    }
+
+    if ((length < 0) || (offset < 0)) {
+        return EINVAL;
+    }
+
+    data = fuse_get_mpdata(vnode_mount(vp));
+
+    /* Without FUSE_FALLOCATE this is nop_allocate(). */
+    if ((length == 0) || !fuse_implemented(data, FSESS_NOIMPLBIT(FALLOCATE))) {
+        return 0;
+    }
+
+    fufh = &(fvdat->fufh[fufh_type]);
+    if (!FUFH_IS_VALID(fufh)) {
+        fufh_type = FUFH_RDWR;
+        fufh = &(fvdat->fufh[fufh_type]);
+        if (!FUFH_IS_VALID(fufh)) {
+            return EBADF;
+        }
+    }
+
+    fuse_lck_mtx_lock(fvdat->fufh_mtx);
+    err = fuse_filehandle_realize(vp, context, fufh_type);
+    fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+    if (err) {
+        return err;
+    }
+
+    fuse_lck_rw_lock_exclusive(fvdat->truncatelock);
+
+    /*
+     * F_PREALLOCATE reserves space past the end of the file and leaves its
+     * size alone. There is no volume position to honor, so both of its
+     * modes start at the end of the file. Only an allocation at a given
+     * offset may extend the file.
+     */
+    keepsize = (flags & (ALLOCATEFROMPEOF | ALLOCATEFROMVOL)) != 0;
+    if (flags & ALLOCATEFROMPEOF) {
+        offset += fvdat->filesize;
+    } else if (flags & ALLOCATEFROMVOL) {
+        offset = fvdat->filesize;
+    }
+
+    fuse_dispatcher_init(&fdi, sizeof(*ffi));
+    fuse_dispatcher_make_vp(&fdi, FUSE_FALLOCATE, vp, context);
+    ffi = fdi.indata;
+    ffi->fh = fufh->fh_id;
+    ffi->offset = offset;
+    ffi->length = length;
+    ffi->mode = keepsize ? FUSE_FALLOC_FL_KEEP_SIZE : 0;
+    ffi->padding = 0;
+
+    err = fuse_dispatcher_wait_answer(&fdi);
+
+    if (!err) {
+        fuse_ticket_drop(fdi.ticket);
+        fuse_invalidate_extents(vp);
+        *ap->a_bytesallocated = length;
+        if (!keepsize && (offset + length > fvdat->filesize)) {
+            fvdat->filesize = offset + length;
+            ubc_setsize(vp, fvdat->filesize);
+        }
+        fuse_invalidate_attr(vp);
+    } else if (err == ENOSYS) {
+        fuse_clear_implemented(data, FSESS_NOIMPLBIT(FALLOCATE));
+        err = 0;
+    }
+
+    fuse_lck_rw_done(fvdat->truncatelock);
+
+    return err;
+}
+
 /*
     struct vnop_blktooff_args {
         struct vnodeop_desc *a_desc;
@@ -315,8 +448,15 @@ fuse_vnop_close(struct vnop_close_args *ap)
         (void)cluster_push(vp, IO_SYNC | IO_CLOSE);
     }
 
+    /* Pages of a direct_io file can only have been dirtied through mmap. */
+    if (fuse_isdirectio(vp) && ubc_pages_resident(vp)) {
+        (void)ubc_msync(vp, (off_t)0, ubc_getsize(vp), NULL,
+                        UBC_PUSHDIRTY | UBC_SYNC);
+    }
+
     data = fuse_get_mpdata(vnode_mount(vp));
-    if (fuse_implemented(data, FSESS_NOIMPLBIT(FLUSH))) {
+    /* A lazily opened handle that saw no I/O has nothing to flush. */
+    if (fuse_implemented(data, FSESS_NOIMPLBIT(FLUSH)) && !fufh->lazy) {
 
         struct fuse_dispatcher  fdi;
         struct fuse_flush_in   *ffi;
@@ -330,6 +470,17 @@ fuse_vnop_close(struct vnop_close_args *ap)
         ffi->padding = 0;
         ffi->lock_owner = 0;
 
+        /*
+         * Without sync-on-close, close(2) does not wait for the daemon
+         * either; fsync(2) reports a failure later. The release that may
+         * follow is queued behind the flush.
+         */
+        if (fuse_isnosynconclose(vp)) {
+            fuse_insert_callback(fdi.ticket, fuse_internal_flush_callback);
+            fuse_insert_message(fdi.ticket);
+            goto skipdir;
+        }
+
         err = fuse_dispatcher_wait_answer(&fdi);
 
         if (!err) {
@@ -349,7 +500,7 @@ skipdir:
     FUFH_USE_DEC(fufh);
 
     if (!FUFH_IS_VALID(fufh)) {
-        (void)fuse_filehandle_put(vp, context, fufh_type);
+        (void)fuse_filehandle_park(vp, context, fufh_type);
     }
     fuse_lck_mtx_unlock(fvdat->fufh_mtx);
 
@@ -453,6 +604,8 @@ good_old:
     }
 
 bringup:
+    fuse_invalidate_dircache(dvp);
+
     feo = dispatcher->answer;
 
     if ((err = fuse_internal_checkentry(feo, VREG))) { // VBLK/VCHR not allowed
@@ -493,6 +646,8 @@ bringup:
         struct fuse_filehandle *fufh = &(fvdat->fufh[FUFH_RDWR]);
         fufh->fh_id = foo->fh;
         fufh->open_flags = foo->open_flags;
+        fufh->owner = kauth_cred_getuid(vfs_context_ucred(context));
+        fufh->local = false;
         FUFH_USE_INC(fufh);
         fuse_lck_mtx_unlock(fvdat->fufh_mtx);
 
@@ -700,6 +855,12 @@ out:
         err = 0;
     }
 
+    /* A close(2) that did not wait for its FLUSH may have failed since. */
+    tmp_err = fuse_internal_flush_error(vp);
+    if (!err) {
+        err = tmp_err;
+    }
+
     return err;
 }
 
@@ -761,6 +922,40 @@ fuse_vnop_getattr(struct vnop_getattr_args *ap)
         }
     }
 
+    /*
+     * Within the staleness window, hand out the expired attributes and let
+     * a background GETATTR bring them up to date. Attributes invalidated by
+     * local changes (attr_valid zeroed) are never used this way.
+     */
+    if (fuse_isstaleattrcache_mp(vnode_mount(vp)) &&
+        (VTOFUD(vp)->attr_valid.tv_sec || VTOFUD(vp)->attr_valid.tv_nsec)) {
+        struct timespec stale = uptsp;
+        uint64_t stale_ms;
+
+        stale.tv_sec -= VTOFUD(vp)->attr_valid.tv_sec;
+        stale.tv_nsec -= VTOFUD(vp)->attr_valid.tv_nsec;
+        if (stale.tv_nsec < 0) {
+            stale.tv_sec--;
+            stale.tv_nsec += 1000000000;
+        }
+        stale_ms = (uint64_t)stale.tv_sec * 1000 + stale.tv_nsec / 1000000;
+
+        if (stale.tv_sec < fuse_attr_stale_window) {
+            int bucket = 0;
+            for (uint64_t limit = 10; bucket < FUSE_ATTR_STALE_BUCKETS - 1 &&
+                 stale_ms >= limit; limit *= 10) {
+                bucket++;
+            }
+            OSIncrementAtomic((SInt32 *)&fuse_attr_stale_histogram[bucket]);
+
+            (void)fuse_internal_attr_revalidate(vp, context);
+            if (vap != VTOVA(vp)) {
+                fuse_internal_attr_loadvap(vp, vap, context);
+            }
+            return 0;
+        }
+    }
+
     fuse_dispatcher_init(&fdi, sizeof(struct fuse_getattr_in));
     fuse_dispatcher_make_vp(&fdi, FUSE_GETATTR, vp, context);
     bzero(fdi.indata, sizeof(struct fuse_getattr_in));
@@ -870,6 +1065,7 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
 
     int err = 0;
     size_t namelen;
+    bool cacheable;
 
     fuse_trace_printf_vnop();
 
@@ -898,6 +1094,16 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
         return ENOTSUP;
     }
 
+    /* Positioned reads (resource forks) always go to the daemon. */
+    cacheable = fuse_isxattrcache(vp) && (!uio || uio_offset(uio) == 0);
+    if (cacheable) {
+        if (fuse_xattr_cache_lookup(vp, name, uio, ap->a_size, &err)) {
+            OSIncrementAtomic((SInt32 *)&fuse_xattr_cache_hits);
+            return err;
+        }
+        OSIncrementAtomic((SInt32 *)&fuse_xattr_cache_misses);
+    }
+
     namelen = strlen(name);
 
     fuse_dispatcher_init(&fdi, sizeof(*fgxi) + namelen + 1);
@@ -925,6 +1131,9 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
             fuse_clear_implemented(data, FSESS_NOIMPLBIT(GETXATTR));
             return ENOTSUP;
         }
+        if (err == ENOATTR && cacheable) {
+            fuse_xattr_cache_enter(vp, name, NULL, 0, ENOATTR);
+        }
         return err;
     }
 
@@ -935,9 +1144,15 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
         } else {
             err = uiomove((char *)fdi.answer, (int)fdi.iosize, uio);
         }
+        if (cacheable) {
+            fuse_xattr_cache_enter(vp, name, fdi.answer, fdi.iosize, 0);
+        }
     } else {
         fgxo = (struct fuse_getxattr_out *)fdi.answer;
         *ap->a_size = fgxo->size;
+        if (cacheable) {
+            fuse_xattr_cache_enter(vp, name, NULL, fgxo->size, 0);
+        }
     }
 
     fuse_ticket_drop(fdi.ticket);
@@ -1042,6 +1257,7 @@ fuse_vnop_link(struct vnop_link_args *ap)
     err = fuse_internal_checkentry(feo, vnode_vtype(vp));
     fuse_ticket_drop(fdi.ticket);
     fuse_invalidate_attr(tdvp);
+    fuse_invalidate_dircache(tdvp);
     fuse_invalidate_attr(vp);
 
     if (err == 0) {
@@ -1094,6 +1310,14 @@ fuse_vnop_listxattr(struct vnop_listxattr_args *ap)
         return ENOTSUP;
     }
 
+    if (fuse_isxattrcache(vp)) {
+        if (fuse_xattr_cache_list_lookup(vp, uio, ap->a_size, &err)) {
+            OSIncrementAtomic((SInt32 *)&fuse_xattr_cache_hits);
+            return err;
+        }
+        OSIncrementAtomic((SInt32 *)&fuse_xattr_cache_misses);
+    }
+
     fuse_dispatcher_init(&fdi, sizeof(*fgxi));
     fuse_dispatcher_make_vp(&fdi, FUSE_LISTXATTR, vp, context);
     fgxi = fdi.indata;
@@ -1119,9 +1343,15 @@ fuse_vnop_listxattr(struct vnop_listxattr_args *ap)
         } else {
             err = uiomove((char *)fdi.answer, (int)fdi.iosize, uio);
         }
+        if (fuse_isxattrcache(vp)) {
+            fuse_xattr_cache_list_enter(vp, fdi.answer, fdi.iosize);
+        }
     } else {
         fgxo = (struct fuse_getxattr_out *)fdi.answer;
         *ap->a_size = fgxo->size;
+        if (fuse_isxattrcache(vp)) {
+            fuse_xattr_cache_list_enter(vp, NULL, fgxo->size);
+        }
     }
 
     fuse_ticket_drop(fdi.ticket);
@@ -1244,6 +1474,11 @@ fuse_vnop_lookup(struct vnop_lookup_args *ap)
     fuse_dispatcher_init(&fdi, cnp->cn_namelen + 1);
     op = FUSE_LOOKUP;
 
+    /* Names are being resolved one by one, READDIRPLUS would have helped. */
+    if (fuse_isreaddirplus_mp(mp)) {
+        VTOFUD(dvp)->c_flag |= C_ADVISE_RDPLUS;
+    }
+
 calldaemon:
     fuse_dispatcher_make(&fdi, op, mp, nodeid, context);
 
@@ -1567,17 +1802,16 @@ fuse_vnop_mmap(struct vnop_mmap_args *ap)
         return ENXIO;
     }
 
-    if (fuse_isdirectio(vp)) {
-        /*
-         * We should be returning ENODEV here, but ubc_map() translates
-         * all errors except ENOPERM to 0. Even then, this is not going
-         * to prevent the mmap()!
-         */
-        return EPERM;
-    }
+    /*
+     * direct_io files are mapped too. Their pages are only a private cache
+     * of the mapping: open throws them away, and read, write, close and
+     * unmap push out what the mapping dirtied.
+     */
 
     CHECK_BLANKET_DENIAL(vp, context, ENOENT);
 
+    fuse_vnode_inval_apply(vp);
+
     if (fflags & (PROT_READ | PROT_WRITE | PROT_EXEC)) { /* nothing to do */
         return 0;
     }
@@ -1590,9 +1824,17 @@ retry:
     fufh = &(fvdat->fufh[fufh_type]);
 
     if (FUFH_IS_VALID(fufh)) {
+        err = fuse_filehandle_realize(vp, context, fufh_type);
+        if (err) {
+            fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+            log("fuse4x: filehandle_realize failed in mmap (type=%d, err=%d)\n",
+                  fufh_type, err);
+            return EPERM;
+        }
         FUFH_USE_INC(fufh);
         fuse_lck_mtx_unlock(fvdat->fufh_mtx);
         OSIncrementAtomic((SInt32 *)&fuse_fh_reuse_count);
+        (void)fuse_internal_open_late(vp, fufh_type, context);
         goto out;
     } else {
         fuse_lck_mtx_unlock(fvdat->fufh_mtx);
@@ -1660,10 +1902,10 @@ fuse_vnop_mnomap(struct vnop_mnomap_args *ap)
     }
 
     if (fuse_isdirectio(vp)) {
-        /*
-         * ubc_unmap() doesn't care about the return value.
-         */
-        return ENODEV;
+        /* Nothing else would send what the mapping dirtied to the daemon. */
+        (void)ubc_msync(vp, (off_t)0, ubc_getsize(vp), NULL,
+                        UBC_PUSHDIRTY | UBC_SYNC);
+        return 0;
     }
 
     /*
@@ -1753,7 +1995,6 @@ fuse_vnop_open(struct vnop_open_args *ap)
 
     int error = 0;
     bool isdir = false;
-    long hint = 0;
 
     fuse_trace_printf_vnop();
 
@@ -1777,6 +2018,7 @@ fuse_vnop_open(struct vnop_open_args *ap)
         fufh_type = FUFH_RDONLY;
     } else {
         fufh_type = fuse_filehandle_xlate_from_fflags(mode);
+        fuse_vnode_inval_apply(vp);
     }
 
     fuse_lck_mtx_lock(fvdat->fufh_mtx);
@@ -1785,7 +2027,7 @@ fuse_vnop_open(struct vnop_open_args *ap)
         FUFH_USE_INC(fufh);
         OSIncrementAtomic((SInt32 *)&fuse_fh_reuse_count);
     } else {
-        error = fuse_filehandle_get(vp, context, fufh_type, mode);
+        error = fuse_filehandle_get_lazy(vp, context, fufh_type, mode);
         if (error == ENOENT) {
             cache_purge(vp);
         }
@@ -1800,52 +2042,8 @@ fuse_vnop_open(struct vnop_open_args *ap)
      * no-cache and no-readahead are cleared by the kernel.
      */
 
-    if ((fufh->fuse_open_flags & FOPEN_DIRECT_IO) || (fuse_isdirectio(vp))) {
-        /*
-         * direct_io for a vnode implies:
-         * - no ubc for the vnode
-         * - no readahead for the vnode
-         * - nosyncwrites disabled FOR THE ENTIRE MOUNT
-         * - no vncache for the vnode (handled in lookup)
-         */
-        ubc_msync(vp, (off_t)0, ubc_getsize(vp), NULL,
-                  UBC_PUSHALL | UBC_INVALIDATE);
-        vnode_setnocache(vp);
-        vnode_setnoreadahead(vp);
-        fuse_clearnosyncwrites_mp(vnode_mount(vp));
-        fvdat->flag |= FN_DIRECT_IO;
+    if (fuse_internal_open_flags(vp, fufh, context)) {
         goto out;
-    } else if (fufh->fuse_open_flags & FOPEN_PURGE_UBC) {
-        ubc_msync(vp, (off_t)0, ubc_getsize(vp), NULL,
-                  UBC_PUSHALL | UBC_INVALIDATE);
-        fufh->fuse_open_flags &= ~FOPEN_PURGE_UBC;
-        hint |= NOTE_WRITE;
-        if (fufh->fuse_open_flags & FOPEN_PURGE_ATTR) {
-            struct fuse_dispatcher fdi;
-            fuse_invalidate_attr(vp);
-            hint |= NOTE_ATTRIB;
-
-            fuse_dispatcher_init(&fdi, sizeof(struct fuse_getattr_in));
-            fuse_dispatcher_make_vp(&fdi, FUSE_GETATTR, vp, context);
-            bzero(fdi.indata, sizeof(struct fuse_getattr_in));
-
-            int serr = fuse_dispatcher_wait_answer(&fdi);
-            if (!serr) {
-                /* XXX: Could check the sanity/volatility of va_mode here. */
-                if ((((struct fuse_attr_out*)fdi.answer)->attr.mode & S_IFMT)) {
-                    cache_attrs(vp, (struct fuse_attr_out *)fdi.answer);
-                    off_t new_filesize =
-                        ((struct fuse_attr_out *)fdi.answer)->attr.size;
-                    if (new_filesize > VTOFUD(vp)->filesize) {
-                        hint |= NOTE_EXTEND;
-                    }
-                    VTOFUD(vp)->filesize = new_filesize;
-                    ubc_setsize(vp, (off_t)new_filesize);
-                }
-                fuse_ticket_drop(fdi.ticket);
-            }
-            fufh->fuse_open_flags &= ~FOPEN_PURGE_ATTR;
-        }
     }
 
     if (fuse_isnoreadahead(vp)) {
@@ -1888,7 +2086,7 @@ fuse_vnop_pagein(struct vnop_pagein_args *ap)
 
     fuse_trace_printf_vnop();
 
-    if (fuse_isdeadfs(vp) || fuse_isdirectio(vp)) {
+    if (fuse_isdeadfs(vp)) {
         if (!(flags & UPL_NOCOMMIT)) {
             ubc_upl_abort_range(pl, (upl_offset_t)pl_offset, (int)size,
                                 UPL_ABORT_FREE_ON_EMPTY | UPL_ABORT_ERROR);
@@ -1938,7 +2136,7 @@ fuse_vnop_pageout(struct vnop_pageout_args *ap)
 
     fuse_trace_printf_vnop();
 
-    if (fuse_isdeadfs(vp) || fuse_isdirectio(vp)) {
+    if (fuse_isdeadfs(vp)) {
         if (!(flags & UPL_NOCOMMIT)) {
             ubc_upl_abort_range(pl, (upl_offset_t)pl_offset, (upl_size_t)size,
                                 UPL_ABORT_FREE_ON_EMPTY | UPL_ABORT_ERROR);
@@ -2050,7 +2248,6 @@ fuse_vnop_read(struct vnop_read_args *ap)
     vfs_context_t context = ap->a_context;
 
     struct fuse_vnode_data *fvdat;
-    struct fuse_data       *data;
 
     off_t orig_resid;
     off_t orig_offset;
@@ -2058,14 +2255,11 @@ fuse_vnop_read(struct vnop_read_args *ap)
     int err = EIO;
 
     /*
-     * XXX: Locking
+     * Locking
      *
-     * lock_shared(truncatelock)
-     * call the cluster layer (note that we are always block-aligned)
-     * lock(nodelock)
-     * do cleanup
-     * unlock(nodelock)
-     * unlock(truncatelock)
+     * The truncate lock is held shared, so reads run alongside each other
+     * and alongside writes that do not change the size of the file, but
+     * not alongside truncation or extension.
      */
 
     fuse_trace_printf_vnop();
@@ -2107,26 +2301,42 @@ fuse_vnop_read(struct vnop_read_args *ap)
         return EINVAL;
     }
 
-    /* Protect against size change here. */
-
-    data = fuse_get_mpdata(vnode_mount(vp));
+    if (fuse_islazyopen_mp(vnode_mount(vp))) {
+        /* May turn the vnode direct_io; see fuse_internal_open_late(). */
+        err = fuse_internal_open_late(vp, FUFH_RDONLY, context);
+        if (err) {
+            return err;
+        }
+        err = EIO;
+    }
 
     if (!fuse_isdirectio(vp)) {
+        struct fuse_filehandle *fufh;
         int res;
         if (fuse_isnoubc(vp)) {
             /* In case we get here through a short cut (e.g. no open). */
             ioflag |= IO_NOCACHE;
         }
-        res = cluster_read(vp, uio, fvdat->filesize, ioflag);
+        fuse_vnode_inval_apply(vp);
+        fufh = fuse_internal_hybrid_fufh(vp, uio, false, context);
+        /* Protect against size change here. */
+        fuse_lck_rw_lock_shared(fvdat->truncatelock);
+        if (fufh) {
+            res = fuse_internal_direct_read(vp, uio, fufh, context);
+        } else {
+            res = cluster_read(vp, uio, fvdat->filesize, ioflag);
+        }
+        fuse_lck_rw_done(fvdat->truncatelock);
+        OSAddAtomic64((SInt64)(orig_resid - uio_resid(uio)),
+                      (SInt64 *)(fufh ? &fuse_io_direct_bytes
+                                      : &fuse_io_cached_bytes));
         return res;
     }
 
     /* direct_io */
     {
         fufh_type_t             fufh_type = FUFH_RDONLY;
-        struct fuse_dispatcher  fdi;
         struct fuse_filehandle *fufh = NULL;
-        struct fuse_read_in    *fri = NULL;
 
         fufh = &(fvdat->fufh[fufh_type]);
 
@@ -2147,36 +2357,23 @@ fuse_vnop_read(struct vnop_read_args *ap)
             /* Using existing fufh of type fufh_type. */
         }
 
-        fuse_dispatcher_init(&fdi, 0);
-
-        while (uio_resid(uio) > 0) {
-            fdi.iosize = sizeof(*fri);
-            fuse_dispatcher_make_vp(&fdi, FUSE_READ, vp, context);
-            fri = fdi.indata;
-            fri->fh = fufh->fh_id;
-            fri->offset = uio_offset(uio);
-            fri->size = (uint32_t)min((size_t)uio_resid(uio), data->iosize);
-
-            if ((err = fuse_dispatcher_wait_answer(&fdi))) {
-                return err;
-            }
-
-            err = uiomove(fdi.answer, (int)min(fri->size, fdi.iosize), uio);
-            if (err) {
-                break;
-            }
-
-            if (fdi.iosize < fri->size) {
-                err = -1;
-                break;
-            }
+        fuse_lck_mtx_lock(fvdat->fufh_mtx);
+        err = fuse_filehandle_realize(vp, context, fufh_type);
+        fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+        if (err) {
+            return err;
         }
 
-        fuse_ticket_drop(fdi.ticket);
+        fuse_lck_rw_lock_shared(fvdat->truncatelock);
+        err = fuse_internal_direct_read(vp, uio, fufh, context);
+        fuse_lck_rw_done(fvdat->truncatelock);
+
+        OSAddAtomic64((SInt64)(orig_resid - uio_resid(uio)),
+                      (SInt64 *)&fuse_io_direct_bytes);
 
     } /* direct_io */
 
-    return ((err == -1) ? 0 : err);
+    return err;
 }
 
 /*
@@ -2215,8 +2412,9 @@ fuse_vnop_readdir(struct vnop_readdir_args *ap)
 
     CHECK_BLANKET_DENIAL(vp, context, EPERM);
 
-    /* No cookies yet. */
-    if (flags & (VNODE_READDIR_REQSEEKOFF | VNODE_READDIR_EXTENDED)) {
+    /* Cookies only fit in extended entries. */
+    if ((flags & VNODE_READDIR_REQSEEKOFF) &&
+        !(flags & VNODE_READDIR_EXTENDED)) {
         return EINVAL;
     }
 
@@ -2240,25 +2438,27 @@ fuse_vnop_readdir(struct vnop_readdir_args *ap)
         OSIncrementAtomic((SInt32 *)&fuse_fh_reuse_count);
     } else {
         err = fuse_filehandle_get(vp, context, FUFH_RDONLY, 0 /* mode */);
+        fuse_lck_mtx_unlock(fvdat->fufh_mtx);
         if (err) {
-            fuse_lck_mtx_unlock(fvdat->fufh_mtx);
             log("fuse4x: filehandle_get failed in readdir (err=%d)\n", err);
             return err;
         }
     }
 
-    size_t dircookedsize = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + MAXNAMLEN + 1);
+    /* Staging area for a whole batch of converted entries. */
+    size_t dircookedsize = min((size_t)uio_resid(uio),
+                               fuse_get_mpdata(vnode_mount(vp))->iosize);
     fiov_init(&cookediov, dircookedsize);
 
-    err = fuse_internal_readdir(vp, uio, context, fufh, &cookediov,
-                                numdirentPtr);
+    err = fuse_internal_readdir(vp, uio, (flags & VNODE_READDIR_EXTENDED) != 0,
+                                context, fufh, &cookediov, numdirentPtr);
 
     fiov_teardown(&cookediov);
 
     fuse_lck_mtx_lock(fvdat->fufh_mtx);
     FUFH_USE_DEC(fufh);
     if (!FUFH_IS_VALID(fufh)) {
-        (void)fuse_filehandle_put(vp, context, FUFH_RDONLY);
+        (void)fuse_filehandle_park(vp, context, FUFH_RDONLY);
     }
     fuse_lck_mtx_unlock(fvdat->fufh_mtx);
 
@@ -2267,6 +2467,99 @@ fuse_vnop_readdir(struct vnop_readdir_args *ap)
     return err;
 }
 
+/*
+    struct vnop_readdirattr_args {
+        struct vnodeop_desc *a_desc;
+        vnode_t              a_vp;
+        struct attrlist     *a_alist;
+        struct uio          *a_uio;
+        uint32_t             a_maxcount;
+        uint32_t             a_options;
+        uint32_t            *a_newstate;
+        int                 *a_eofflag;
+        uint32_t            *a_actualcount;
+        vfs_context_t        a_context;
+    };
+*/
+static
+int
+fuse_vnop_readdirattr(struct vnop_readdirattr_args *ap)
+{
+    vnode_t          vp          = ap->a_vp;
+    struct attrlist *alist       = ap->a_alist;
+    uio_t            uio         = ap->a_uio;
+    uint32_t         maxcount    = ap->a_maxcount;
+    uint32_t        *newstate    = ap->a_newstate;
+    int             *eofflag     = ap->a_eofflag;
+    uint32_t        *actualcount = ap->a_actualcount;
+    vfs_context_t    context     = ap->a_context;
+
+    struct fuse_filehandle *fufh = NULL;
+    struct fuse_vnode_data *fvdat;
+    struct fuse_iov         cookediov;
+
+    int err = 0;
+
+    fuse_trace_printf_vnop();
+
+    *actualcount = 0;
+    *eofflag = 0;
+
+    if (fuse_isdeadfs(vp)) {
+        return ENXIO;
+    }
+
+    CHECK_BLANKET_DENIAL(vp, context, EPERM);
+
+    /* Without attributes in the replies there is nothing to batch. */
+    if (!fuse_isreaddirplus_mp(vnode_mount(vp))) {
+        return ENOTSUP;
+    }
+
+    if (uio_iovcnt(uio) > 1) {
+        return EINVAL;
+    }
+
+    fvdat = VTOFUD(vp);
+
+    fuse_lck_mtx_lock(fvdat->fufh_mtx);
+    fufh = &(fvdat->fufh[FUFH_RDONLY]);
+
+    if (FUFH_IS_VALID(fufh)) {
+        FUFH_USE_INC(fufh);
+        fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+        OSIncrementAtomic((SInt32 *)&fuse_fh_reuse_count);
+    } else {
+        err = fuse_filehandle_get(vp, context, FUFH_RDONLY, 0 /* mode */);
+        fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+        if (err) {
+            log("fuse4x: filehandle_get failed in readdirattr (err=%d)\n", err);
+            return err;
+        }
+    }
+
+    fiov_init(&cookediov, fuse_get_mpdata(vnode_mount(vp))->iosize);
+
+    err = fuse_internal_readdirattr(vp, uio, alist, maxcount, fufh,
+                                    &cookediov, eofflag, actualcount, context);
+
+    fiov_teardown(&cookediov);
+
+    fuse_lck_mtx_lock(fvdat->fufh_mtx);
+    FUFH_USE_DEC(fufh);
+    if (!FUFH_IS_VALID(fufh)) {
+        (void)fuse_filehandle_park(vp, context, FUFH_RDONLY);
+    }
+    fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+
+    fuse_invalidate_attr(vp);
+
+    /* Changes whenever the directory's contents may have. */
+    *newstate = fuse_dircache_gen(vp);
+
+    return err;
+}
+
 /*
     struct vnop_readlink_args {
         struct vnodeop_desc *a_desc;
@@ -2340,14 +2633,17 @@ fuse_vnop_reclaim(struct vnop_reclaim_args *ap)
 
     fuse_trace_printf_vnop();
 
-    if (fuse_isdeadfs(vp)) {
-        goto out;
-    }
-
     if (!fvdat) {
         panic("fuse4x: no vnode data during recycling");
     }
 
+    /* Even on a dead file system, the reaper must forget about us. */
+    fuse_filehandle_unpark(vp, context);
+
+    if (fuse_isdeadfs(vp)) {
+        goto out;
+    }
+
     /*
      * Cannot do early bail out on a dead file system in this case.
      */
@@ -2423,6 +2719,11 @@ fuse_vnop_remove(struct vnop_remove_args *ap)
 
     fuse_vncache_purge(vp);
 
+    /* Do not make the daemon keep a removed file around for nothing. */
+    fuse_lck_mtx_lock(VTOFUD(vp)->fufh_mtx);
+    fuse_filehandle_unpark(vp, context);
+    fuse_lck_mtx_unlock(VTOFUD(vp)->fufh_mtx);
+
     err = fuse_internal_remove(dvp, vp, cnp, FUSE_UNLINK, context);
 
     if (err == 0) {
@@ -2504,6 +2805,8 @@ fuse_vnop_removexattr(struct vnop_removexattr_args *ap)
         fuse_ticket_drop(fdi.ticket);
         VTOFUD(vp)->c_flag |= C_TOUCH_CHGTIME;
         fuse_invalidate_attr(vp);
+        fuse_invalidate_access(vp);
+        fuse_invalidate_xattr(vp);
     } else {
         if (err == ENOSYS) {
             fuse_clear_implemented(data, FSESS_NOIMPLBIT(REMOVEXATTR));
@@ -2550,6 +2853,13 @@ fuse_vnop_rename(struct vnop_rename_args *ap)
 
     fuse_vncache_purge(fvp);
 
+    /* The target is about to be replaced; do not keep it open for nothing. */
+    if ((tvp != NULLVP) && (tvp != fvp)) {
+        fuse_lck_mtx_lock(VTOFUD(tvp)->fufh_mtx);
+        fuse_filehandle_unpark(tvp, context);
+        fuse_lck_mtx_unlock(VTOFUD(tvp)->fufh_mtx);
+    }
+
     err = fuse_internal_rename(fdvp, fvp, fcnp, tdvp, tvp, tcnp, ap->a_context);
 
     if (err == 0) {
@@ -2624,6 +2934,10 @@ fuse_vnop_rmdir(struct vnop_rmdir_args *ap)
 
     fuse_vncache_purge(vp);
 
+    fuse_lck_mtx_lock(VTOFUD(vp)->fufh_mtx);
+    fuse_filehandle_unpark(vp, context);
+    fuse_lck_mtx_unlock(VTOFUD(vp)->fufh_mtx);
+
     err = fuse_internal_remove(dvp, vp, cnp, FUSE_RMDIR, context);
 
     if (err == 0) {
@@ -2679,21 +2993,16 @@ fuse_vnop_setattr(struct vnop_setattr_args *ap)
     fuse_trace_printf_vnop();
 
     /*
-     * XXX: Locking
+     * Locking
      *
      * We need to worry about the file size changing in setattr(). If the call
      * is indeed altering the size, then:
      *
      * lock_exclusive(truncatelock)
-     *   lock(nodelock)
-     *     set the new size
-     *   unlock(nodelock)
+     *   tell the daemon
+     *   set the new size
      *   adjust ubc
-     *   lock(nodelock)
-     *     do cleanup
-     *   unlock(nodelock)
      * unlock(truncatelock)
-     * ...
      */
 
     if (fuse_isdeadfs(vp)) {
@@ -2713,6 +3022,10 @@ fuse_vnop_setattr(struct vnop_setattr_args *ap)
         goto out;
     }
 
+    if (sizechanged) {
+        fuse_lck_rw_lock_exclusive(VTOFUD(vp)->truncatelock);
+    }
+
     vtyp = vnode_vtype(vp);
 
     if (fsai->valid & FATTR_SIZE && vtyp == VDIR) {
@@ -2725,8 +3038,13 @@ fuse_vnop_setattr(struct vnop_setattr_args *ap)
         goto out;
     }
 
-    if ((err = fuse_dispatcher_wait_answer(&fdi))) {
+    err = fuse_dispatcher_wait_answer(&fdi);
+    fuse_invalidate_access(vp);
+    if (err) {
         fuse_invalidate_attr(vp);
+        if (sizechanged) {
+            fuse_lck_rw_done(VTOFUD(vp)->truncatelock);
+        }
         return err;
     }
 
@@ -2767,6 +3085,10 @@ out:
     if (!err && sizechanged) {
         VTOFUD(vp)->filesize = newsize;
         ubc_setsize(vp, (off_t)newsize);
+        fuse_invalidate_extents(vp);
+    }
+    if (sizechanged) {
+        fuse_lck_rw_done(VTOFUD(vp)->truncatelock);
     }
 
     return err;
@@ -2886,6 +3208,8 @@ fuse_vnop_setxattr(struct vnop_setxattr_args *ap)
     if (!err) {
         fuse_ticket_drop(fdi.ticket);
         fuse_invalidate_attr(vp);
+        fuse_invalidate_access(vp);
+        fuse_invalidate_xattr(vp);
         VTOFUD(vp)->c_flag |= C_TOUCH_CHGTIME;
     } else {
         if ((err == ENOSYS) || (err == ENOTSUP)) {
@@ -3019,32 +3343,25 @@ fuse_vnop_write(struct vnop_write_args *ap)
     off_t        original_offset;
     off_t        original_size;
     user_ssize_t original_resid;
+    bool         exclusive;
 
     struct fuse_vnode_data *fvdat;
+    struct fuse_filehandle *fufh;
 
     /*
-     * XXX: Locking
+     * Locking
      *
      * lock_shared(truncatelock)
-     * lock(nodelock)
      * if (file is being extended) {
-     *     unlock(nodelock)
      *     unlock(truncatelock)
      *     lock_exclusive(truncatelock)
-     *     lock(nodelock)
      *     current_size = the file's current size
      * }
-     * if (file is being extended) { // check again
-     *     // do whatever needs to be done to allocate storage
-     * }
-     * // We are always block-aligned
-     * unlock(nodelock)
      * call the cluster layer
      * adjust ubc
-     * lock(nodelock)
-     * do cleanup
-     * unlock(nodelock)
      * unlock(truncatelock)
+     *
+     * Writes within the file thus run alongside reads and each other.
      */
 
     fuse_trace_printf_vnop();
@@ -3078,16 +3395,16 @@ fuse_vnop_write(struct vnop_write_args *ap)
         return EINVAL;
     }
 
-    if (fuse_isdirectio(vp)) { /* direct_io */
-        fufh_type_t             fufh_type = FUFH_WRONLY;
-        struct fuse_dispatcher  fdi;
-        struct fuse_filehandle *fufh = NULL;
-        struct fuse_write_in   *fwi  = NULL;
-        struct fuse_write_out  *fwo  = NULL;
-        struct fuse_data       *data = fuse_get_mpdata(vnode_mount(vp));
+    if (fuse_islazyopen_mp(vnode_mount(vp))) {
+        /* May turn the vnode direct_io; see fuse_internal_open_late(). */
+        error = fuse_internal_open_late(vp, FUFH_WRONLY, context);
+        if (error) {
+            return error;
+        }
+    }
 
-        size_t chunksize;
-        off_t  diff;
+    if (fuse_isdirectio(vp)) { /* direct_io */
+        fufh_type_t fufh_type = FUFH_WRONLY;
 
         fufh = &(fvdat->fufh[fufh_type]);
 
@@ -3108,46 +3425,24 @@ fuse_vnop_write(struct vnop_write_args *ap)
             /* Using existing fufh of type fufh_type. */
         }
 
-        fuse_dispatcher_init(&fdi, 0);
-
-        while (uio_resid(uio) > 0) {
-            chunksize = min((size_t)uio_resid(uio), data->iosize);
-            fdi.iosize = sizeof(*fwi) + chunksize;
-            fuse_dispatcher_make_vp(&fdi, FUSE_WRITE, vp, context);
-            fwi = fdi.indata;
-            fwi->fh = fufh->fh_id;
-            fwi->offset = uio_offset(uio);
-            fwi->size = (uint32_t)chunksize;
-
-            error = uiomove((char *)fdi.indata + sizeof(*fwi), (int)chunksize,
-                            uio);
-            if (error) {
-                break;
-            }
-
-            error = fuse_dispatcher_wait_answer(&fdi);
-            if (error) {
-                return error;
-            }
-
-            fwo = (struct fuse_write_out *)fdi.answer;
-
-            diff = chunksize - fwo->size;
-            if (diff < 0) {
-                error = EINVAL;
-                break;
-            }
-
-            uio_setresid(uio, (uio_resid(uio) + diff));
-            uio_setoffset(uio, (uio_offset(uio) - diff));
+        fuse_lck_mtx_lock(fvdat->fufh_mtx);
+        error = fuse_filehandle_realize(vp, context, fufh_type);
+        fuse_lck_mtx_unlock(fvdat->fufh_mtx);
+        if (error) {
+            return error;
+        }
 
-        } /* while */
+        /* The daemon keeps the size; we only keep truncation out. */
+        fuse_lck_rw_lock_shared(fvdat->truncatelock);
+        error = fuse_internal_direct_write(vp, uio, fufh, context);
+        fuse_lck_rw_done(fvdat->truncatelock);
 
-        if (!error) {
+        if (uio_resid(uio) != original_resid) {
             fuse_invalidate_attr(vp);
         }
 
-        fuse_ticket_drop(fdi.ticket);
+        OSAddAtomic64((SInt64)(original_resid - uio_resid(uio)),
+                      (SInt64 *)&fuse_io_direct_bytes);
 
         return error;
 
@@ -3155,8 +3450,14 @@ fuse_vnop_write(struct vnop_write_args *ap)
 
     /* !direct_io */
 
+    fuse_vnode_inval_apply(vp);
+
     /* Be wary of a size change here. */
 
+    fuse_lck_rw_lock_shared(fvdat->truncatelock);
+    exclusive = false;
+
+again:
     original_size = fvdat->filesize;
 
     if (ioflag & IO_APPEND) {
@@ -3166,9 +3467,19 @@ fuse_vnop_write(struct vnop_write_args *ap)
     }
 
     if (offset < 0) {
+        fuse_lck_rw_done(fvdat->truncatelock);
         return EFBIG;
     }
 
+    /* Only a write that changes the size needs the file to itself. */
+    if (!exclusive && ((offset + original_resid > original_size) ||
+                       (ioflag & IO_APPEND))) {
+        fuse_lck_rw_done(fvdat->truncatelock);
+        fuse_lck_rw_lock_exclusive(fvdat->truncatelock);
+        exclusive = true;
+        goto again;
+    }
+
     if (offset + original_resid > original_size) {
         /* Need to extend the file. */
         filesize = offset + original_resid;
@@ -3194,8 +3505,17 @@ fuse_vnop_write(struct vnop_write_args *ap)
         zero_off = 0;
     }
 
-    error = cluster_write(vp, uio, (off_t)original_size, (off_t)filesize,
-                          (off_t)zero_off, (off_t)0, lflag);
+    fufh = fuse_internal_hybrid_fufh(vp, uio, true, context);
+    if (fufh) {
+        error = fuse_internal_direct_write(vp, uio, fufh, context);
+    } else {
+        error = cluster_write(vp, uio, (off_t)original_size, (off_t)filesize,
+                              (off_t)zero_off, (off_t)0, lflag);
+    }
+
+    OSAddAtomic64((SInt64)(original_resid - uio_resid(uio)),
+                  (SInt64 *)(fufh ? &fuse_io_direct_bytes
+                                  : &fuse_io_cached_bytes));
 
     if (!error) {
         if (uio_offset(uio) > original_size) {
@@ -3248,6 +3568,8 @@ fuse_vnop_write(struct vnop_write_args *ap)
     }
      */
 
+    fuse_lck_rw_done(fvdat->truncatelock);
+
     return error;
 }
 
@@ -3272,6 +3594,7 @@ fuse_vnop_ioctl(struct vnop_ioctl_args *ap)
     struct fuse_ioctl_in *fioi;
     struct fuse_data *data;
     mount_t mp;
+    int err;
 
     fuse_trace_printf_vnop_novp();
 
@@ -3281,6 +3604,20 @@ fuse_vnop_ioctl(struct vnop_ioctl_args *ap)
 
     CHECK_BLANKET_DENIAL(vp, context, EPERM);
 
+    /* lseek(2) with SEEK_HOLE or SEEK_DATA */
+    if ((ap->a_command == FSIOC_FIOSEEKHOLE) ||
+        (ap->a_command == FSIOC_FIOSEEKDATA)) {
+        return fuse_internal_seek_hole(vp, (off_t *)ap->a_data,
+                                       ap->a_command == FSIOC_FIOSEEKHOLE,
+                                       context);
+    }
+
+    if (ap->a_command == FUSE4XIOC_COPYRANGE) {
+        return fuse_internal_copy_range(vp,
+                                        (struct fuse_copyrange_args *)ap->a_data,
+                                        ap->a_fflag, context);
+    }
+
     mp = vnode_mount(vp);
     data = fuse_get_mpdata(mp);
 
@@ -3295,6 +3632,13 @@ fuse_vnop_ioctl(struct vnop_ioctl_args *ap)
         return EIO;
     }
 
+    fuse_lck_mtx_lock(VTOFUD(vp)->fufh_mtx);
+    err = fuse_filehandle_realize(vp, context, fufh_type);
+    fuse_lck_mtx_unlock(VTOFUD(vp)->fufh_mtx);
+    if (err) {
+        return err;
+    }
+
     const int iodata_size = (int)IOCPARM_LEN(ap->a_command);
     fuse_dispatcher_init(&fdi, sizeof(*fioi) + iodata_size);
     fuse_dispatcher_make_vp(&fdi, FUSE_IOCTL, vp, context);
@@ -3310,7 +3654,7 @@ fuse_vnop_ioctl(struct vnop_ioctl_args *ap)
         fioi->out_size = iodata_size;
     }
 
-    int err = fuse_dispatcher_wait_answer(&fdi);
+    err = fuse_dispatcher_wait_answer(&fdi);
 
     if (!err) {
         if (ap->a_command | IOC_OUT) {
@@ -3331,7 +3675,7 @@ typedef int (*fuse_vnode_op_t)(void *);
 
 struct vnodeopv_entry_desc fuse_vnode_operation_entries[] = {
     { &vnop_access_desc,        (fuse_vnode_op_t) fuse_vnop_access        },
-    { &vnop_allocate_desc,      (fuse_vnode_op_t) nop_allocate            }, // vnop stub until FUSE_FALLOCATE is implemented
+    { &vnop_allocate_desc,      (fuse_vnode_op_t) fuse_vnop_allocate      },
     { &vnop_blktooff_desc,      (fuse_vnode_op_t) fuse_vnop_blktooff      },
     { &vnop_blockmap_desc,      (fuse_vnode_op_t) fuse_vnop_blockmap      },
     { &vnop_close_desc,         (fuse_vnode_op_t) fuse_vnop_close         },
@@ -3356,6 +3700,7 @@ struct vnodeopv_entry_desc fuse_vnode_operation_entries[] = {
     { &vnop_pathconf_desc,      (fuse_vnode_op_t) fuse_vnop_pathconf      },
     { &vnop_read_desc,          (fuse_vnode_op_t) fuse_vnop_read          },
     { &vnop_readdir_desc,       (fuse_vnode_op_t) fuse_vnop_readdir       },
+    { &vnop_readdirattr_desc,   (fuse_vnode_op_t) fuse_vnop_readdirattr   },
     { &vnop_readlink_desc,      (fuse_vnode_op_t) fuse_vnop_readlink      },
     { &vnop_reclaim_desc,       (fuse_vnode_op_t) fuse_vnop_reclaim       },
     { &vnop_remove_desc,        (fuse_vnode_op_t) fuse_vnop_remove        },